@@ -0,0 +1,54 @@
+// cgroup_collector.h
+// This file defines the CgroupCollector class. See cgroup_collector.cpp for more information.
+
+#ifndef EPMON_CGROUP_COLLECTOR_H
+#define EPMON_CGROUP_COLLECTOR_H
+
+#include <map>
+#include <string>
+#include <vector>
+#include "monitor_options.h"
+
+// The data read from one cgroup's interface files in a single sampling round.
+struct cgroup_stat {
+    // False if the cgroup went away or its files couldn't be read.
+    bool valid;
+    // From cpu.stat.
+    unsigned long long usage_usec;
+    // From memory.current, in bytes.
+    unsigned long long memory_current;
+    // The "anon" and "file" entries of memory.stat, in bytes.
+    unsigned long long memory_anon;
+    unsigned long long memory_file;
+    // The rbytes and wbytes entries of io.stat, summed over all devices.
+    unsigned long long io_rbytes;
+    unsigned long long io_wbytes;
+};
+
+class CgroupCollector {
+public:
+    CgroupCollector();
+    ~CgroupCollector() = default;     // Nothing to clean up.
+
+    // Check that a cgroup v2 hierarchy is mounted. On failure, reason says why.
+    bool probe(std::string &reason);
+    // Return the absolute directory of the selected cgroup, or an empty string if it
+    // doesn't exist.
+    std::string resolve(const cgroup_selector &selector);
+    // Read the stats of each of the given cgroup directories.
+    void sample(const std::vector<std::string> &dirs, std::vector<cgroup_stat> &stats);
+
+private:
+    // Where the cgroup2 hierarchy is mounted.
+    std::string mount_point;
+    // Unit names we've already found, and the directories we found them in.
+    std::map<std::string, std::string> unit_dirs;
+
+    std::string find_unit(const std::string &dir, const std::string &unit, int depth);
+};
+
+// Calculate the CPU usage between two samples as a percentage of the total CPU time,
+// the same way calc_cpu_usage_pct() does for processes.
+double calc_cgroup_cpu_pct(const cgroup_stat &cur, const cgroup_stat &last, long unsigned int total_time_diff);
+
+#endif //EPMON_CGROUP_COLLECTOR_H
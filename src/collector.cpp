@@ -0,0 +1,322 @@
+// collector.cpp
+// This file implements the Collector interface and its backends. A Collector does the
+// process work for the Monitor in batches: one walk of /proc to match all the app names,
+// and one call to sample the stat data of all the matched processes, with a single read
+// of /proc/stat for the whole round. The parsing itself is shared by all the backends
+// (see process_info.cpp); the backends only differ in how they get the bytes out of /proc.
+// At startup select_collector() probes each backend, fastest first, and returns the first
+// one that works on the running kernel with our privileges. The backends are:
+//   pread - keeps /proc/<pid>/stat open between rounds and re-reads it with pread().
+//   stdio - the original fopen()/fscanf()/fclose() per file, which should work anywhere.
+// What It Doesn't Do
+// There are no io_uring, netlink (taskstats) or BPF backends. They need liburing, libnl
+// or libbpf, none of which this project uses, and taskstats and BPF also need privileges
+// we don't normally run with. A new backend only has to implement the Collector interface
+// and be added to the candidate list in select_collector().
+// Testing
+// The backends can be tested against each other: sampling the same PIDs with each should
+// give the same results, give or take the ticks that pass between the reads.
+
+#include "collector.h"
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define PROC_DIRECTORY          "/proc/"
+#define CPU_STAT_PATH           "/proc/stat"
+#define SELF_STAT_PATH          "/proc/self/stat"
+#define CASE_SENSITIVE          1
+#define CASE_INSENSITIVE        0
+#define MAX_PROCNAME_LEN        1024
+#define MAX_STATPATH_LEN        128
+#define MAX_STAT_LEN            1024
+// Big enough for the per-CPU lines of /proc/stat on a machine with a few hundred CPUs.
+#define CPU_STAT_LEN            65536
+// Don't hold more stat files open than this, so we stay well clear of the default
+// 1024 file descriptor limit no matter how many processes we sample.
+#define PREAD_MAX_CACHED_FDS    512
+// Close a stat file that hasn't been read in this many rounds. The Monitor makes a few
+// sample() calls per cycle with different sets of PIDs, so this can't be just one.
+#define PREAD_STALE_ROUNDS      8
+
+// An anonymous namespace for functions that don't need to be in the Collector classes.
+namespace {
+    // Only look at the first entry in the command line string, which should be the
+    // executable name. The arguments are NUL-separated, so the string already stops at
+    // the end of the first one, but some programs rewrite their command line with spaces.
+    void trim_cmdline(char *cmdline)
+    {
+        char *p = strchr(cmdline, ' ');
+        if (p != nullptr)
+            *p = '\0';
+    }
+}
+
+// Loop through the entries in the proc directory, collecting the directories with
+// names consisting of only digits.
+int Collector::enumerate(std::vector<pid_t> &pids)
+{
+    struct dirent *dir_entry = nullptr;
+
+    pids.clear();
+    DIR *dir_proc = opendir(PROC_DIRECTORY);
+    if (dir_proc == nullptr) {
+        perror("Unable to open the " PROC_DIRECTORY " directory.");
+        return -2;
+    }
+    while ( (dir_entry = readdir(dir_proc)) ) {
+        if (dir_entry->d_type == DT_DIR && IsNumeric(dir_entry->d_name)) {
+            pid_t pid = parse_pid(dir_entry->d_name);
+            if (pid > 0)
+                pids.push_back(pid);
+        }
+    }
+    closedir(dir_proc);
+    return 0;
+}
+
+int Collector::parse_cpu_stat(sample_round &round)
+{
+    if (parse_cpu_lines(cpu_stat_buf.data(), round.cpus) != 0)
+        return -1;
+    round.cpu_total_time = cpu_times_total(round.cpus[0]);
+    return 0;
+}
+
+// Walk the process list once, reading each process's command line and checking it
+// against every name that hasn't been matched yet. The executable name probably
+// contains the path info, which we may not have been given for the process we're
+// looking for, so this is a "contains" match. We stop early once every name is matched.
+int Collector::match(const std::vector<std::string> &names, std::vector<pid_t> &pids)
+{
+    char cmdline_path[MAX_STATPATH_LEN];
+    char proc_name[MAX_PROCNAME_LEN];
+    std::vector<pid_t> all_pids;
+    size_t unmatched = names.size();
+
+    pids.assign(names.size(), (pid_t) -1);
+    int ret = enumerate(all_pids);
+    if (ret != 0)
+        return ret;
+    for (pid_t pid : all_pids) {
+        if (unmatched == 0)
+            break;
+        snprintf(cmdline_path, MAX_STATPATH_LEN, "%s%d/cmdline", PROC_DIRECTORY, pid);
+        if (read_proc_file(cmdline_path, proc_name, MAX_PROCNAME_LEN) <= 0)
+            continue;
+        trim_cmdline(proc_name);
+        for (size_t ii = 0; ii < names.size(); ii++) {
+            if (pids[ii] < 0 && contains_proc_name(proc_name, names[ii].c_str(), CASE_INSENSITIVE)) {
+                pids[ii] = pid;
+                unmatched--;
+            }
+        }
+    }
+    return 0;
+}
+
+// Check that we can read and parse our own stat file.
+bool StdioCollector::probe(std::string &reason)
+{
+    char buf[MAX_STAT_LEN];
+    struct pstat ps = { 0 };
+
+    if (read_proc_file(SELF_STAT_PATH, buf, sizeof(buf)) <= 0 || parse_proc_stat(buf, &ps) != 0) {
+        reason = std::string("cannot read " SELF_STAT_PATH ": ") + strerror(errno);
+        return false;
+    }
+    return true;
+}
+
+ssize_t StdioCollector::read_proc_file(const char *path, char *buf, size_t len)
+{
+    FILE *proc_file = fopen(path, "r");
+    if (proc_file == nullptr)
+        return -1;
+    size_t nread = fread(buf, 1, len - 1, proc_file);
+    fclose(proc_file);
+    buf[nread] = '\0';
+    return (ssize_t) nread;
+}
+
+int StdioCollector::sample(const std::vector<pid_t> &pids, sample_round &round)
+{
+    char stat_filepath[MAX_STATPATH_LEN];
+    char buf[MAX_STAT_LEN];
+
+    round.procs.clear();
+    round.cpu_total_time = 0;
+    cpu_stat_buf.resize(CPU_STAT_LEN);
+    if (read_proc_file(CPU_STAT_PATH, cpu_stat_buf.data(), cpu_stat_buf.size()) <= 0 ||
+        parse_cpu_stat(round) != 0) {
+        perror("Failed to read " CPU_STAT_PATH " ");
+        return -1;
+    }
+    for (pid_t pid : pids) {
+        proc_sample ps = { pid, false, { 0 } };
+        ps.stat.cpu_total_time = round.cpu_total_time;
+        snprintf(stat_filepath, MAX_STATPATH_LEN, "%s%d/stat", PROC_DIRECTORY, pid);
+        if (read_proc_file(stat_filepath, buf, sizeof(buf)) > 0)
+            ps.valid = (parse_proc_stat(buf, &ps.stat) == 0);
+        round.procs.push_back(ps);
+    }
+    return 0;
+}
+
+PreadCollector::~PreadCollector()
+{
+    for (auto &entry : stat_fds)
+        close(entry.second.fd);
+    if (cpu_stat_fd >= 0)
+        close(cpu_stat_fd);
+}
+
+// Check that a kept-open stat file can be read more than once with pread().
+bool PreadCollector::probe(std::string &reason)
+{
+    char buf[MAX_STAT_LEN];
+    struct pstat ps = { 0 };
+
+    int fd = open(SELF_STAT_PATH, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        reason = std::string("cannot open " SELF_STAT_PATH ": ") + strerror(errno);
+        return false;
+    }
+    bool ok = true;
+    for (int ii = 0; ii < 2 && ok; ii++) {
+        ssize_t nread = pread(fd, buf, sizeof(buf) - 1, 0);
+        if (nread <= 0) {
+            reason = std::string("pread of " SELF_STAT_PATH " failed: ") + strerror(errno);
+            ok = false;
+        }
+        else {
+            buf[nread] = '\0';
+            if (parse_proc_stat(buf, &ps) != 0) {
+                reason = "cannot parse " SELF_STAT_PATH;
+                ok = false;
+            }
+        }
+    }
+    close(fd);
+    return ok;
+}
+
+// Files other than stat (the command lines) are only read once, so there's no point
+// keeping them open; we just skip the stdio layer.
+ssize_t PreadCollector::read_proc_file(const char *path, char *buf, size_t len)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    ssize_t nread = pread(fd, buf, len - 1, 0);
+    close(fd);
+    if (nread < 0)
+        return -1;
+    buf[nread] = '\0';
+    return nread;
+}
+
+// Return the descriptor to use for the given PID's stat file, opening it if needed.
+// cached is set to false if the descriptor isn't kept and the caller must close it.
+int PreadCollector::stat_fd(pid_t pid, bool &cached)
+{
+    char stat_filepath[MAX_STATPATH_LEN];
+
+    auto it = stat_fds.find(pid);
+    if (it != stat_fds.end()) {
+        cached = true;
+        it->second.last_round = round_count;
+        return it->second.fd;
+    }
+    snprintf(stat_filepath, MAX_STATPATH_LEN, "%s%d/stat", PROC_DIRECTORY, pid);
+    int fd = open(stat_filepath, O_RDONLY | O_CLOEXEC);
+    cached = (fd >= 0 && stat_fds.size() < PREAD_MAX_CACHED_FDS);
+    if (cached)
+        stat_fds[pid] = { fd, round_count };
+    return fd;
+}
+
+// Close the descriptors of processes we haven't been asked about for a while.
+void PreadCollector::close_stale_fds()
+{
+    for (auto it = stat_fds.begin(); it != stat_fds.end(); ) {
+        if (round_count - it->second.last_round > PREAD_STALE_ROUNDS) {
+            close(it->second.fd);
+            it = stat_fds.erase(it);
+        }
+        else
+            ++it;
+    }
+}
+
+int PreadCollector::sample(const std::vector<pid_t> &pids, sample_round &round)
+{
+    char buf[MAX_STAT_LEN];
+
+    round.procs.clear();
+    round.cpu_total_time = 0;
+    cpu_stat_buf.resize(CPU_STAT_LEN);
+    if (cpu_stat_fd < 0)
+        cpu_stat_fd = open(CPU_STAT_PATH, O_RDONLY | O_CLOEXEC);
+    ssize_t nread = (cpu_stat_fd >= 0) ? pread(cpu_stat_fd, cpu_stat_buf.data(), cpu_stat_buf.size() - 1, 0) : -1;
+    if (nread <= 0) {
+        perror("Failed to read " CPU_STAT_PATH " ");
+        return -1;
+    }
+    cpu_stat_buf[nread] = '\0';
+    if (parse_cpu_stat(round) != 0)
+        return -1;
+
+    round_count++;
+    close_stale_fds();
+    for (pid_t pid : pids) {
+        proc_sample ps = { pid, false, { 0 } };
+        ps.stat.cpu_total_time = round.cpu_total_time;
+        bool cached = false;
+        int fd = stat_fd(pid, cached);
+        if (fd >= 0) {
+            // A process that has exited gives ESRCH here, and if its PID has been reused
+            // the old descriptor still refers to the dead process, so either way we drop it.
+            nread = pread(fd, buf, sizeof(buf) - 1, 0);
+            if (nread > 0) {
+                buf[nread] = '\0';
+                ps.valid = (parse_proc_stat(buf, &ps.stat) == 0);
+            }
+            if (!cached)
+                close(fd);
+            else if (nread <= 0) {
+                close(fd);
+                stat_fds.erase(pid);
+            }
+        }
+        round.procs.push_back(ps);
+    }
+    return 0;
+}
+
+std::unique_ptr<Collector> select_collector(const std::shared_ptr<spdlog::logger> &logger)
+{
+    std::vector<std::unique_ptr<Collector>> candidates;
+    candidates.emplace_back(new PreadCollector());
+    candidates.emplace_back(new StdioCollector());
+
+    for (auto &candidate : candidates) {
+        std::string reason;
+        auto start = std::chrono::steady_clock::now();
+        bool ok = candidate->probe(reason);
+        auto probe_us = std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - start).count();
+        if (ok) {
+            logger->info("select_collector: using the {0} collector backend (probe took {1} us)",
+                         candidate->name(), probe_us);
+            return std::move(candidate);
+        }
+        logger->warn("select_collector: {0} collector backend unavailable: {1}", candidate->name(), reason);
+    }
+    logger->error("select_collector: no usable collector backend");
+    return nullptr;
+}
@@ -0,0 +1,108 @@
+// collector.h
+// This file defines the Collector interface and its backends. See collector.cpp for more information.
+
+#ifndef EPMON_COLLECTOR_H
+#define EPMON_COLLECTOR_H
+
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include <sys/types.h>
+#include <spdlog/spdlog.h>
+#include "process_info.h"
+
+// The data read for one process in a single sampling round.
+struct proc_sample {
+    pid_t pid;
+    // False if the process went away or its stat file couldn't be parsed.
+    bool valid;
+    struct pstat stat;
+};
+
+// The result of one call to Collector::sample(). The total CPU time comes from a single
+// read of /proc/stat made for the whole round, not one read per process. The per-CPU
+// times from the same read are kept for the host metrics (see host_metrics.cpp).
+struct sample_round {
+    long unsigned int cpu_total_time;
+    // cpus[0] is the total for all CPUs, cpus[n + 1] is CPU n.
+    std::vector<cpu_times> cpus;
+    std::vector<proc_sample> procs;
+};
+
+class Collector {
+public:
+    virtual ~Collector() = default;
+
+    // The backend name, for logging.
+    virtual const char *name() const = 0;
+    // Check that this backend works on the running kernel with our privileges. On
+    // failure, reason says why.
+    virtual bool probe(std::string &reason) = 0;
+    // Fill pids with every process currently listed in /proc.
+    virtual int enumerate(std::vector<pid_t> &pids);
+    // For each name, find the first process whose executable name contains it, in a
+    // single walk of /proc. pids gets one entry per name, -1 if there's no match.
+    virtual int match(const std::vector<std::string> &names, std::vector<pid_t> &pids);
+    // Read the stat data for each of the given PIDs, plus the total CPU time.
+    virtual int sample(const std::vector<pid_t> &pids, sample_round &round) = 0;
+
+protected:
+    // The buffer /proc/stat is read into. It has a line per CPU, so it doesn't fit on
+    // the stack as comfortably as the per-process files.
+    std::vector<char> cpu_stat_buf;
+
+    // Read a (small) /proc file into buf, NUL-terminated. Returns the number of bytes
+    // read, or -1 on error.
+    virtual ssize_t read_proc_file(const char *path, char *buf, size_t len) = 0;
+    // Parse the /proc/stat contents in cpu_stat_buf into the round.
+    int parse_cpu_stat(sample_round &round);
+};
+
+// The original implementation: every file is opened, read with stdio and closed again.
+class StdioCollector : public Collector {
+public:
+    const char *name() const override { return "stdio"; }
+    bool probe(std::string &reason) override;
+    int sample(const std::vector<pid_t> &pids, sample_round &round) override;
+
+protected:
+    ssize_t read_proc_file(const char *path, char *buf, size_t len) override;
+};
+
+// Keeps the stat files of sampled processes open between rounds and re-reads them
+// with pread(), so a round costs one syscall per process instead of three plus the
+// stdio buffer setup.
+class PreadCollector : public Collector {
+public:
+    ~PreadCollector() override;
+
+    const char *name() const override { return "pread"; }
+    bool probe(std::string &reason) override;
+    int sample(const std::vector<pid_t> &pids, sample_round &round) override;
+
+protected:
+    ssize_t read_proc_file(const char *path, char *buf, size_t len) override;
+
+private:
+    // An open /proc/<pid>/stat descriptor, and the last round it was read in.
+    struct cached_fd {
+        int fd;
+        unsigned long last_round;
+    };
+    // The open stat descriptors, by PID.
+    std::map<pid_t, cached_fd> stat_fds;
+    // The open /proc/stat descriptor.
+    int cpu_stat_fd = -1;
+    // Counts calls to sample().
+    unsigned long round_count = 0;
+
+    int stat_fd(pid_t pid, bool &cached);
+    void close_stale_fds();
+};
+
+// Probe the available backends, fastest first, and return the first one that works.
+// Returns nullptr if none of them do.
+std::unique_ptr<Collector> select_collector(const std::shared_ptr<spdlog::logger> &logger);
+
+#endif //EPMON_COLLECTOR_H
@@ -0,0 +1,116 @@
+// compress.cpp
+// This file implements the compression of the reports sent to the results server. The
+// reports are very repetitive (the same keys and app names in every entry), so they
+// compress well. gzip comes from zlib, which every curl build depends on anyway. zstd
+// is faster and usually compresses better, but libzstd is optional: the build defines
+// EPMON_HAVE_ZSTD when it finds the library, and without it zstd isn't offered.
+// The level is -1 for the library's default, or one from compression_levels(): 0 (store
+// only) to 9 for gzip, and 1 to ZSTD_maxCLevel() for zstd. The configuration is checked
+// against those when it's read (see monitor_config.cpp).
+// What It Doesn't Do
+// There's no dictionary support for zstd. A dictionary trained on our reports would
+// help a lot with small payloads, but the server would need the same dictionary.
+// Testing
+// Decompressing the output with gzip -d or zstd -d should give back the input.
+
+#include "compress.h"
+#include <zlib.h>
+#ifdef EPMON_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+// zlib's windowBits for a gzip wrapper rather than a zlib one: the largest window (15)
+// plus 16.
+#define GZIP_WINDOW_BITS    (15 + 16)
+// zlib's default memory level.
+#define GZIP_MEM_LEVEL      8
+
+// An anonymous namespace for functions that don't need to be visible outside this file.
+namespace {
+    bool gzip_compress(int level, const char *data, size_t len, std::string &out)
+    {
+        z_stream strm = {};
+        if (level < Z_NO_COMPRESSION || level > Z_BEST_COMPRESSION)
+            level = Z_DEFAULT_COMPRESSION;
+        if (deflateInit2(&strm, level, Z_DEFLATED, GZIP_WINDOW_BITS, GZIP_MEM_LEVEL, Z_DEFAULT_STRATEGY) != Z_OK)
+            return false;
+        // deflateBound() is for the zlib wrapper; the gzip one is a few bytes bigger.
+        out.resize(deflateBound(&strm, len) + 32);
+        strm.next_in = (Bytef *) data;
+        strm.avail_in = (uInt) len;
+        strm.next_out = (Bytef *) &out[0];
+        strm.avail_out = (uInt) out.size();
+        int ret = deflate(&strm, Z_FINISH);
+        out.resize(strm.total_out);
+        deflateEnd(&strm);
+        return ret == Z_STREAM_END;
+    }
+
+#ifdef EPMON_HAVE_ZSTD
+    bool zstd_compress(int level, const char *data, size_t len, std::string &out)
+    {
+        if (level < 1 || level > ZSTD_maxCLevel())
+            level = ZSTD_CLEVEL_DEFAULT;
+        out.resize(ZSTD_compressBound(len));
+        size_t ret = ZSTD_compress(&out[0], out.size(), data, len, level);
+        if (ZSTD_isError(ret))
+            return false;
+        out.resize(ret);
+        return true;
+    }
+#endif
+}
+
+bool have_zstd()
+{
+#ifdef EPMON_HAVE_ZSTD
+    return true;
+#else
+    return false;
+#endif
+}
+
+const char *content_encoding(compression_type type)
+{
+    switch (type) {
+        case compression_type::gzip:
+            return "gzip";
+        case compression_type::zstd:
+            return "zstd";
+        default:
+            return nullptr;
+    }
+}
+
+bool compression_levels(compression_type type, int &min_level, int &max_level)
+{
+    switch (type) {
+        case compression_type::gzip:
+            min_level = Z_NO_COMPRESSION;
+            max_level = Z_BEST_COMPRESSION;
+            return true;
+#ifdef EPMON_HAVE_ZSTD
+        case compression_type::zstd:
+            // zstd's negative "fast" levels aren't offered; -1 means the default here.
+            min_level = 1;
+            max_level = ZSTD_maxCLevel();
+            return true;
+#endif
+        default:
+            return false;
+    }
+}
+
+bool compress_payload(compression_type type, int level, const char *data, size_t len, std::string &out)
+{
+    switch (type) {
+        case compression_type::gzip:
+            return gzip_compress(level, data, len, out);
+#ifdef EPMON_HAVE_ZSTD
+        case compression_type::zstd:
+            return zstd_compress(level, data, len, out);
+#endif
+        default:
+            return false;
+    }
+}
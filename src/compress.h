@@ -0,0 +1,22 @@
+// compress.h
+// This file defines the payload compression helpers. See compress.cpp for more information.
+
+#ifndef EPMON_COMPRESS_H
+#define EPMON_COMPRESS_H
+
+#include <cstddef>
+#include <string>
+#include "monitor_options.h"
+
+// Whether this build can compress with zstd.
+bool have_zstd();
+// The Content-Encoding header value for the compression type, or nullptr for none.
+const char *content_encoding(compression_type type);
+// The levels the compression type takes, other than -1 for the library's default.
+// Returns false if it doesn't take any.
+bool compression_levels(compression_type type, int &min_level, int &max_level);
+// Compress len bytes of data into out. Returns false if it didn't work, in which case
+// the data should be sent as it is.
+bool compress_payload(compression_type type, int level, const char *data, size_t len, std::string &out);
+
+#endif //EPMON_COMPRESS_H
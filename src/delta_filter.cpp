@@ -0,0 +1,119 @@
+// delta_filter.cpp
+// This file implements the DeltaFilter class, which lets the Monitor send only the
+// results that changed. Most monitored apps are idle most of the time, so most cycles
+// send the same near-zero CPU and the same memory for them again. With delta reporting
+// turned on (see "delta" in monitor_config.cpp) the Monitor runs each round's results
+// through the filter before they're written, and the filter drops every entry whose
+// numbers are all within epsilon of the last values it sent for that app.
+// A value has changed if it moved by more than epsilon times the larger of the old and
+// new values, or times 1 for values under 1. So an epsilon of 0.05 means a 5% change in
+// memory or I/O, or 0.05 percentage points of CPU near zero. The comparison is with the
+// last values sent, not the last seen, so a slow drift is sent once it adds up. A new
+// PID (the app restarted) always counts as a change. The cgroup pressure isn't compared,
+// its totals change all the time, but it's sent along with a cgroup that changed.
+// Every keyframe_interval reports the filter sends a keyframe: every result, whether it
+// changed or not, so the results server can start over from a known state. The first
+// report after delta reporting is turned on is a keyframe too. Each report says which
+// kind it is in a "delta" member:
+//   "delta": { "keyframe": true }
+//   "delta": { "keyframe": false, "unchanged": 12,
+//              "removed": [ { "app": "bash", "PID": 2544 },
+//                           { "app": "nginx", "cgroup": "/sys/fs/cgroup/..." } ] }
+// where "removed" lists the apps that were sent before but weren't found this time, so
+// the server doesn't mistake them for unchanged ones.
+// What It Doesn't Do
+// The collector still samples every app every cycle; only what's sent is reduced.
+// If a delta report is lost (dropped from a full send queue, or evicted from the spool)
+// the server is out of date for those apps until the next keyframe.
+
+#include "delta_filter.h"
+#include <algorithm>
+#include <cmath>
+#include <set>
+
+// An anonymous namespace for functions that don't need to be in the DeltaFilter class itself.
+namespace {
+    // Processes and cgroups can have the same name, so keep them apart.
+    std::string result_key(const app_result &result)
+    {
+        return (result.is_cgroup ? "cgroup:" : "process:") + result.app;
+    }
+
+    bool value_changed(double last, double cur, double epsilon)
+    {
+        double scale = std::max(1.0, std::max(std::fabs(last), std::fabs(cur)));
+        return std::fabs(cur - last) > epsilon * scale;
+    }
+
+    bool result_changed(const app_result &last, const app_result &cur, double epsilon)
+    {
+        if (last.pid != cur.pid || last.cgroup != cur.cgroup)
+            return true;
+        if (value_changed(last.cpu, cur.cpu, epsilon) || value_changed(last.memory, cur.memory, epsilon))
+            return true;
+        return cur.is_cgroup && (value_changed(last.memory_anon, cur.memory_anon, epsilon) ||
+                                 value_changed(last.memory_file, cur.memory_file, epsilon) ||
+                                 value_changed(last.io_read, cur.io_read, epsilon) ||
+                                 value_changed(last.io_write, cur.io_write, epsilon));
+    }
+}
+
+DeltaFilter::DeltaFilter()
+    : since_keyframe(0)
+{
+}
+
+json DeltaFilter::filter(std::vector<app_result> &results, double epsilon, unsigned int keyframe_interval)
+{
+    if (keyframe_interval <= 1) {
+        // Turned off. Start with a keyframe if it's turned on again.
+        last_sent.clear();
+        since_keyframe = 0;
+        return json();
+    }
+    if (last_sent.empty() || ++since_keyframe >= keyframe_interval) {
+        last_sent.clear();
+        for (const app_result &result : results)
+            last_sent[result_key(result)] = result;
+        since_keyframe = 0;
+        return {{"keyframe", true}};
+    }
+
+    std::set<std::string> seen;
+    size_t unchanged = 0;
+    auto keep = results.begin();
+    for (auto it = results.begin(); it != results.end(); ++it) {
+        std::string key = result_key(*it);
+        seen.insert(key);
+        auto last = last_sent.find(key);
+        if (last != last_sent.end() && !result_changed(last->second, *it, epsilon)) {
+            unchanged++;
+            continue;
+        }
+        last_sent[key] = *it;
+        if (keep != it)
+            *keep = std::move(*it);
+        ++keep;
+    }
+    results.erase(keep, results.end());
+
+    json removed = json::array();
+    for (auto it = last_sent.begin(); it != last_sent.end(); ) {
+        if (seen.count(it->first)) {
+            ++it;
+            continue;
+        }
+        if (it->second.is_cgroup)
+            removed.push_back({{"app", it->second.app}, {"cgroup", it->second.cgroup}});
+        else
+            removed.push_back({{"app", it->second.app}, {"PID", it->second.pid}});
+        it = last_sent.erase(it);
+    }
+    json jres = {
+            {"keyframe", false},
+            {"unchanged", unchanged},
+    };
+    if (!removed.empty())
+        jres["removed"] = removed;
+    return jres;
+}
@@ -0,0 +1,30 @@
+// delta_filter.h
+// This file defines the DeltaFilter class. See delta_filter.cpp for more information.
+
+#ifndef EPMON_DELTA_FILTER_H
+#define EPMON_DELTA_FILTER_H
+
+#include <map>
+#include <string>
+#include <vector>
+#include "results.h"
+
+class DeltaFilter {
+public:
+    DeltaFilter();
+    ~DeltaFilter() = default;     // Nothing to clean up.
+
+    // Take the results that haven't changed by more than epsilon since they were last
+    // sent out of results, unless it's time for a keyframe, and return the "delta" member
+    // for the report. A keyframe is sent every keyframe_interval calls; an interval of 1
+    // turns the filter off, and then it returns null and leaves results alone.
+    json filter(std::vector<app_result> &results, double epsilon, unsigned int keyframe_interval);
+
+private:
+    // The last results sent, by app.
+    std::map<std::string, app_result> last_sent;
+    // Reports since the last keyframe.
+    unsigned int since_keyframe;
+};
+
+#endif //EPMON_DELTA_FILTER_H
@@ -0,0 +1,71 @@
+// encode_bench.cpp
+// This is a benchmark of the binary result formats. For rounds of 10, 100 and 1000 made-up
+// results it times encoding the report as CBOR and as MessagePack, the way the Monitor
+// does (report_to_json() and then json::to_cbor() or json::to_msgpack()), against writing
+// it as JSON text with dump(), and prints how long each took and how big it was:
+//   apps  format      usec/report   bytes  vs dump()
+//   10    json dump()        ...      ...    100.0%
+//   10    cbor               ...      ...     ...%
+// Each encoding is repeated until it has run for about ENCODE_BENCH_MIN_MSEC, and the
+// average time is reported. The timestamp is the rfc3339 string, the biggest of them.
+// Usage: encode_bench [min_msec]
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <string>
+#include <vector>
+#include "results.h"
+#include "sample_results.h"
+
+#define ENCODE_BENCH_MIN_MSEC   500
+
+// An anonymous namespace for functions that don't need to be visible outside this file.
+namespace {
+    // Run encode over and over for at least min_msec, and return the average time per
+    // run in microseconds, and the size of what it made.
+    double time_encoding(const std::function<void(std::string &)> &encode, long min_msec, size_t &size)
+    {
+        auto start = std::chrono::steady_clock::now();
+        auto min_time = std::chrono::milliseconds(min_msec);
+        long runs = 0;
+        std::chrono::steady_clock::duration elapsed;
+        do {
+            std::string out;
+            encode(out);
+            size = out.size();
+            runs++;
+            elapsed = std::chrono::steady_clock::now() - start;
+        } while (elapsed < min_time);
+        return std::chrono::duration<double, std::micro>(elapsed).count() / runs;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    long min_msec = argc > 1 ? strtol(argv[1], nullptr, 10) : ENCODE_BENCH_MIN_MSEC;
+    json timestamp = format_timestamp(time_format::rfc3339, std::chrono::system_clock::now());
+    json extra = json::object();
+    static const size_t counts[] = { 10, 100, 1000 };
+
+    printf("%-6s %-12s %12s %10s %10s\n", "apps", "format", "usec/report", "bytes", "vs dump()");
+    for (size_t count : counts) {
+        std::vector<app_result> results = make_sample_results(count);
+        size_t dump_size = 0;
+        size_t size = 0;
+        double usec = time_encoding([&](std::string &out) {
+            out = report_to_json(results, timestamp, results_layout::rows, extra).dump();
+        }, min_msec, dump_size);
+        printf("%-6zu %-12s %12.1f %10zu %9.1f%%\n", count, "json dump()", usec, dump_size, 100.0);
+        usec = time_encoding([&](std::string &out) {
+            json::to_cbor(report_to_json(results, timestamp, results_layout::rows, extra), out);
+        }, min_msec, size);
+        printf("%-6zu %-12s %12.1f %10zu %9.1f%%\n", count, "cbor", usec, size, 100.0 * size / dump_size);
+        usec = time_encoding([&](std::string &out) {
+            json::to_msgpack(report_to_json(results, timestamp, results_layout::rows, extra), out);
+        }, min_msec, size);
+        printf("%-6zu %-12s %12.1f %10zu %9.1f%%\n", count, "msgpack", usec, size, 100.0 * size / dump_size);
+    }
+    return 0;
+}
@@ -3,9 +3,14 @@
 // implemented for Ubuntu Linux. At least that's what I'm using; it may work on other Linux
 // flavors as well.
 // The work is done by two classes, MonitorConfig (for reading the list of apps to monitor), and
-// Monitor (for getting process info and sending it to the results server). The main function
-// checks for loop interval parameters passed on the command line (with some simple error handling)
-// but has default values, so command line parameters are not required.
+// Monitor (for getting process info and sending it to the results server). Monitor hands its
+// reports to a ResultsSender, which does the actual sending on a thread of its own, and to a
+// results sink for each of the other destinations given on the command line. EventWatcher
+// sends OOM and pids-limit events for monitored cgroups as they happen, and MetricsServer
+// serves the latest results at /metrics for Prometheus to scrape, if the configuration turns
+// it on. The main function checks for loop interval parameters passed on the command line
+// (with some simple error handling) but has default values, so command line parameters are
+// not required.
 // There are two data objects defined: a vector of strings to contain the names of applications
 // to monitor, and a mutex for data locking. See the class implementation files for more on the
 // use of this shared data.
@@ -40,6 +45,9 @@
 #include <spdlog/async.h>
 #include "monitor_config.h"
 #include "monitor.h"
+#include "event_watcher.h"
+#include "results_sink.h"
+#include "http_client.h"
 
 using json = nlohmann::json;
 
@@ -56,6 +64,9 @@ using json = nlohmann::json;
 // This is the list of applications to monitor. It is shared by the MonitorConfig
 // and Monitor classes.
 std::vector<std::string> app_list;
+// These are the monitoring options from the configuration server, also shared by the
+// MonitorConfig and Monitor classes.
+Monitor_options monitor_options;
 // This is the mutex shared by the MonitorConfig and Monitor classes.
 std::mutex data_lock;
 // The logger. The threads can retrieve this themselves by name.
@@ -73,6 +84,8 @@ struct Ep_config
     std::string config_server_url;
     // The results server URL.
     std::string results_server_url;
+    // Where else to send the results (see results_sink.cpp).
+    std::vector<std::string> other_destinations;
 
     Ep_config() {
         config_update_interval = CONFIG_UPDATE_INTERVAL_DEFAULT;
@@ -104,10 +117,13 @@ namespace {
 
     // Look for configuration parameters on the command line. The expected format is
     // epmon [config read interval] [monitor interval] [configuration server URL] [results server URL]
+    //       [other destination]...
     // where the interval values are seconds such that:
     //     1 <= [config read interval] <= 1800
     //     1 <= [monitor interval] <= 600
-    // You must pass all parameters.
+    // You must pass the first four parameters. Any more are other places to send the
+    // results to: more URLs, stream+URL, file:PATH, udp://HOST:PORT, unix:PATH,
+    // statsd://HOST:PORT or influx://HOST:PORT. The results server URL can be any of these too.
     // If we fail to read values, use the default values defined above. This is not awesome
     // for the URLs but it's all I have time for.
     // This is really brain-dead brute force parameter handling, and there's no error-checking
@@ -117,12 +133,14 @@ namespace {
         // If argc is zero, there's no need to check anything, we'll just use
         // the initialized default values.
         if (argc > 1) {
-            if (argc != 5) {
+            if (argc < 5) {
                 std::cerr << "ERROR: invalid number of parameters (" << argc - 1 << "). Expected four values:\n"
                           << "\tconfiguration update interval\n"
                           << "\tmonitor interval\n"
                           << "\tconfiguration server URL\n"
                           << "\tresults server URL\n"
+                          << "and optionally other destinations for the results (URL, stream+URL, file:PATH, "
+                          << "udp://HOST:PORT, unix:PATH, statsd://HOST:PORT or influx://HOST:PORT)\n"
                           << "Using default values:\n"
                           << "\tconfiguration update interval: " << CONFIG_UPDATE_INTERVAL_DEFAULT
                           << "\n\tmonitor interval: " << MONITOR_UPDATE_INTERVAL_DEFAULT
@@ -184,6 +202,8 @@ namespace {
             // Yes indeed, we really ought to have some kind of error checking / validation here, but...
             cfg.config_server_url.assign(argv[3]);
             cfg.results_server_url.assign(argv[4]);
+            for (int ii = 5; ii < argc; ii++)
+                cfg.other_destinations.push_back(argv[ii]);
         }
     }
 
@@ -229,6 +249,10 @@ int main(int argc, char *argv[])
     // The curl library initialization must happen only once, and since we can't
     // guarantee which thread might get there first, we'll do it here.
     curl_global_init(CURL_GLOBAL_ALL);
+    // The threads share DNS and TLS session caches, which have to be set up before any of
+    // them creates its HttpClient.
+    if (!http_share_init())
+        std::cerr << "curl share initialization failed, continuing without shared caches." << std::endl;
 
     // Initialize logging.
     if (!init_logger()) {
@@ -241,24 +265,78 @@ int main(int argc, char *argv[])
               << "\tconfiguration update interval: " << prog_config.config_update_interval
               << "\n\tmonitor interval: " << prog_config.monitor_interval
               << "\n\tconfiguration server URL: " << prog_config.config_server_url
-              << "\n\tresults server URL: " << prog_config.results_server_url
-              << "\nLog file is logs/epmon_log.txt"
+              << "\n\tresults server URL: " << prog_config.results_server_url;
+    for (auto &dest : prog_config.other_destinations)
+        std::cout << "\n\tother destination: " << dest;
+    std::cout << "\nLog file is logs/epmon_log.txt"
               << "\nPress Ctrl-C to quit." << std::endl;
     logger->info("Begin epmon with config interval {0}, monitor interval {1}, config server {2}, results server {3}",
                  prog_config.config_update_interval, prog_config.monitor_interval,
                  prog_config.config_server_url, prog_config.results_server_url);
     // start monitor configuration thread
     logger->info("Starting MonitorConfig thread");
-    MonitorConfig monitor_config(prog_config.config_update_interval, prog_config.config_server_url, &app_list, data_lock);
+    MonitorConfig monitor_config(prog_config.config_update_interval, prog_config.config_server_url, &app_list,
+                                 &monitor_options, data_lock);
     std::thread monitor_config_thread = monitor_config.run();
 
+    // start a thread for each results sink, which the Monitor queues its reports for: the
+    // results server first, then any other destinations
+    std::vector<std::string> destinations(1, prog_config.results_server_url);
+    destinations.insert(destinations.end(), prog_config.other_destinations.begin(),
+                        prog_config.other_destinations.end());
+    std::vector<std::unique_ptr<ResultsSink>> sinks;
+    std::vector<ResultsSink *> sink_ptrs;
+    std::vector<std::thread> sink_threads;
+    for (auto &dest : destinations) {
+        std::unique_ptr<ResultsSink> sink = make_results_sink(dest, sinks.size());
+        if (!sink) {
+            std::cerr << "ERROR: can't send results to " << dest << ", ignoring it." << std::endl;
+            continue;
+        }
+        logger->info("Starting results sink thread for {0}", dest);
+        sink_threads.push_back(sink->run());
+        sink_ptrs.push_back(sink.get());
+        sinks.push_back(std::move(sink));
+    }
+    if (sinks.empty()) {
+        std::cerr << "No usable results destination, terminating." << std::endl;
+        exit(-1);
+    }
+
+    // start the /metrics server thread, which the Monitor publishes each round to
+    logger->info("Starting MetricsServer thread");
+    MetricsServer metrics_server(&monitor_options, data_lock);
+    std::thread metrics_server_thread = metrics_server.run();
+
     // start monitor thread
     logger->info("Starting Monitor thread");
-    Monitor monitor(prog_config.monitor_interval, prog_config.results_server_url, &app_list, data_lock);
+    Monitor monitor(prog_config.monitor_interval, sink_ptrs, &metrics_server, &app_list, &monitor_options,
+                    data_lock);
     std::thread monitor_thread = monitor.run();
 
+    // start cgroup event watcher thread, which POSTs its events to the first destination
+    // that is an HTTP server
+    std::string events_url;
+    for (auto sink : sink_ptrs) {
+        events_url = http_destination_url(sink->name());
+        if (!events_url.empty())
+            break;
+    }
+    if (events_url.empty()) {
+        std::cerr << "WARNING: no http(s) results destination, cgroup and PSI events won't be sent." << std::endl;
+        logger->warn("No http(s) results destination, cgroup and PSI events won't be sent");
+    }
+    logger->info("Starting EventWatcher thread, sending events to {0}", events_url);
+    EventWatcher event_watcher(events_url, &monitor_options, data_lock);
+    std::thread event_watcher_thread = event_watcher.run();
+
     monitor_config_thread.join();
     monitor_thread.join();
+    for (auto &thread : sink_threads)
+        thread.join();
+    event_watcher_thread.join();
+    metrics_server_thread.join();
+    http_share_cleanup();
 
     return 0;
 }
@@ -0,0 +1,185 @@
+// epmon_shm.h
+// This file defines the layout of the shared-memory snapshot epmon publishes the latest
+// results in (see shm_publisher.cpp), and EpmonShmReader, a header-only reader for it.
+// A program on the same host that wants the latest CPU and memory of the monitored apps
+// can include just this file, with no other part of epmon, and read them straight out of
+// shared memory: no HTTP, no syscall per read, and never in the way of the writer.
+//   EpmonShmReader reader;
+//   epmon_shm_entry entry;
+//   if (reader.open() && reader.find("nginx", entry))
+//       use(entry.cpu, entry.memory);
+// The segment is protected by a seqlock. The writer makes seq odd, changes the data, then
+// makes it even again. A reader notes seq, copies what it wants, and checks that seq is
+// still the same even number; if not, the writer got in the way and it tries again. The
+// writer never waits for readers, and readers only ever wait out one write.
+// Link with -lrt on systems where shm_open() isn't in libc.
+
+#ifndef EPMON_SHM_H
+#define EPMON_SHM_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define EPMON_SHM_DEFAULT_NAME  "/epmon"
+// "EPMN", and the layout version. The version goes up if the layout ever changes.
+#define EPMON_SHM_MAGIC         0x4e4d5045u
+#define EPMON_SHM_VERSION       1
+#define EPMON_SHM_MAX_ENTRIES   1024
+#define EPMON_SHM_APP_LEN       64
+// Set in an entry's flags if it's a cgroup rather than a process.
+#define EPMON_SHM_CGROUP        0x1u
+// How long a reader spins waiting for a write to finish before giving up. A write takes
+// microseconds; this is only reached if epmon died in the middle of one.
+#define EPMON_SHM_SPIN_MAX      (1 << 24)
+
+// One monitored app or cgroup.
+struct epmon_shm_entry {
+    // The app name, NUL-terminated, cut short if it doesn't fit.
+    char app[EPMON_SHM_APP_LEN];
+    // The process, or 0 for a cgroup.
+    int32_t pid;
+    uint32_t flags;
+    // CPU usage (percent) and memory (Kbytes), as in the reports.
+    double cpu;
+    double memory;
+};
+
+struct epmon_shm_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t entry_size;
+    uint32_t max_entries;
+    // The seqlock: odd while the writer is changing the rest of the segment.
+    std::atomic<uint64_t> seq;
+    // When the round was sampled, and how many rounds have been published.
+    uint64_t timestamp_ns;
+    uint64_t rounds;
+    // The number of entries in use.
+    uint32_t count;
+    uint32_t reserved;
+};
+
+struct epmon_shm_segment {
+    epmon_shm_header header;
+    epmon_shm_entry entries[EPMON_SHM_MAX_ENTRIES];
+};
+
+class EpmonShmReader {
+public:
+    EpmonShmReader() : segment(nullptr) {}
+    ~EpmonShmReader() { close(); }
+    EpmonShmReader(const EpmonShmReader &) = delete;
+    EpmonShmReader &operator=(const EpmonShmReader &) = delete;
+
+    // Map the segment. Returns false if epmon hasn't created it, or it's a layout this
+    // reader doesn't know.
+    bool open(const char *name = EPMON_SHM_DEFAULT_NAME)
+    {
+        close();
+        int fd = shm_open(name, O_RDONLY | O_CLOEXEC, 0);
+        if (fd < 0)
+            return false;
+        struct stat st;
+        void *addr = MAP_FAILED;
+        if (fstat(fd, &st) == 0 && (size_t) st.st_size >= sizeof(epmon_shm_segment))
+            addr = mmap(nullptr, sizeof(epmon_shm_segment), PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (addr == MAP_FAILED)
+            return false;
+        segment = static_cast<const epmon_shm_segment *>(addr);
+        if (segment->header.magic != EPMON_SHM_MAGIC || segment->header.version != EPMON_SHM_VERSION ||
+            segment->header.entry_size != sizeof(epmon_shm_entry)) {
+            close();
+            return false;
+        }
+        return true;
+    }
+
+    void close()
+    {
+        if (segment)
+            munmap(const_cast<epmon_shm_segment *>(segment), sizeof(epmon_shm_segment));
+        segment = nullptr;
+    }
+
+    // Copy the latest entry for an app, and optionally when it was sampled. Returns false
+    // if the app isn't in the latest round.
+    bool find(const char *app, epmon_shm_entry &entry, uint64_t *timestamp_ns = nullptr) const
+    {
+        uint64_t seq;
+        while (begin_read(seq)) {
+            bool found = false;
+            uint32_t count = segment->header.count;
+            if (count > EPMON_SHM_MAX_ENTRIES)
+                count = EPMON_SHM_MAX_ENTRIES;
+            for (uint32_t ii = 0; ii < count && !found; ii++) {
+                if (strncmp(segment->entries[ii].app, app, EPMON_SHM_APP_LEN) == 0) {
+                    memcpy(&entry, &segment->entries[ii], sizeof(entry));
+                    found = true;
+                }
+            }
+            uint64_t when = segment->header.timestamp_ns;
+            if (end_read(seq)) {
+                entry.app[EPMON_SHM_APP_LEN - 1] = '\0';
+                if (timestamp_ns)
+                    *timestamp_ns = when;
+                return found;
+            }
+        }
+        return false;
+    }
+
+    // Copy the whole latest round: up to max entries, returning how many there were.
+    uint32_t read_all(epmon_shm_entry *entries, uint32_t max, uint64_t *timestamp_ns = nullptr) const
+    {
+        uint64_t seq;
+        while (begin_read(seq)) {
+            uint32_t count = segment->header.count;
+            if (count > EPMON_SHM_MAX_ENTRIES)
+                count = EPMON_SHM_MAX_ENTRIES;
+            if (count > max)
+                count = max;
+            memcpy(entries, segment->entries, count * sizeof(epmon_shm_entry));
+            uint64_t when = segment->header.timestamp_ns;
+            if (end_read(seq)) {
+                for (uint32_t ii = 0; ii < count; ii++)
+                    entries[ii].app[EPMON_SHM_APP_LEN - 1] = '\0';
+                if (timestamp_ns)
+                    *timestamp_ns = when;
+                return count;
+            }
+        }
+        return 0;
+    }
+
+private:
+    const epmon_shm_segment *segment;
+
+    // Wait out a write in progress, and get the sequence number to check against. Returns
+    // false if there's no segment, or the write never finishes.
+    bool begin_read(uint64_t &seq) const
+    {
+        if (!segment)
+            return false;
+        for (long spins = 0; spins < EPMON_SHM_SPIN_MAX; spins++) {
+            seq = segment->header.seq.load(std::memory_order_acquire);
+            if ((seq & 1) == 0)
+                return true;
+        }
+        return false;
+    }
+
+    // True if nothing was written while we were reading.
+    bool end_read(uint64_t seq) const
+    {
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return segment->header.seq.load(std::memory_order_relaxed) == seq;
+    }
+};
+
+#endif //EPMON_SHM_H
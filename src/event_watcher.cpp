@@ -0,0 +1,375 @@
+// event_watcher.cpp
+// This file implements the EventWatcher class. This class is responsible for noticing
+// OOM kills and pids-limit hits in the monitored cgroups as soon as they happen, instead
+// of at the next monitoring interval (or never, if the service restarts quickly enough
+// that the next sample looks normal).
+// With cgroup v2 the kernel keeps event counters in each group's memory.events and
+// pids.events files, and generates an inotify modify event on the file whenever one of
+// them changes. So we put a watch on those files for every monitored cgroup and wait
+// for events with poll(). When a file changes we read it, compare the counters we care
+// about with the last values we saw, and if any of them went up we POST an event to
+// the results server (or, if that isn't an HTTP server, the first destination that is;
+// see http_destination_url() in results_sink.cpp) right away:
+// { "events" : [
+//   { "app": "nginx",
+//     "timestamp": "Mon Nov 22 15:02:51 2021",
+//     "cgroup": "/sys/fs/cgroup/system.slice/nginx.service",
+//     "event": "oom_kill",
+//     "count": 3,
+//     "increase": 1 }
+//   ]
+// }
+// The same poll() also waits on the configured Pressure Stall Information triggers (see
+// pressure.cpp). The kernel signals a trigger's descriptor when the stall time passes its
+// threshold within its window, and we send a "psi" event with the current averages:
+//   { "app": "nginx", "timestamp": ..., "event": "psi", "resource": "memory", "type": "some",
+//     "threshold_us": 150000, "window_us": 1000000, "avg10": 12.5 }
+// System-wide triggers are reported with "app": "system".
+// The timestamps are written in the same format as the monitoring results'.
+// The lists of cgroups and triggers come from the same shared options as the Monitor's,
+// so every EVENT_REFRESH_INTERVAL seconds we copy them (holding the shared mutex, as the
+// Monitor does) and add or remove watches and triggers to match.
+// The only public method is the run() method, which starts a thread running the private
+// watch_loop() method. This method runs forever.
+// What It Doesn't Do
+// With no http(s) destination at all, there's nowhere to send events, so nothing is
+// watched. Only cgroups selected in the configuration are watched; processes monitored
+// by name don't have events files of their own. Events that happen between a cgroup
+// being added to the configuration and the next refresh are missed, since we take the
+// counter values at that point as the baseline.
+// Testing
+// A cgroup with a low memory.max and a process that allocates past it will produce an
+// oom_kill event; a low pids.max and a fork loop will produce a max event.
+
+#include "event_watcher.h"
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cstring>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#include "http_client.h"
+#include "pressure.h"
+#include "results.h"
+
+// The number of seconds between checks for changes to the list of monitored cgroups.
+#define EVENT_REFRESH_INTERVAL  5
+#define EVENTS_FILE_LEN         1024
+#define INOTIFY_BUF_LEN         (16 * (sizeof(struct inotify_event) + NAME_MAX + 1))
+
+// An anonymous namespace for functions that don't need to be in the EventWatcher class itself.
+namespace {
+    // The events files we watch in each cgroup, and the counters in them we report.
+    struct events_file {
+        const char *file;
+        std::vector<const char *> keys;
+    };
+    const std::vector<events_file> watched_events = {
+            { "memory.events", { "oom", "oom_kill" } },
+            { "pids.events", { "max" } },
+    };
+
+    // Read the "key value" lines of a cgroup events file.
+    bool read_counters(const std::string &path, std::map<std::string, unsigned long long> &counters)
+    {
+        char buf[EVENTS_FILE_LEN];
+        char key[64];
+        unsigned long long value;
+
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            return false;
+        ssize_t nread = read(fd, buf, sizeof(buf) - 1);
+        close(fd);
+        if (nread < 0)
+            return false;
+        buf[nread] = '\0';
+        counters.clear();
+        for (char *line = strtok(buf, "\n"); line; line = strtok(nullptr, "\n")) {
+            if (sscanf(line, "%63s %llu", key, &value) == 2)
+                counters[key] = value;
+        }
+        return true;
+    }
+}
+
+// The constructor sets up the inotify instance; the watches are added once the thread
+// is running and has read the list of cgroups.
+EventWatcher::EventWatcher(std::string url, Monitor_options *options, std::mutex &mut)
+    : results_url(std::move(url)), shared_options(options), data_lock(mut), max_payload_bytes(MAX_PAYLOAD_BYTES_DEFAULT),
+      timestamp_format(time_format::ctime)
+{
+    // Get the shared logger pointer.
+    logger = spdlog::get("epmon");
+    std::string reason;
+    have_cgroups = cgroup_collector.probe(reason);
+    inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd < 0)
+        logger->error("EventWatcher: inotify_init1 failed: {0}", strerror(errno));
+}
+
+EventWatcher::~EventWatcher()
+{
+    if (inotify_fd >= 0)
+        close(inotify_fd);
+    for (auto &entry : psi_watches)
+        close(entry.first);
+}
+
+// Make the set of watches match the currently configured cgroups. A new watch starts
+// with the current counter values, so we only report events from now on.
+void EventWatcher::update_watches()
+{
+    std::vector<cgroup_selector> cgroups;
+    std::vector<psi_trigger> triggers;
+    {
+        std::lock_guard<std::mutex> lck { data_lock };
+        cgroups = shared_options->cgroups;
+        triggers = shared_options->psi_triggers;
+        max_payload_bytes = shared_options->max_payload_bytes;
+        timestamp_format = shared_options->timestamp_format;
+    }
+    update_psi_triggers(cgroups, triggers);
+    if (!have_cgroups || inotify_fd < 0)
+        return;
+    std::map<int, watched_file> wanted;
+    for (auto &selector : cgroups) {
+        std::string dir = cgroup_collector.resolve(selector);
+        if (dir.empty())
+            continue;
+        for (auto &ef : watched_events) {
+            std::string path = dir + "/" + ef.file;
+            // Adding a watch for a path we already watch returns the same descriptor.
+            int wd = inotify_add_watch(inotify_fd, path.c_str(), IN_MODIFY);
+            if (wd < 0) {
+                // The controller isn't enabled for this cgroup; nothing to watch.
+                continue;
+            }
+            auto it = watches.find(wd);
+            if (it != watches.end() && it->second.dir == dir) {
+                wanted[wd] = it->second;
+                continue;
+            }
+            watched_file wf;
+            wf.name = selector.name;
+            wf.dir = dir;
+            wf.file = ef.file;
+            read_counters(path, wf.counters);
+            logger->info("EventWatcher::update_watches: watching {0}", path);
+            wanted[wd] = wf;
+        }
+    }
+    for (auto &entry : watches) {
+        if (wanted.find(entry.first) == wanted.end()) {
+            logger->info("EventWatcher::update_watches: no longer watching {0}/{1}", entry.second.dir, entry.second.file);
+            inotify_rm_watch(inotify_fd, entry.first);
+        }
+    }
+    watches.swap(wanted);
+}
+
+// Make the set of open PSI triggers match the configured ones. A trigger is identified
+// by its pressure file and settings; one whose settings changed is closed (which removes
+// it in the kernel) and registered again.
+void EventWatcher::update_psi_triggers(const std::vector<cgroup_selector> &cgroups,
+                                       const std::vector<psi_trigger> &triggers)
+{
+    std::map<int, psi_watch> wanted;
+    std::map<int, psi_watch> current;
+    current.swap(psi_watches);
+
+    for (auto &trig : triggers) {
+        psi_watch pw;
+        pw.trigger = trig;
+        pw.name = "system";
+        std::string dir;
+        if (!trig.cgroup.empty()) {
+            if (!have_cgroups)
+                continue;
+            for (auto &selector : cgroups) {
+                if (selector.name == trig.cgroup) {
+                    dir = cgroup_collector.resolve(selector);
+                    break;
+                }
+            }
+            if (dir.empty())
+                continue;
+            pw.name = trig.cgroup;
+        }
+        pw.path = pressure_path(trig.resource, dir);
+        auto it = current.begin();
+        for ( ; it != current.end(); ++it) {
+            const psi_trigger &old = it->second.trigger;
+            if (it->second.path == pw.path && old.type == trig.type &&
+                old.threshold_us == trig.threshold_us && old.window_us == trig.window_us)
+                break;
+        }
+        if (it != current.end()) {
+            wanted[it->first] = it->second;
+            current.erase(it);
+            continue;
+        }
+        int fd = open_psi_trigger(pw.path, trig.type, trig.threshold_us, trig.window_us);
+        if (fd < 0) {
+            logger->warn("EventWatcher::update_psi_triggers: cannot register trigger \"{0} {1} {2}\" on {3}: {4}",
+                         trig.type, trig.threshold_us, trig.window_us, pw.path, strerror(errno));
+            continue;
+        }
+        logger->info("EventWatcher::update_psi_triggers: registered trigger \"{0} {1} {2}\" on {3}",
+                     trig.type, trig.threshold_us, trig.window_us, pw.path);
+        wanted[fd] = pw;
+    }
+    // Whatever is left is no longer configured.
+    for (auto &entry : current) {
+        logger->info("EventWatcher::update_psi_triggers: removed trigger on {0}", entry.second.path);
+        close(entry.first);
+    }
+    psi_watches.swap(wanted);
+}
+
+// Add an event for a PSI trigger that fired, with the current pressure averages.
+void EventWatcher::psi_event(const psi_watch &pw, json &events)
+{
+    psi_stats stats;
+
+    read_pressure(pw.path, stats);
+    const psi_line &line = (pw.trigger.type == "full") ? stats.full : stats.some;
+    logger->warn("EventWatcher: {0} {1} pressure ({2}) exceeded {3} us in {4} us, avg10 {5}",
+                 pw.name, pw.trigger.resource, pw.trigger.type, pw.trigger.threshold_us,
+                 pw.trigger.window_us, line.avg10);
+    json jev = {
+            {"app", pw.name},
+            {"timestamp", format_timestamp(timestamp_format, std::chrono::system_clock::now())},
+            {"event", "psi"},
+            {"resource", pw.trigger.resource},
+            {"type", pw.trigger.type},
+            {"threshold_us", pw.trigger.threshold_us},
+            {"window_us", pw.trigger.window_us},
+            {"avg10", line.avg10},
+    };
+    events.push_back(jev);
+}
+
+// Re-read a changed events file and add an event to the list for each reported
+// counter that went up.
+void EventWatcher::check_counters(watched_file &wf, json &events)
+{
+    std::map<std::string, unsigned long long> counters;
+
+    if (!read_counters(wf.dir + "/" + wf.file, counters))
+        return;
+    for (auto &ef : watched_events) {
+        if (wf.file != ef.file)
+            continue;
+        for (const char *key : ef.keys) {
+            unsigned long long count = counters[key];
+            unsigned long long last = wf.counters[key];
+            if (count > last) {
+                logger->warn("EventWatcher: {0} {1} increased by {2} to {3}", wf.name, key, count - last, count);
+                json jev = {
+                        {"app", wf.name},
+                        {"timestamp", format_timestamp(timestamp_format, std::chrono::system_clock::now())},
+                        {"cgroup", wf.dir},
+                        {"event", key},
+                        {"count", count},
+                        {"increase", count - last},
+                };
+                events.push_back(jev);
+            }
+        }
+    }
+    wf.counters.swap(counters);
+}
+
+// This is the thread function. It runs forever, waiting for inotify events and PSI
+// triggers and sending any events to the results server immediately. The poll() times
+// out every second so we can notice changes to the configuration.
+void EventWatcher::watch_loop()
+{
+    char buf[INOTIFY_BUF_LEN] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    auto last_refresh = std::chrono::steady_clock::time_point();
+    std::vector<struct pollfd> pfds;
+
+    logger->info("begin EventWatcher::watch_loop");
+    if (results_url.empty()) {
+        logger->warn("EventWatcher::watch_loop: no http(s) destination to send events to, not watching");
+        return;
+    }
+    if (inotify_fd < 0 || !have_cgroups)
+        logger->warn("EventWatcher::watch_loop: cgroup events unavailable, only watching PSI triggers");
+    while (true) {
+        auto now = std::chrono::steady_clock::now();
+        if (now - last_refresh >= std::chrono::seconds(EVENT_REFRESH_INTERVAL)) {
+            update_watches();
+            last_refresh = now;
+        }
+        pfds.clear();
+        if (inotify_fd >= 0 && !watches.empty())
+            pfds.push_back({ inotify_fd, POLLIN, 0 });
+        for (auto &entry : psi_watches)
+            pfds.push_back({ entry.first, POLLPRI, 0 });
+        if (pfds.empty()) {
+            sleep(1);
+            continue;
+        }
+        int ret = poll(pfds.data(), pfds.size(), 1000);
+        if (ret < 0 && errno != EINTR) {
+            logger->error("EventWatcher::watch_loop: poll failed: {0}", strerror(errno));
+            sleep(1);
+            continue;
+        }
+        if (ret <= 0)
+            continue;
+
+        json events = json::array();
+        for (auto &pfd : pfds) {
+            if (pfd.revents == 0)
+                continue;
+            if (pfd.fd == inotify_fd) {
+                // Several modifications of the same file may be queued; we only need to
+                // read each changed file once.
+                std::vector<int> changed;
+                ssize_t len;
+                while ((len = read(inotify_fd, buf, sizeof(buf))) > 0) {
+                    for (char *ptr = buf; ptr < buf + len; ) {
+                        auto *event = (const struct inotify_event *) ptr;
+                        if (event->mask & IN_IGNORED)
+                            watches.erase(event->wd);     // the cgroup went away
+                        else if (std::find(changed.begin(), changed.end(), event->wd) == changed.end())
+                            changed.push_back(event->wd);
+                        ptr += sizeof(struct inotify_event) + event->len;
+                    }
+                }
+                for (int wd : changed) {
+                    auto it = watches.find(wd);
+                    if (it != watches.end())
+                        check_counters(it->second, events);
+                }
+            }
+            else {
+                auto it = psi_watches.find(pfd.fd);
+                if (it == psi_watches.end())
+                    continue;
+                if (pfd.revents & POLLERR) {
+                    // The cgroup went away; the trigger is gone with it.
+                    logger->info("EventWatcher::watch_loop: trigger on {0} is gone", it->second.path);
+                    close(it->first);
+                    psi_watches.erase(it);
+                }
+                else if (pfd.revents & POLLPRI)
+                    psi_event(it->second, events);
+            }
+        }
+        if (!events.empty()) {
+            json jres;
+            jres["events"] = events;
+            if (send_app_results(http, results_url, jres, max_payload_bytes, logger))
+                logger->info("EventWatcher::watch_loop: sent {0} events", events.size());
+            else
+                logger->warn("EventWatcher::watch_loop: failed to send events");
+        }
+    }
+}
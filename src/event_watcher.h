@@ -0,0 +1,77 @@
+// event_watcher.h
+// This file defines the EventWatcher class. See event_watcher.cpp for more information.
+
+#ifndef EPMON_EVENT_WATCHER_H
+#define EPMON_EVENT_WATCHER_H
+
+#include <map>
+#include <mutex>
+#include <thread>
+#include "nlohmann_json/json.hpp"
+#include <spdlog/spdlog.h>
+#include "cgroup_collector.h"
+#include "monitor_options.h"
+#include "http_client.h"
+
+using json = nlohmann::json;
+
+class EventWatcher {
+public:
+    EventWatcher(std::string url, Monitor_options *options, std::mutex &mut);
+    ~EventWatcher();
+
+    std::thread run() { return std::thread([this] { this->watch_loop(); }); }
+
+private:
+    // A cgroup events file we have an inotify watch on.
+    struct watched_file {
+        // The name of the monitored cgroup, as reported.
+        std::string name;
+        // The cgroup directory and the events file in it.
+        std::string dir;
+        std::string file;
+        // The last counter values we saw, by key.
+        std::map<std::string, unsigned long long> counters;
+    };
+
+    // A registered PSI trigger.
+    struct psi_watch {
+        // The monitored cgroup name, or "system".
+        std::string name;
+        // The pressure file the trigger was written to.
+        std::string path;
+        psi_trigger trigger;
+    };
+
+    // URL of the results server, or of the first destination that is an HTTP server.
+    // Empty if there isn't one.
+    std::string results_url;
+    // The shared monitoring options.
+    Monitor_options *shared_options;
+    // The shared mutex.
+    std::mutex &data_lock;
+    // The logger.
+    std::shared_ptr<spdlog::logger> logger;
+    // The connection to the results server.
+    HttpClient http;
+    // Used to find the cgroup directories, the same way the Monitor does.
+    CgroupCollector cgroup_collector;
+    bool have_cgroups;
+    // The inotify instance, and the files it watches by watch descriptor.
+    int inotify_fd;
+    std::map<int, watched_file> watches;
+    // The largest event report we'll send, and how to write its timestamps, from the
+    // shared options.
+    size_t max_payload_bytes;
+    time_format timestamp_format;
+    // The open PSI trigger descriptors, by descriptor.
+    std::map<int, psi_watch> psi_watches;
+
+    void update_watches();
+    void update_psi_triggers(const std::vector<cgroup_selector> &cgroups, const std::vector<psi_trigger> &triggers);
+    void check_counters(watched_file &wf, json &events);
+    void psi_event(const psi_watch &pw, json &events);
+    void watch_loop();
+};
+
+#endif //EPMON_EVENT_WATCHER_H
@@ -0,0 +1,105 @@
+// host_metrics.cpp
+// This file implements the HostMetrics class, which gives each report some context about
+// the host it came from: overall and per-CPU utilization (including iowait and steal,
+// which tell a starved VM from a busy one), the load averages and the memory totals.
+// With that, an app's CPU share can be compared with how busy the whole box was.
+// The CPU numbers cost nothing extra to collect: the collector already reads /proc/stat
+// once per sampling round for the process CPU calculations, and keeps the per-CPU lines
+// from that read (see collector.cpp). We compare them with the previous cycle's, so the
+// utilization covers the whole monitor interval. The only additional reads are
+// /proc/loadavg and /proc/meminfo, once per cycle.
+// What It Doesn't Do
+// If a CPU comes or goes between cycles, the per-CPU numbers are skipped for that cycle.
+
+#include "host_metrics.h"
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define LOADAVG_PATH    "/proc/loadavg"
+#define MEMINFO_PATH    "/proc/meminfo"
+#define MEMINFO_LEN     4096
+
+// An anonymous namespace for functions that don't need to be in the HostMetrics class itself.
+namespace {
+    bool read_small_file(const char *path, char *buf, size_t len)
+    {
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            return false;
+        ssize_t nread = read(fd, buf, len - 1);
+        close(fd);
+        if (nread < 0)
+            return false;
+        buf[nread] = '\0';
+        return true;
+    }
+
+    // Find "Key:   value kB" in /proc/meminfo.
+    long long unsigned int meminfo_value(const char *buf, const char *key)
+    {
+        size_t key_len = strlen(key);
+        for (const char *line = buf; line && *line; ) {
+            if (strncmp(line, key, key_len) == 0 && line[key_len] == ':')
+                return strtoull(line + key_len + 1, nullptr, 10);
+            line = strchr(line, '\n');
+            if (line)
+                line++;
+        }
+        return 0;
+    }
+
+    // The share of the time between two readings spent in each state.
+    host_cpu_usage cpu_usage(const cpu_times &cur, const cpu_times &last)
+    {
+        host_cpu_usage usage;
+        memset(&usage, 0, sizeof(usage));
+        long unsigned int cur_total = cpu_times_total(cur);
+        long unsigned int last_total = cpu_times_total(last);
+        if (cur_total <= last_total)
+            return usage;
+        double total = (double) (cur_total - last_total);
+        usage.user = 100.0 * (double) ((cur.user + cur.nice) - (last.user + last.nice)) / total;
+        usage.system = 100.0 * (double) ((cur.system + cur.irq + cur.softirq)
+                                         - (last.system + last.irq + last.softirq)) / total;
+        usage.iowait = 100.0 * (double) (cur.iowait - last.iowait) / total;
+        usage.steal = 100.0 * (double) (cur.steal - last.steal) / total;
+        usage.idle = 100.0 * (double) (cur.idle - last.idle) / total;
+        usage.busy = 100.0 - usage.idle - usage.iowait;
+        return usage;
+    }
+}
+
+void HostMetrics::collect(const sample_round &baseline, const sample_round &cur, host_info &info)
+{
+    char buf[MEMINFO_LEN];
+
+    const std::vector<cpu_times> &last = last_cpus.empty() ? baseline.cpus : last_cpus;
+    info.have_cpu = !cur.cpus.empty() && !last.empty();
+    info.per_cpu_busy.clear();
+    if (info.have_cpu) {
+        info.cpu = cpu_usage(cur.cpus[0], last[0]);
+        if (cur.cpus.size() == last.size()) {
+            for (size_t ii = 1; ii < cur.cpus.size(); ii++)
+                info.per_cpu_busy.push_back(cpu_usage(cur.cpus[ii], last[ii]).busy);
+        }
+    }
+    if (!cur.cpus.empty())
+        last_cpus = cur.cpus;
+
+    info.loadavg[0] = info.loadavg[1] = info.loadavg[2] = 0.0;
+    if (read_small_file(LOADAVG_PATH, buf, sizeof(buf)))
+        sscanf(buf, "%lf %lf %lf", &info.loadavg[0], &info.loadavg[1], &info.loadavg[2]);
+
+    memset(&info.memory, 0, sizeof(info.memory));
+    if (read_small_file(MEMINFO_PATH, buf, sizeof(buf))) {
+        info.memory.total = meminfo_value(buf, "MemTotal");
+        info.memory.free = meminfo_value(buf, "MemFree");
+        info.memory.available = meminfo_value(buf, "MemAvailable");
+        info.memory.buffers = meminfo_value(buf, "Buffers");
+        info.memory.cached = meminfo_value(buf, "Cached");
+        info.memory.swap_total = meminfo_value(buf, "SwapTotal");
+        info.memory.swap_free = meminfo_value(buf, "SwapFree");
+    }
+}
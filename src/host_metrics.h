@@ -0,0 +1,57 @@
+// host_metrics.h
+// This file defines the HostMetrics class. See host_metrics.cpp for more information.
+
+#ifndef EPMON_HOST_METRICS_H
+#define EPMON_HOST_METRICS_H
+
+#include <vector>
+#include "collector.h"
+
+// Where the CPU time went, as percentages of the time measured.
+struct host_cpu_usage {
+    double user;
+    double system;
+    double iowait;
+    double steal;
+    double idle;
+    // Everything except idle and iowait.
+    double busy;
+};
+
+// From /proc/meminfo, in Kbytes.
+struct host_memory {
+    long long unsigned int total;
+    long long unsigned int free;
+    long long unsigned int available;
+    long long unsigned int buffers;
+    long long unsigned int cached;
+    long long unsigned int swap_total;
+    long long unsigned int swap_free;
+};
+
+struct host_info {
+    // False until there are two sets of CPU times to compare.
+    bool have_cpu;
+    host_cpu_usage cpu;
+    // The busy percentage of each CPU.
+    std::vector<double> per_cpu_busy;
+    // The 1, 5 and 15 minute load averages.
+    double loadavg[3];
+    host_memory memory;
+};
+
+class HostMetrics {
+public:
+    HostMetrics() = default;
+    ~HostMetrics() = default;     // Nothing to clean up.
+
+    // Collect the host metrics for a sampling round. CPU usage is measured from the
+    // previous call's round, or from baseline on the first call.
+    void collect(const sample_round &baseline, const sample_round &cur, host_info &info);
+
+private:
+    // The CPU times from the previous call.
+    std::vector<cpu_times> last_cpus;
+};
+
+#endif //EPMON_HOST_METRICS_H
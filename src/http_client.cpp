@@ -0,0 +1,323 @@
+// http_client.cpp
+// This file implements the HttpClient class and the HTTP POST used to send JSON to the
+// results server.
+// Every thread that talks to a server (MonitorConfig, Monitor and EventWatcher) owns an
+// HttpClient, which keeps a single curl easy handle for the life of the thread instead of
+// creating and cleaning one up for every request. A handle that is reused keeps its
+// connection open, so with keep-alive the next request to the same server skips the DNS
+// lookup and the TCP and TLS handshakes entirely. On top of that all the handles share a
+// curl share object holding the DNS cache and the TLS session cache, so a lookup or TLS
+// session done by one thread can be picked up by another, whose first connection then
+// gets a shortened TLS handshake. The share object needs locking since the threads use
+// it concurrently; curl calls our lock and unlock callbacks, which use one mutex per kind
+// of shared data. The connection cache isn't shared: libcurl doesn't support sharing
+// connections between threads that use them at the same time, even with the locks, and
+// each thread's long-lived handle already reuses its own connections.
+// Every request logs whether it reused a connection or had to open a new one.
+// An HttpMulti runs a set of POSTs at once instead of one after the other, for a results
+// sender with a spool backlog to get through (see results_sender.cpp). All of them are
+// added to a curl multi handle, which the calling thread drives until they're done. The
+// multi handle limits the connections to HttpMulti::set_limits()' max_connections; the
+// transfers beyond that wait for a connection rather than opening another. Over HTTP/2
+// (https:// URLs, when the server offers it) the transfers are multiplexed as streams on
+// the same connection, so one connection carries them all at once. Each transfer has
+// its own timeout, so a stuck one can't hold up the rest for longer than that.
+// What It Doesn't Do
+// An HttpClient or HttpMulti must only be used by one thread at a time; that's what keeps
+// the easy handles themselves lock-free. An HttpMulti doesn't use the share object, so
+// it keeps its own connections. HTTP/2 over cleartext (h2c) isn't tried.
+
+#include <chrono>
+#include <mutex>
+#include "http_client.h"
+
+// The maximum time, in seconds, we'll wait for any one request.
+#define HTTP_TIMEOUT            30
+// How long to keep idle connections around, in seconds. Servers usually close idle
+// connections after a minute or two; there's no point keeping ours open any longer.
+#define HTTP_MAX_IDLE_SECONDS   120
+
+// An anonymous namespace for functions and data that don't need to be visible outside this file.
+namespace {
+    // The share object, and a mutex for each kind of data it can share.
+    CURLSH *share = nullptr;
+    std::mutex share_locks[CURL_LOCK_DATA_LAST];
+
+    void share_lock_cb(CURL *, curl_lock_data data, curl_lock_access, void *)
+    {
+        share_locks[data].lock();
+    }
+
+    void share_unlock_cb(CURL *, curl_lock_data data, void *)
+    {
+        share_locks[data].unlock();
+    }
+
+    // This callback function captures the output of the curl_easy_perform() call.
+    // Without it, the output is written to stdout, which is not helpful in this case.
+    size_t curl_write_cb(void *ptr, size_t size, size_t nmemb, void *userp)
+    {
+        auto *data = (std::string *) userp;
+        data->append((char *) ptr, size * nmemb);
+        return size * nmemb;
+    }
+
+    // An HttpMulti only wants the status, so the response body is thrown away.
+    size_t discard_cb(char *, size_t size, size_t nmemb, void *)
+    {
+        return size * nmemb;
+    }
+}
+
+bool http_share_init()
+{
+    share = curl_share_init();
+    if (share == nullptr)
+        return false;
+    curl_share_setopt(share, CURLSHOPT_LOCKFUNC, share_lock_cb);
+    curl_share_setopt(share, CURLSHOPT_UNLOCKFUNC, share_unlock_cb);
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+    return true;
+}
+
+void http_share_cleanup()
+{
+    if (share != nullptr)
+        curl_share_cleanup(share);
+    share = nullptr;
+}
+
+// Set up the options that stay the same for every request.
+HttpClient::HttpClient()
+    : status(0), retry_after(0)
+{
+    // Get the shared logger pointer.
+    logger = spdlog::get("epmon");
+    curl = curl_easy_init();
+    if (curl == nullptr) {
+        logger->error("HttpClient: curl_easy_init failed");
+        return;
+    }
+    if (share != nullptr)
+        curl_easy_setopt(curl, CURLOPT_SHARE, share);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curl_write_cb);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *) &response_body);
+    curl_easy_setopt(curl, CURLOPT_TIMEOUT, (long) HTTP_TIMEOUT);
+    curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+    curl_easy_setopt(curl, CURLOPT_MAXAGE_CONN, (long) HTTP_MAX_IDLE_SECONDS);
+    // We have more than one thread, so curl mustn't use signals for DNS timeouts.
+    curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+}
+
+HttpClient::~HttpClient()
+{
+    if (curl != nullptr)
+        curl_easy_cleanup(curl);
+}
+
+void HttpClient::set_timeout(unsigned int timeout_ms)
+{
+    if (curl != nullptr)
+        curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, (long) timeout_ms);
+}
+
+// Run the request that has been set up on the handle, and log how it went.
+bool HttpClient::perform(const char *method, const std::string &url)
+{
+    long new_connects = 0;
+    double total_time = 0.0;
+
+    response_body.clear();
+    status = 0;
+    retry_after = 0;
+    curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+    CURLcode res = curl_easy_perform(curl);
+    if (res != CURLE_OK) {
+        logger->error("HttpClient: {0} {1} failed: {2}", method, url, curl_easy_strerror(res));
+        return false;
+    }
+    // curl only fails on transport errors; the server turning the request down counts too.
+    // curl parses Retry-After for us, whether it's in seconds or an HTTP date.
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
+    curl_off_t wait_secs = 0;
+    if (curl_easy_getinfo(curl, CURLINFO_RETRY_AFTER, &wait_secs) == CURLE_OK)
+        retry_after = (long) wait_secs;
+    if (status >= 400) {
+        logger->error("HttpClient: {0} {1} failed: HTTP status {2}", method, url, status);
+        return false;
+    }
+    curl_easy_getinfo(curl, CURLINFO_NUM_CONNECTS, &new_connects);
+    curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME, &total_time);
+    if (new_connects == 0)
+        logger->info("HttpClient: {0} {1} reused a connection, took {2:.1f} ms", method, url, total_time * 1000.0);
+    else
+        logger->info("HttpClient: {0} {1} opened a new connection, took {2:.1f} ms", method, url, total_time * 1000.0);
+    return true;
+}
+
+bool HttpClient::get(const std::string &url, std::string &response)
+{
+    if (curl == nullptr)
+        return false;
+    curl_easy_setopt(curl, CURLOPT_HTTPGET, 1L);
+    bool ret = perform("GET", url);
+    response.swap(response_body);
+    return ret;
+}
+
+bool HttpClient::post(const std::string &url, const char *data, size_t len, const char *content_type,
+                      const char *encoding)
+{
+    struct curl_slist *headers = nullptr;
+
+    if (curl == nullptr)
+        return false;
+    headers = curl_slist_append(headers, (std::string("Content-Type: ") + content_type).c_str());
+    if (encoding != nullptr)
+        headers = curl_slist_append(headers, (std::string("Content-Encoding: ") + encoding).c_str());
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+    curl_easy_setopt(curl, CURLOPT_POST, 1L);
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, (long) len);
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, data);
+    bool ret = perform("POST", url);
+    // The handle is reused, so it mustn't keep pointing at the list we're freeing.
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, nullptr);
+    curl_slist_free_all(headers);
+    return ret;
+}
+
+HttpMulti::HttpMulti()
+    : timeout_ms(HTTP_TIMEOUT * 1000L)
+{
+    // Get the shared logger pointer.
+    logger = spdlog::get("epmon");
+    multi = curl_multi_init();
+    if (multi == nullptr) {
+        logger->error("HttpMulti: curl_multi_init failed");
+        return;
+    }
+    curl_multi_setopt(multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+}
+
+HttpMulti::~HttpMulti()
+{
+    for (CURL *handle : handles)
+        curl_easy_cleanup(handle);
+    if (multi != nullptr)
+        curl_multi_cleanup(multi);
+}
+
+void HttpMulti::set_limits(unsigned int max_connections, unsigned int timeout)
+{
+    timeout_ms = (long) timeout;
+    if (multi == nullptr)
+        return;
+    curl_multi_setopt(multi, CURLMOPT_MAX_TOTAL_CONNECTIONS, (long) max_connections);
+    curl_multi_setopt(multi, CURLMOPT_MAX_HOST_CONNECTIONS, (long) max_connections);
+}
+
+void HttpMulti::post_all(const std::string &url, std::vector<http_post> &posts)
+{
+    std::vector<struct curl_slist *> headers(posts.size(), nullptr);
+    size_t used = 0;
+
+    if (multi == nullptr)
+        return;
+    auto start = std::chrono::steady_clock::now();
+    while (handles.size() < posts.size()) {
+        CURL *handle = curl_easy_init();
+        if (handle == nullptr)
+            break;
+        curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, discard_cb);
+        curl_easy_setopt(handle, CURLOPT_TCP_KEEPALIVE, 1L);
+        curl_easy_setopt(handle, CURLOPT_NOSIGNAL, 1L);
+        curl_easy_setopt(handle, CURLOPT_POST, 1L);
+        // HTTP/2 where the server offers it.
+        curl_easy_setopt(handle, CURLOPT_HTTP_VERSION, (long) CURL_HTTP_VERSION_2TLS);
+        handles.push_back(handle);
+    }
+    // Over TLS, wait to see if the first connection can multiplex before opening more.
+    // Plain http:// is always HTTP/1.1 here, so there's nothing to wait for.
+    long pipewait = url.compare(0, 8, "https://") == 0 ? 1L : 0L;
+    for (size_t ii = 0; ii < posts.size() && ii < handles.size(); ii++) {
+        http_post &post = posts[ii];
+        CURL *handle = handles[ii];
+        post.status = 0;
+        post.ok = false;
+        post.retry_after = 0;
+        headers[ii] = curl_slist_append(headers[ii], (std::string("Content-Type: ") + post.content_type).c_str());
+        if (post.encoding != nullptr)
+            headers[ii] = curl_slist_append(headers[ii], (std::string("Content-Encoding: ") + post.encoding).c_str());
+        curl_easy_setopt(handle, CURLOPT_URL, url.c_str());
+        curl_easy_setopt(handle, CURLOPT_HTTPHEADER, headers[ii]);
+        curl_easy_setopt(handle, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t) post.len);
+        curl_easy_setopt(handle, CURLOPT_POSTFIELDS, post.data);
+        curl_easy_setopt(handle, CURLOPT_TIMEOUT_MS, timeout_ms);
+        curl_easy_setopt(handle, CURLOPT_PIPEWAIT, pipewait);
+        curl_easy_setopt(handle, CURLOPT_PRIVATE, (void *) &post);
+        if (curl_multi_add_handle(multi, handle) != CURLM_OK)
+            logger->error("HttpMulti: curl_multi_add_handle failed");
+        used++;
+    }
+    int running = 1;
+    while (running > 0) {
+        if (curl_multi_perform(multi, &running) != CURLM_OK)
+            break;
+        if (running > 0)
+            curl_multi_poll(multi, nullptr, 0, 1000, nullptr);
+    }
+    CURLMsg *msg;
+    int left = 0;
+    size_t ok = 0;
+    while ((msg = curl_multi_info_read(multi, &left)) != nullptr) {
+        if (msg->msg != CURLMSG_DONE)
+            continue;
+        http_post *post = nullptr;
+        curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **) &post);
+        if (post == nullptr)
+            continue;
+        if (msg->data.result != CURLE_OK) {
+            logger->error("HttpMulti: POST {0} failed: {1}", url, curl_easy_strerror(msg->data.result));
+            continue;
+        }
+        curl_easy_getinfo(msg->easy_handle, CURLINFO_RESPONSE_CODE, &post->status);
+        curl_off_t wait_secs = 0;
+        if (curl_easy_getinfo(msg->easy_handle, CURLINFO_RETRY_AFTER, &wait_secs) == CURLE_OK)
+            post->retry_after = (long) wait_secs;
+        post->ok = post->status < 400;
+        if (post->ok)
+            ok++;
+        else
+            logger->error("HttpMulti: POST {0} failed: HTTP status {1}", url, post->status);
+    }
+    for (size_t ii = 0; ii < used; ii++) {
+        curl_multi_remove_handle(multi, handles[ii]);
+        curl_easy_setopt(handles[ii], CURLOPT_HTTPHEADER, nullptr);
+    }
+    for (struct curl_slist *list : headers)
+        curl_slist_free_all(list);
+    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+    logger->info("HttpMulti: {0} of {1} POSTs to {2} succeeded, took {3} ms", ok, posts.size(), url, elapsed.count());
+}
+
+// Send a POST message containing the JSON app monitoring results to the results URL.
+// The serialized string is handed straight to curl along with its length, so there's no
+// copy and no limit on the size other than max_bytes. A report bigger than that is not
+// sent at all, since cutting it short would just make it invalid JSON.
+bool send_app_results(HttpClient &http, const std::string &url, const json &json_results, size_t max_bytes,
+                      const std::shared_ptr<spdlog::logger> &logger)
+{
+    // Convert the JSON results to a single string.
+    std::string body = json_results.dump();
+    if (body.size() > max_bytes) {
+        logger->error("send_app_results: {0} byte payload exceeds the {1} byte maximum, not sent",
+                      body.size(), max_bytes);
+        return false;
+    }
+    // Pass the JSON string as the POST data. POST it!
+    bool ret = http.post(url, body.data(), body.size(), "application/json");
+    if (!ret)
+        logger->error("send_app_results failed");
+    return ret;
+}
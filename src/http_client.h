@@ -0,0 +1,96 @@
+// http_client.h
+// This file defines the HttpClient class and the HTTP helpers shared by the threads that
+// talk to the configuration and results servers. See http_client.cpp for more information.
+
+#ifndef EPMON_HTTP_CLIENT_H
+#define EPMON_HTTP_CLIENT_H
+
+#include <string>
+#include <vector>
+#include <curl/curl.h>
+#include "nlohmann_json/json.hpp"
+#include <spdlog/spdlog.h>
+
+using json = nlohmann::json;
+
+// Create and destroy the curl share object used by every HttpClient. Call these once,
+// after curl_global_init() and before any HttpClient is created.
+bool http_share_init();
+void http_share_cleanup();
+
+class HttpClient {
+public:
+    HttpClient();
+    ~HttpClient();
+    HttpClient(const HttpClient &) = delete;
+    HttpClient &operator=(const HttpClient &) = delete;
+
+    // Make a GET request, putting the response body in response.
+    bool get(const std::string &url, std::string &response);
+    // POST the given data, which is len bytes long and needn't be NUL-terminated, with
+    // the given Content-Type. If encoding isn't null, it's sent as the Content-Encoding.
+    bool post(const std::string &url, const char *data, size_t len, const char *content_type,
+              const char *encoding = nullptr);
+    // The HTTP status of the last response, or 0 if there wasn't one.
+    long last_status() const { return status; }
+    // The seconds the server's last response asked us to wait in a Retry-After header,
+    // or 0 if it didn't.
+    long last_retry_after() const { return retry_after; }
+    // The longest a request may take, if not the default.
+    void set_timeout(unsigned int timeout_ms);
+
+private:
+    // The long-lived easy handle.
+    CURL *curl;
+    // The body of the last response.
+    std::string response_body;
+    long status;
+    long retry_after;
+    // The logger.
+    std::shared_ptr<spdlog::logger> logger;
+
+    bool perform(const char *method, const std::string &url);
+};
+
+// One POST for HttpMulti::post_all(), and how it went.
+struct http_post {
+    const char *data = nullptr;
+    size_t len = 0;
+    const char *content_type = nullptr;
+    // The Content-Encoding, or null for none.
+    const char *encoding = nullptr;
+    // The HTTP status, or 0 if there wasn't a response, whether it worked, and the
+    // seconds the response's Retry-After asked us to wait, if it had one.
+    long status = 0;
+    bool ok = false;
+    long retry_after = 0;
+};
+
+// Runs many POSTs at once on one thread, through a curl multi handle.
+class HttpMulti {
+public:
+    HttpMulti();
+    ~HttpMulti();
+    HttpMulti(const HttpMulti &) = delete;
+    HttpMulti &operator=(const HttpMulti &) = delete;
+
+    // Open no more than max_connections connections at once, and give each POST no
+    // more than timeout_ms.
+    void set_limits(unsigned int max_connections, unsigned int timeout_ms);
+    // POST each of the bodies to url, as many at once as the limits allow, and wait
+    // until they have all finished.
+    void post_all(const std::string &url, std::vector<http_post> &posts);
+
+private:
+    CURLM *multi;
+    // Easy handles kept from one call to the next, so they don't have to be set up again.
+    std::vector<CURL *> handles;
+    long timeout_ms;
+    // The logger.
+    std::shared_ptr<spdlog::logger> logger;
+};
+
+bool send_app_results(HttpClient &http, const std::string &url, const json &json_results, size_t max_bytes,
+                      const std::shared_ptr<spdlog::logger> &logger);
+
+#endif //EPMON_HTTP_CLIENT_H
@@ -0,0 +1,156 @@
+// http_post_test.cpp
+// This is a test program for HttpClient::post(). It makes up a report with
+// HTTP_POST_TEST_APPS results, far bigger than the 4096 bytes reports used to be cut
+// down to, and POSTs it to a listener on a loopback port that this program runs itself.
+// The test passes if the listener gets the whole body, byte for byte, and it parses as a
+// report with every result in it. It exits with 0 if it passes and 1 if it doesn't, so
+// ctest can run it.
+// The listener only understands as much HTTP as curl needs for one POST: the headers, a
+// Content-Length body, and an Expect: 100-continue if curl sends one. The loopback
+// address is exempted from any proxy set in the environment, and if the POST fails the
+// listener is shut down, so it can't wait forever for a connection that isn't coming.
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <curl/curl.h>
+#include <spdlog/spdlog.h>
+#include <spdlog/sinks/null_sink.h>
+#include "http_client.h"
+#include "results.h"
+#include "sample_results.h"
+
+#define HTTP_POST_TEST_APPS     10000
+
+// An anonymous namespace for functions that don't need to be visible outside this file.
+namespace {
+    // Read from the connection until the buffer holds the end of the request headers.
+    // Returns the length of the headers, including the blank line, or 0 if the
+    // connection closed first.
+    size_t read_headers(int fd, std::string &buf)
+    {
+        char chunk[4096];
+        size_t end;
+        while ((end = buf.find("\r\n\r\n")) == std::string::npos) {
+            ssize_t len = read(fd, chunk, sizeof(chunk));
+            if (len <= 0)
+                return 0;
+            buf.append(chunk, len);
+        }
+        return end + 4;
+    }
+
+    // The value of a header, or an empty string if it isn't there. Header names aren't
+    // case sensitive.
+    std::string header_value(const std::string &headers, const char *name)
+    {
+        size_t name_len = strlen(name);
+        size_t pos = headers.find("\r\n");
+        while (pos != std::string::npos && pos + 2 < headers.size()) {
+            size_t line = pos + 2;
+            pos = headers.find("\r\n", line);
+            if (pos - line > name_len && headers[line + name_len] == ':' &&
+                strncasecmp(headers.c_str() + line, name, name_len) == 0) {
+                size_t start = headers.find_first_not_of(' ', line + name_len + 1);
+                return headers.substr(start, pos - start);
+            }
+        }
+        return std::string();
+    }
+
+    // Accept one connection, read one POST from it into body and answer 200 OK.
+    void serve_one_post(int listen_fd, std::string &body)
+    {
+        int fd = accept(listen_fd, nullptr, nullptr);
+        if (fd < 0)
+            return;
+        std::string buf;
+        size_t header_len = read_headers(fd, buf);
+        if (header_len > 0) {
+            std::string headers = buf.substr(0, header_len);
+            size_t content_length = std::stoul("0" + header_value(headers, "Content-Length"));
+            if (strcasecmp(header_value(headers, "Expect").c_str(), "100-continue") == 0) {
+                static const char go_on[] = "HTTP/1.1 100 Continue\r\n\r\n";
+                (void) !write(fd, go_on, sizeof(go_on) - 1);
+            }
+            body = buf.substr(header_len);
+            char chunk[65536];
+            while (body.size() < content_length) {
+                ssize_t len = read(fd, chunk, sizeof(chunk));
+                if (len <= 0)
+                    break;
+                body.append(chunk, len);
+            }
+            static const char ok[] = "HTTP/1.1 200 OK\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+            (void) !write(fd, ok, sizeof(ok) - 1);
+        }
+        close(fd);
+    }
+}
+
+int main()
+{
+    auto logger = std::make_shared<spdlog::logger>("epmon", std::make_shared<spdlog::sinks::null_sink_mt>());
+    spdlog::register_logger(logger);
+    setenv("NO_PROXY", "127.0.0.1", 1);
+    setenv("no_proxy", "127.0.0.1", 1);
+    curl_global_init(CURL_GLOBAL_ALL);
+    http_share_init();
+
+    int listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    struct sockaddr_in addr = {};
+    socklen_t addr_len = sizeof(addr);
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (listen_fd < 0 || bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(listen_fd, 1) < 0 ||
+        getsockname(listen_fd, (struct sockaddr *) &addr, &addr_len) < 0) {
+        std::cerr << "FAIL: can't listen on a loopback port: " << strerror(errno) << std::endl;
+        return 1;
+    }
+    std::string received;
+    std::thread server([listen_fd, &received] { serve_one_post(listen_fd, received); });
+
+    std::vector<app_result> results = make_sample_results(HTTP_POST_TEST_APPS);
+    std::string body;
+    write_report(body, results, format_timestamp(time_format::ctime, std::chrono::system_clock::now()),
+                 results_layout::rows, json::object());
+    std::string url = "http://127.0.0.1:" + std::to_string(ntohs(addr.sin_port)) + "/results";
+    bool ok;
+    {
+        HttpClient http;
+        ok = http.post(url, body.data(), body.size(), "application/json");
+    }
+    // Wake the listener if it's still waiting in accept().
+    if (!ok)
+        shutdown(listen_fd, SHUT_RDWR);
+    server.join();
+    close(listen_fd);
+    http_share_cleanup();
+    curl_global_cleanup();
+
+    if (!ok) {
+        std::cerr << "FAIL: POST of " << body.size() << " bytes to " << url << " failed" << std::endl;
+        return 1;
+    }
+    if (received != body) {
+        std::cerr << "FAIL: sent " << body.size() << " bytes, the listener got " << received.size() << std::endl;
+        return 1;
+    }
+    json report = json::parse(received, nullptr, false);
+    if (report.is_discarded() || !report.contains("healthcheck") ||
+        report["healthcheck"].size() != HTTP_POST_TEST_APPS) {
+        std::cerr << "FAIL: the listener got " << received.size() << " bytes that aren't a report of "
+                  << HTTP_POST_TEST_APPS << " results" << std::endl;
+        return 1;
+    }
+    std::cout << "PASS: posted " << HTTP_POST_TEST_APPS << " results in " << body.size() << " bytes" << std::endl;
+    return 0;
+}
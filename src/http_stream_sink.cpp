@@ -0,0 +1,314 @@
+// http_stream_sink.cpp
+// This file implements the HttpStreamSink class, the results sink (see results_sink.cpp)
+// for stream+http:// and stream+https:// destinations. Rather than a POST per report,
+// it holds one long-lived POST open to the collector, with a chunked request body, and
+// writes each report into it as it comes, as the next chunk. Once the connection is up, a
+// report costs one write: no request line, no headers, no response to wait for. JSON
+// and OTLP reports get a newline after them, so the body is NDJSON; CBOR and MessagePack
+// reports say how long they are, so they're written back to back.
+// The request is driven by a curl multi handle on the sink's own thread. When curl wants
+// more of the body and there's no report queued, the read callback pauses the request;
+// enqueue() wakes the thread, which unpauses it, and curl asks again. A report in a
+// different format from the one the request was started with ends the request (the
+// zero-length chunk), and the next one starts with the new Content-Type.
+// If the request fails, or the server answers it, the sink opens a new one, waiting
+// HTTP_STREAM_RETRY_MIN_MS first and doubling the wait after each failure up to
+// HTTP_STREAM_RETRY_MAX_MS. A request that got at least one report through starts the
+// wait from the minimum again. A report that was only partly written when the request
+// failed goes back on the front of the queue and is written again, whole, on the next
+// request, so the server sees each frame complete or not at all.
+// The queue follows the configured overflow policy, except that block is treated as
+// drop_oldest, as for the StreamSink. The counters count reports written as sent, and
+// the requests opened as posts.
+// What It Doesn't Do
+// There's no acknowledgement of individual reports: one written into a connection that
+// then dies may or may not have reached the server. There's no batching, compression or
+// spool; the ResultsSender does those for the plain http:// destinations.
+// Testing
+// http_stream_test.cpp plays the collector on a loopback port: it checks that reports
+// arrive as whole NDJSON frames, and that after the connection is closed partway through
+// a report the sink reconnects and sends that report again, whole. By hand, nc -l PORT
+// shows the request headers and then the chunks as they arrive.
+
+#include "http_stream_sink.h"
+#include <algorithm>
+#include <cstring>
+
+// How long the thread waits in curl for something to happen before looking at the
+// queue again, in milliseconds. enqueue() wakes it sooner.
+#define HTTP_STREAM_POLL_MS         1000
+// The most time to spend connecting, in seconds.
+#define HTTP_STREAM_CONNECT_TIMEOUT 10
+// Idle seconds before TCP keep-alive probes start, so a dead collector is noticed even
+// while the request is paused.
+#define HTTP_STREAM_KEEPIDLE        30
+// The shortest and longest waits before opening a new request after a failure.
+#define HTTP_STREAM_RETRY_MIN_MS    1000
+#define HTTP_STREAM_RETRY_MAX_MS    60000
+
+// An anonymous namespace for functions that don't need to be in the HttpStreamSink class itself.
+namespace {
+    // The Content-Type for a stream of reports in the given format.
+    const char *stream_content_type(results_format format)
+    {
+        switch (format) {
+            case results_format::cbor:
+                return "application/cbor-seq";
+            case results_format::msgpack:
+                return "application/msgpack";
+            default:
+                return "application/x-ndjson";
+        }
+    }
+
+    bool is_text(results_format format)
+    {
+        return format == results_format::json || format == results_format::otlp;
+    }
+
+    // The response only matters for its status, so the body is thrown away rather than
+    // written to stdout.
+    size_t discard_cb(char *, size_t size, size_t nmemb, void *)
+    {
+        return size * nmemb;
+    }
+}
+
+// The constructor only parses the destination and sets up the multi handle. The request
+// isn't started until the thread is running and there's something to send.
+HttpStreamSink::HttpStreamSink(std::string dest)
+    : ResultsSink(std::move(dest)), capacity(SENDER_QUEUE_SIZE_DEFAULT), overflow(sender_overflow::drop_oldest),
+      multi(nullptr), easy(nullptr), headers(nullptr), stream_format(results_format::json), paused(false),
+      ending(false), offset(0), newline_done(false), stream_reports(0), retry_delay(HTTP_STREAM_RETRY_MIN_MS)
+{
+    // Get the shared logger pointer.
+    logger = spdlog::get("epmon");
+    counters.capacity = capacity;
+    if (destination.compare(0, 14, "stream+http://") == 0 || destination.compare(0, 15, "stream+https://") == 0)
+        url = destination.substr(7);
+    else
+        logger->error("HttpStreamSink: can't use destination {0}", destination);
+    multi = curl_multi_init();
+    if (multi == nullptr)
+        logger->error("HttpStreamSink: curl_multi_init failed");
+}
+
+HttpStreamSink::~HttpStreamSink()
+{
+    if (easy != nullptr) {
+        curl_multi_remove_handle(multi, easy);
+        curl_easy_cleanup(easy);
+    }
+    curl_slist_free_all(headers);
+    if (multi != nullptr)
+        curl_multi_cleanup(multi);
+}
+
+void HttpStreamSink::configure(const Monitor_options &options)
+{
+    std::lock_guard<std::mutex> lck { queue_lock };
+    capacity = options.sender_queue_size;
+    counters.capacity = capacity;
+    overflow = options.sender_overflow_policy;
+}
+
+void HttpStreamSink::enqueue(std::shared_ptr<const results_report> report)
+{
+    std::unique_lock<std::mutex> lck { queue_lock };
+
+    if (queue.size() >= capacity) {
+        if (overflow == sender_overflow::coalesce) {
+            queue.back() = std::move(report);
+            counters.coalesced++;
+            counters.enqueued++;
+            return;
+        }
+        while (queue.size() >= capacity) {
+            queue.pop_front();
+            counters.dropped++;
+        }
+    }
+    queue.push_back(std::move(report));
+    counters.enqueued++;
+    counters.depth = queue.size();
+    lck.unlock();
+    not_empty.notify_one();
+    // The thread may be waiting in curl rather than on not_empty.
+    curl_multi_wakeup(multi);
+}
+
+sender_stats HttpStreamSink::stats()
+{
+    std::lock_guard<std::mutex> lck { queue_lock };
+    counters.depth = queue.size();
+    return counters;
+}
+
+size_t HttpStreamSink::read_cb(char *buffer, size_t size, size_t nitems, void *userp)
+{
+    return static_cast<HttpStreamSink *>(userp)->read_body(buffer, size * nitems);
+}
+
+// curl wants up to max more bytes of the body. Give it what's queued, pause the request
+// if there's nothing, or end it if the next report is in a different format.
+size_t HttpStreamSink::read_body(char *buffer, size_t max)
+{
+    size_t written = 0;
+
+    while (written < max) {
+        if (!current) {
+            std::lock_guard<std::mutex> lck { queue_lock };
+            if (queue.empty())
+                break;
+            if (queue.front()->format != stream_format) {
+                ending = true;
+                break;
+            }
+            current = queue.front();
+            queue.pop_front();
+            counters.depth = queue.size();
+            offset = 0;
+            newline_done = !is_text(stream_format);
+        }
+        size_t len = std::min(max - written, current->body.size() - offset);
+        memcpy(buffer + written, current->body.data() + offset, len);
+        offset += len;
+        written += len;
+        if (offset == current->body.size() && !newline_done && written < max) {
+            buffer[written++] = '\n';
+            newline_done = true;
+        }
+        if (offset == current->body.size() && newline_done) {
+            std::lock_guard<std::mutex> lck { queue_lock };
+            counters.sent++;
+            stream_reports++;
+            current.reset();
+        }
+    }
+    if (written > 0)
+        return written;
+    if (ending)
+        return 0;
+    paused = true;
+    return CURL_READFUNC_PAUSE;
+}
+
+// Start a new streaming request in stream_format.
+bool HttpStreamSink::start_request()
+{
+    easy = curl_easy_init();
+    if (easy == nullptr) {
+        logger->error("HttpStreamSink: curl_easy_init failed");
+        return false;
+    }
+    curl_slist_free_all(headers);
+    headers = nullptr;
+    headers = curl_slist_append(headers, (std::string("Content-Type: ") + stream_content_type(stream_format)).c_str());
+    headers = curl_slist_append(headers, "Transfer-Encoding: chunked");
+    // Don't wait for a 100 Continue before sending the body.
+    headers = curl_slist_append(headers, "Expect:");
+    curl_easy_setopt(easy, CURLOPT_URL, url.c_str());
+    curl_easy_setopt(easy, CURLOPT_POST, 1L);
+    curl_easy_setopt(easy, CURLOPT_HTTPHEADER, headers);
+    curl_easy_setopt(easy, CURLOPT_READFUNCTION, read_cb);
+    curl_easy_setopt(easy, CURLOPT_READDATA, (void *) this);
+    curl_easy_setopt(easy, CURLOPT_WRITEFUNCTION, discard_cb);
+    curl_easy_setopt(easy, CURLOPT_CONNECTTIMEOUT, (long) HTTP_STREAM_CONNECT_TIMEOUT);
+    curl_easy_setopt(easy, CURLOPT_TCP_KEEPALIVE, 1L);
+    curl_easy_setopt(easy, CURLOPT_TCP_KEEPIDLE, (long) HTTP_STREAM_KEEPIDLE);
+    curl_easy_setopt(easy, CURLOPT_TCP_KEEPINTVL, (long) HTTP_STREAM_KEEPIDLE);
+    // We have more than one thread, so curl mustn't use signals for DNS timeouts.
+    curl_easy_setopt(easy, CURLOPT_NOSIGNAL, 1L);
+    paused = false;
+    ending = false;
+    stream_reports = 0;
+    if (curl_multi_add_handle(multi, easy) != CURLM_OK) {
+        logger->error("HttpStreamSink: curl_multi_add_handle failed");
+        curl_easy_cleanup(easy);
+        easy = nullptr;
+        return false;
+    }
+    std::lock_guard<std::mutex> lck { queue_lock };
+    counters.posts++;
+    logger->info("HttpStreamSink: opening a stream to {0}", url);
+    return true;
+}
+
+// The request has finished. Unless we ended it ourselves and the server was happy, that's
+// a failure: put back the report it was in the middle of, and wait before the next one.
+void HttpStreamSink::finish_request(CURLcode result)
+{
+    long status = 0;
+    curl_easy_getinfo(easy, CURLINFO_RESPONSE_CODE, &status);
+    bool ok = ending && result == CURLE_OK && status < 400;
+    if (result != CURLE_OK)
+        logger->error("HttpStreamSink: stream to {0} failed after {1} reports: {2}", url, stream_reports,
+                      curl_easy_strerror(result));
+    else if (!ok)
+        logger->error("HttpStreamSink: stream to {0} ended by the server after {1} reports, HTTP status {2}", url,
+                      stream_reports, status);
+    else
+        logger->info("HttpStreamSink: stream to {0} ended after {1} reports", url, stream_reports);
+    curl_multi_remove_handle(multi, easy);
+    curl_easy_cleanup(easy);
+    easy = nullptr;
+    if (ok) {
+        retry_delay = std::chrono::milliseconds(HTTP_STREAM_RETRY_MIN_MS);
+        return;
+    }
+    if (stream_reports > 0)
+        retry_delay = std::chrono::milliseconds(HTTP_STREAM_RETRY_MIN_MS);
+    retry_at = std::chrono::steady_clock::now() + retry_delay;
+    retry_delay = std::min(retry_delay * 2, std::chrono::milliseconds(HTTP_STREAM_RETRY_MAX_MS));
+    if (current) {
+        std::lock_guard<std::mutex> lck { queue_lock };
+        counters.failed++;
+        queue.push_front(std::move(current));
+        counters.depth = queue.size();
+        current.reset();
+    }
+}
+
+// This is the thread function. It runs forever. With no request open it waits for a
+// report, and for any retry wait to pass, then opens one; with a request open it lets curl
+// get on with it, unpausing it whenever there's a report for it.
+void HttpStreamSink::send_loop()
+{
+    logger->info("begin HttpStreamSink::send_loop for {0}", destination);
+    retry_at = std::chrono::steady_clock::now();
+    while(true) {
+        bool unpause = false;
+        {
+            std::unique_lock<std::mutex> lck { queue_lock };
+            if (easy == nullptr) {
+                not_empty.wait(lck, [this] { return !queue.empty(); });
+                if (std::chrono::steady_clock::now() < retry_at) {
+                    not_empty.wait_until(lck, retry_at);
+                    continue;
+                }
+                stream_format = queue.front()->format;
+            }
+            else if (paused && !queue.empty()) {
+                paused = false;
+                unpause = true;
+            }
+        }
+        if (easy == nullptr && !start_request()) {
+            retry_at = std::chrono::steady_clock::now() + retry_delay;
+            retry_delay = std::min(retry_delay * 2, std::chrono::milliseconds(HTTP_STREAM_RETRY_MAX_MS));
+            continue;
+        }
+        if (unpause)
+            curl_easy_pause(easy, CURLPAUSE_CONT);
+        int running = 0;
+        curl_multi_perform(multi, &running);
+        CURLMsg *msg;
+        int left = 0;
+        while ((msg = curl_multi_info_read(multi, &left)) != nullptr) {
+            if (msg->msg == CURLMSG_DONE && msg->easy_handle == easy)
+                finish_request(msg->data.result);
+        }
+        if (easy != nullptr)
+            curl_multi_poll(multi, nullptr, 0, HTTP_STREAM_POLL_MS, nullptr);
+    }
+}
@@ -0,0 +1,78 @@
+// http_stream_sink.h
+// This file defines the HttpStreamSink class. See http_stream_sink.cpp for more information.
+
+#ifndef EPMON_HTTP_STREAM_SINK_H
+#define EPMON_HTTP_STREAM_SINK_H
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <curl/curl.h>
+#include <spdlog/spdlog.h>
+#include "results_sink.h"
+
+class HttpStreamSink : public ResultsSink {
+public:
+    // dest is stream+http://... or stream+https://...
+    explicit HttpStreamSink(std::string dest);
+    ~HttpStreamSink() override;
+    HttpStreamSink(const HttpStreamSink &) = delete;
+    HttpStreamSink &operator=(const HttpStreamSink &) = delete;
+
+    // False if the destination couldn't be parsed, or curl couldn't be set up.
+    bool valid() const { return multi != nullptr && !url.empty(); }
+
+    std::thread run() override { return std::thread([this] { this->send_loop(); }); }
+    // Pick up the queue size and overflow policy.
+    void configure(const Monitor_options &options) override;
+    void enqueue(std::shared_ptr<const results_report> report) override;
+    sender_stats stats() override;
+
+private:
+    // The URL, without the stream+ in front.
+    std::string url;
+    // The queue and what to do when it's full, protected by queue_lock.
+    std::deque<std::shared_ptr<const results_report>> queue;
+    size_t capacity;
+    sender_overflow overflow;
+    sender_stats counters;
+    std::mutex queue_lock;
+    std::condition_variable not_empty;
+    // The logger.
+    std::shared_ptr<spdlog::logger> logger;
+    // The multi handle, which lives as long as the sink so enqueue() can wake it, and the
+    // streaming request, or null between requests.
+    CURLM *multi;
+    CURL *easy;
+    struct curl_slist *headers;
+    // The format of the reports on the current request; a report in another format ends
+    // it, and the next request is started in the new format.
+    results_format stream_format;
+    // Set when the read callback has paused the request for want of a report, and when
+    // it has ended the request for a format change.
+    bool paused;
+    bool ending;
+    // The report being written and how much of it has been, plus whether its newline
+    // has. The report is put back on the queue if the request fails before it's all
+    // written.
+    std::shared_ptr<const results_report> current;
+    size_t offset;
+    bool newline_done;
+    // Reports finished on the current request.
+    unsigned long long stream_reports;
+    // After a failure, how long to wait before trying again, and when that is.
+    std::chrono::milliseconds retry_delay;
+    std::chrono::steady_clock::time_point retry_at;
+
+    static size_t read_cb(char *buffer, size_t size, size_t nitems, void *userp);
+    size_t read_body(char *buffer, size_t max);
+    bool start_request();
+    void finish_request(CURLcode result);
+    void send_loop();
+};
+
+#endif //EPMON_HTTP_STREAM_SINK_H
@@ -0,0 +1,215 @@
+// http_stream_test.cpp
+// This is a test program for the HttpStreamSink (see http_stream_sink.cpp). It plays the
+// collector itself, on a loopback port, and checks that:
+//   - the sink opens one chunked POST and the reports queued on it arrive as whole
+//     NDJSON frames, in order, one per line
+//   - when the connection is closed in the middle of a report, the sink opens a new
+//     request and resumes with that report, whole, followed by the ones queued after it,
+//     without sending again the reports that had got through
+// The report cut off is HTTP_STREAM_TEST_BIG_BYTES long, too big for the socket buffers,
+// so it's still being written when the connection goes. Every wait has a timeout, so a
+// sink that doesn't do what it should makes the test fail rather than hang. It exits with
+// 0 if it passes and 1 if it doesn't, so ctest can run it. The sink's thread never
+// returns, so the program ends with _exit() rather than waiting for it.
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <curl/curl.h>
+#include <spdlog/spdlog.h>
+#include <spdlog/sinks/null_sink.h>
+#include "http_stream_sink.h"
+#include "nlohmann_json/json.hpp"
+
+using json = nlohmann::json;
+
+// How long to wait for the sink to connect, or to send more, in milliseconds.
+#define HTTP_STREAM_TEST_TIMEOUT_MS 15000
+// The size of the report the connection is closed in the middle of.
+#define HTTP_STREAM_TEST_BIG_BYTES  (16 * 1024 * 1024)
+// How much of that report to read before closing the connection.
+#define HTTP_STREAM_TEST_CUT_BYTES  65536
+
+// An anonymous namespace for functions that don't need to be visible outside this file.
+namespace {
+    // One request from the sink, and the chunked body read from it so far.
+    struct stream_conn {
+        int fd = -1;
+        // Bytes read but not decoded yet, and the decoded body.
+        std::string raw;
+        std::string body;
+        std::string headers;
+        // The complete lines taken from the front of body.
+        std::vector<std::string> frames;
+    };
+
+    void fail(const std::string &why)
+    {
+        std::cerr << "FAIL: " << why << std::endl;
+        fflush(stdout);
+        _exit(1);
+    }
+
+    // Read more from the connection into raw, waiting no longer than the timeout.
+    // Returns false if the connection closed or nothing came.
+    bool read_more(stream_conn &conn)
+    {
+        struct pollfd pfd = { conn.fd, POLLIN, 0 };
+        if (poll(&pfd, 1, HTTP_STREAM_TEST_TIMEOUT_MS) <= 0)
+            return false;
+        char chunk[65536];
+        ssize_t len = read(conn.fd, chunk, sizeof(chunk));
+        if (len <= 0)
+            return false;
+        conn.raw.append(chunk, len);
+        return true;
+    }
+
+    // Decode the complete chunks in raw into body, and the complete lines in body into
+    // frames. A chunk is its length in hex, CRLF, the data, CRLF.
+    void decode(stream_conn &conn)
+    {
+        while (true) {
+            size_t eol = conn.raw.find("\r\n");
+            if (eol == std::string::npos)
+                break;
+            size_t len = strtoul(conn.raw.substr(0, eol).c_str(), nullptr, 16);
+            if (conn.raw.size() < eol + 2 + len + 2)
+                break;
+            conn.body.append(conn.raw, eol + 2, len);
+            conn.raw.erase(0, eol + 2 + len + 2);
+        }
+        size_t nl;
+        while ((nl = conn.body.find('\n')) != std::string::npos) {
+            conn.frames.push_back(conn.body.substr(0, nl));
+            conn.body.erase(0, nl + 1);
+        }
+    }
+
+    // Wait for the sink to connect, and read the request headers.
+    void accept_request(int listen_fd, stream_conn &conn)
+    {
+        struct pollfd pfd = { listen_fd, POLLIN, 0 };
+        if (poll(&pfd, 1, HTTP_STREAM_TEST_TIMEOUT_MS) <= 0)
+            fail("the sink didn't connect");
+        conn.fd = accept(listen_fd, nullptr, nullptr);
+        if (conn.fd < 0)
+            fail(std::string("accept failed: ") + strerror(errno));
+        size_t end;
+        while ((end = conn.raw.find("\r\n\r\n")) == std::string::npos) {
+            if (!read_more(conn))
+                fail("the request headers didn't arrive");
+        }
+        conn.headers = conn.raw.substr(0, end + 2);
+        conn.raw.erase(0, end + 4);
+        if (strcasestr(conn.headers.c_str(), "\r\nTransfer-Encoding: chunked\r\n") == nullptr ||
+            strcasestr(conn.headers.c_str(), "\r\nContent-Type: application/x-ndjson\r\n") == nullptr)
+            fail("the request isn't a chunked NDJSON POST:\n" + conn.headers);
+    }
+
+    // Read until count frames have arrived on the connection.
+    void read_frames(stream_conn &conn, size_t count)
+    {
+        decode(conn);
+        while (conn.frames.size() < count) {
+            if (!read_more(conn))
+                fail("only " + std::to_string(conn.frames.size()) + " of " + std::to_string(count) +
+                     " reports arrived");
+            decode(conn);
+        }
+    }
+
+    // Check that a frame is the whole report with the given number, and as long as it
+    // should be.
+    void check_frame(const std::string &frame, int number, size_t size)
+    {
+        json report = json::parse(frame, nullptr, false);
+        if (report.is_discarded() || !report.is_object() || report.value("report", -1) != number ||
+            frame.size() != size)
+            fail("expected report " + std::to_string(number) + " in " + std::to_string(size) + " bytes, got " +
+                 std::to_string(frame.size()) + " bytes: " + frame.substr(0, 80));
+    }
+
+    // Make report number, padded out to size bytes of JSON.
+    std::shared_ptr<const results_report> make_report(int number, size_t size)
+    {
+        std::shared_ptr<results_report> report(new results_report);
+        std::string head = "{\"report\":" + std::to_string(number) + ",\"pad\":\"";
+        report->body = head + std::string(size - head.size() - 2, 'x') + "\"}";
+        return report;
+    }
+}
+
+int main()
+{
+    auto logger = std::make_shared<spdlog::logger>("epmon", std::make_shared<spdlog::sinks::null_sink_mt>());
+    spdlog::register_logger(logger);
+    setenv("NO_PROXY", "127.0.0.1", 1);
+    setenv("no_proxy", "127.0.0.1", 1);
+    curl_global_init(CURL_GLOBAL_ALL);
+
+    int listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    struct sockaddr_in addr = {};
+    socklen_t addr_len = sizeof(addr);
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (listen_fd < 0 || bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(listen_fd, 1) < 0 ||
+        getsockname(listen_fd, (struct sockaddr *) &addr, &addr_len) < 0)
+        fail(std::string("can't listen on a loopback port: ") + strerror(errno));
+
+    HttpStreamSink sink("stream+http://127.0.0.1:" + std::to_string(ntohs(addr.sin_port)) + "/stream");
+    if (!sink.valid())
+        fail("the sink can't use the destination");
+    sink.run().detach();
+
+    // Three reports on the first request, each a whole frame.
+    static const size_t small_sizes[] = { 100, 5000, 70000 };
+    for (int ii = 0; ii < 3; ii++)
+        sink.enqueue(make_report(ii + 1, small_sizes[ii]));
+    stream_conn first;
+    accept_request(listen_fd, first);
+    read_frames(first, 3);
+    for (int ii = 0; ii < 3; ii++)
+        check_frame(first.frames[ii], ii + 1, small_sizes[ii]);
+
+    // Close the connection partway through a big one.
+    sink.enqueue(make_report(4, HTTP_STREAM_TEST_BIG_BYTES));
+    size_t got = 0;
+    while (got < HTTP_STREAM_TEST_CUT_BYTES) {
+        if (!read_more(first))
+            fail("the big report didn't start arriving");
+        got += first.raw.size();
+        first.raw.clear();
+    }
+    close(first.fd);
+
+    // The sink comes back with the big report, whole, and then the ones queued since.
+    sink.enqueue(make_report(5, 200));
+    sink.enqueue(make_report(6, 300));
+    stream_conn second;
+    accept_request(listen_fd, second);
+    read_frames(second, 3);
+    check_frame(second.frames[0], 4, HTTP_STREAM_TEST_BIG_BYTES);
+    check_frame(second.frames[1], 5, 200);
+    check_frame(second.frames[2], 6, 300);
+    if (second.frames.size() != 3 || !second.body.empty())
+        fail("more than the expected reports arrived on the second request");
+    sender_stats stats = sink.stats();
+    if (stats.posts != 2)
+        fail("the sink opened " + std::to_string(stats.posts) + " requests instead of 2");
+
+    std::cout << "PASS: 3 reports on the first request; the cut-off " << HTTP_STREAM_TEST_BIG_BYTES
+              << " byte report and 2 more whole on the second" << std::endl;
+    fflush(stdout);
+    _exit(0);
+}
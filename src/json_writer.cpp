@@ -0,0 +1,180 @@
+// json_writer.cpp
+// This file implements the JsonWriter class, which writes JSON text straight into a
+// string without building a json object first. The reports are written with it (see
+// results.cpp): building a json object for every app, copying them into an array and
+// then calling dump() costs an allocation or several for every key and value, when all
+// we want at the end is the text.
+// The output is byte for byte what dump() would produce for the same values, so the
+// results server can't tell the difference: no whitespace, numbers formatted by the same
+// code nlohmann json uses (nlohmann::detail::to_chars for doubles, so 0 is "0.0"), and
+// strings escaped the same way. dump() writes object members in sorted key order, since
+// json objects are std::maps, so callers have to write the keys in that order too.
+// What It Doesn't Do
+// There's no checking: a key outside an object, or a missing end_object(), just makes
+// bad JSON. Invalid UTF-8 in a string is copied through as it is, where dump() would
+// throw an exception.
+// Testing
+// Writing a few objects with both JsonWriter and dump() and comparing the strings is the
+// obvious test, especially for doubles and strings with control characters in them.
+
+#include "json_writer.h"
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+
+JsonWriter::JsonWriter(std::string &out)
+    : out(out), after_key(false)
+{
+}
+
+// Put a comma before the value if it isn't the first one in its object or array.
+void JsonWriter::separate()
+{
+    if (after_key) {
+        after_key = false;
+        return;
+    }
+    if (!not_empty.empty()) {
+        if (not_empty.back())
+            out.push_back(',');
+        not_empty.back() = true;
+    }
+}
+
+void JsonWriter::begin_object()
+{
+    separate();
+    out.push_back('{');
+    not_empty.push_back(false);
+}
+
+void JsonWriter::end_object()
+{
+    out.push_back('}');
+    not_empty.pop_back();
+}
+
+void JsonWriter::begin_array()
+{
+    separate();
+    out.push_back('[');
+    not_empty.push_back(false);
+}
+
+void JsonWriter::end_array()
+{
+    out.push_back(']');
+    not_empty.pop_back();
+}
+
+void JsonWriter::key(const char *name)
+{
+    separate();
+    write_string(name, strlen(name));
+    out.push_back(':');
+    after_key = true;
+}
+
+void JsonWriter::key(const std::string &name)
+{
+    separate();
+    write_string(name.data(), name.size());
+    out.push_back(':');
+    after_key = true;
+}
+
+void JsonWriter::value(const std::string &str)
+{
+    separate();
+    write_string(str.data(), str.size());
+}
+
+void JsonWriter::value(const char *str)
+{
+    separate();
+    write_string(str, strlen(str));
+}
+
+void JsonWriter::value(double num)
+{
+    separate();
+    if (!std::isfinite(num)) {
+        out.append("null");
+        return;
+    }
+    char buf[64];
+    char *end = nlohmann::detail::to_chars(buf, buf + sizeof(buf), num);
+    out.append(buf, end - buf);
+}
+
+void JsonWriter::value(long long num)
+{
+    char buf[32];
+    separate();
+    int len = snprintf(buf, sizeof(buf), "%lld", num);
+    out.append(buf, len);
+}
+
+void JsonWriter::value(unsigned long long num)
+{
+    char buf[32];
+    separate();
+    int len = snprintf(buf, sizeof(buf), "%llu", num);
+    out.append(buf, len);
+}
+
+void JsonWriter::value(const json &j)
+{
+    separate();
+    out.append(j.dump());
+}
+
+void JsonWriter::raw(const std::string &text)
+{
+    separate();
+    out.append(text);
+}
+
+// Write a quoted string, escaped the way dump() does it: the two-character escapes
+// where there is one, \u00XX for the other control characters, and everything else as
+// it is.
+void JsonWriter::write_string(const char *str, size_t len)
+{
+    out.push_back('"');
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = (unsigned char) str[i];
+        switch (c) {
+            case '"':
+                out.append("\\\"");
+                break;
+            case '\\':
+                out.append("\\\\");
+                break;
+            case '\b':
+                out.append("\\b");
+                break;
+            case '\f':
+                out.append("\\f");
+                break;
+            case '\n':
+                out.append("\\n");
+                break;
+            case '\r':
+                out.append("\\r");
+                break;
+            case '\t':
+                out.append("\\t");
+                break;
+            default:
+                if (c < 0x20) {
+                    char buf[8];
+                    snprintf(buf, sizeof(buf), "\\u%04x", c);
+                    out.append(buf, 6);
+                }
+                else
+                    out.push_back((char) c);
+                break;
+        }
+    }
+    out.push_back('"');
+}
@@ -0,0 +1,48 @@
+// json_writer.h
+// This file defines the JsonWriter class. See json_writer.cpp for more information.
+
+#ifndef EPMON_JSON_WRITER_H
+#define EPMON_JSON_WRITER_H
+
+#include <string>
+#include <vector>
+#include "nlohmann_json/json.hpp"
+
+using json = nlohmann::json;
+
+class JsonWriter {
+public:
+    // Append to out, which is not cleared first.
+    explicit JsonWriter(std::string &out);
+
+    void begin_object();
+    void end_object();
+    void begin_array();
+    void end_array();
+    // Start an object member. Members must be written in sorted key order to match dump().
+    void key(const char *name);
+    void key(const std::string &name);
+    void value(const std::string &str);
+    void value(const char *str);
+    void value(double num);
+    void value(long long num);
+    void value(unsigned long long num);
+    void value(int num) { value((long long) num); }
+    // Write a JSON value that's already been built, as dump() would.
+    void value(const json &j);
+    // Write a value that's already JSON text, e.g. one that's written many times.
+    void raw(const std::string &text);
+
+private:
+    std::string &out;
+    // One entry for each open object or array: whether it has anything in it yet, so we
+    // know when a comma is needed.
+    std::vector<bool> not_empty;
+    // Set between a key and its value.
+    bool after_key;
+
+    void separate();
+    void write_string(const char *str, size_t len);
+};
+
+#endif //EPMON_JSON_WRITER_H
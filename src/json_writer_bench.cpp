@@ -0,0 +1,166 @@
+// json_writer_bench.cpp
+// This is a benchmark of write_report() (see results.cpp), which writes the JSON text of a
+// report straight from the results with a JsonWriter, against the old way of building the
+// report as a json object with report_to_json() and writing that with dump(). For rounds
+// of 10 up to 10000 made-up results, in both layouts, it prints the heap allocations, the
+// bytes allocated and the time each way takes to make one report. Allocations are counted
+// by replacing the global operator new.
+// write_report() is only a drop-in replacement if it gives exactly the same text, so
+// before timing anything every case is checked for that: all the layouts and timestamp
+// formats, with and without results and extra top-level members. Any difference is
+// printed and the program exits with 1. With --check it only does the checks, which is
+// how ctest runs it.
+// Usage: json_writer_bench [--check]
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <new>
+#include <string>
+#include <vector>
+#include "results.h"
+#include "sample_results.h"
+
+// How many times each report is made for the timings.
+#define JSON_WRITER_BENCH_RUNS  20
+
+// The heap allocations since startup, and their total size.
+static unsigned long long alloc_count = 0;
+static unsigned long long alloc_bytes = 0;
+
+// Kept out of line, so the compiler doesn't see the malloc() and free() inside them and
+// think they're mismatched with new and delete.
+__attribute__((noinline)) void *operator new(size_t size)
+{
+    alloc_count++;
+    alloc_bytes += size;
+    void *ptr = malloc(size ? size : 1);
+    if (ptr == nullptr)
+        throw std::bad_alloc();
+    return ptr;
+}
+
+__attribute__((noinline)) void operator delete(void *ptr) noexcept
+{
+    free(ptr);
+}
+
+__attribute__((noinline)) void operator delete(void *ptr, size_t) noexcept
+{
+    free(ptr);
+}
+
+// An anonymous namespace for functions that don't need to be visible outside this file.
+namespace {
+    // The other top-level members a report can have, some sorting before "healthcheck"
+    // and some after it.
+    json make_extra()
+    {
+        return {
+                {"delta", {{"keyframe", true}, {"unchanged", 0}}},
+                {"host", {{"cpu", 12.5}, {"load", {0.5, 0.25, 0.125}}, {"memory_total", 16384000}}},
+                {"sender", {{"depth", 0}, {"dropped", 0}, {"sent", 1234567890123ULL}}},
+                {"top", json::array({{{"app", "cc1plus"}, {"cpu", 99.5}}})},
+        };
+    }
+
+    // Check that write_report() gives the same text as dump() for the results. Returns
+    // false, and says how they differ, if it doesn't.
+    bool check_same(const std::vector<app_result> &results, const json &timestamp, results_layout layout,
+                    const json &extra)
+    {
+        std::string written;
+        write_report(written, results, timestamp, layout, extra);
+        std::string dumped = report_to_json(results, timestamp, layout, extra).dump();
+        if (written == dumped)
+            return true;
+        size_t pos = 0;
+        while (pos < written.size() && pos < dumped.size() && written[pos] == dumped[pos])
+            pos++;
+        size_t start = pos > 40 ? pos - 40 : 0;
+        printf("FAIL: %zu results, %s layout, timestamp %s, %s extra: differs at byte %zu\n"
+               "  write_report: ...%s\n  dump():       ...%s\n",
+               results.size(), layout == results_layout::rows ? "rows" : "columns", timestamp.dump().c_str(),
+               extra.empty() ? "no" : "with", pos, written.substr(start, 80).c_str(),
+               dumped.substr(start, 80).c_str());
+        return false;
+    }
+
+    // Run check_same() for every combination. Returns the number that failed.
+    int check_all()
+    {
+        static const size_t counts[] = { 0, 1, 4, 100 };
+        static const time_format formats[] = { time_format::ctime, time_format::epoch_ns, time_format::rfc3339 };
+        static const results_layout layouts[] = { results_layout::rows, results_layout::columns };
+        auto now = std::chrono::system_clock::now();
+        int failed = 0;
+        int checked = 0;
+        for (size_t count : counts) {
+            std::vector<app_result> results = make_sample_results(count);
+            for (time_format format : formats) {
+                for (results_layout layout : layouts) {
+                    failed += !check_same(results, format_timestamp(format, now), layout, json::object());
+                    failed += !check_same(results, format_timestamp(format, now), layout, make_extra());
+                    checked += 2;
+                }
+            }
+        }
+        printf("%d of %d cases give the same text as dump()\n", checked - failed, checked);
+        return failed;
+    }
+
+    // Make the report JSON_WRITER_BENCH_RUNS times and print the allocations and time
+    // per report.
+    void bench(const char *name, size_t count, const char *layout, const std::function<void(std::string &)> &make)
+    {
+        unsigned long long start_count = alloc_count;
+        unsigned long long start_bytes = alloc_bytes;
+        size_t size = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (int ii = 0; ii < JSON_WRITER_BENCH_RUNS; ii++) {
+            std::string out;
+            make(out);
+            size = out.size();
+        }
+        double usec = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+        printf("%-6zu %-8s %-13s %10zu %12.1f %14.1f %12.1f\n", count, layout, name, size,
+               (double) (alloc_count - start_count) / JSON_WRITER_BENCH_RUNS,
+               (double) (alloc_bytes - start_bytes) / JSON_WRITER_BENCH_RUNS, usec / JSON_WRITER_BENCH_RUNS);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    if (check_all() > 0)
+        return 1;
+    if (argc > 1 && strcmp(argv[1], "--check") == 0)
+        return 0;
+
+    static const size_t counts[] = { 10, 100, 1000, 10000 };
+    json timestamp = format_timestamp(time_format::ctime, std::chrono::system_clock::now());
+    json extra = make_extra();
+    printf("\n%-6s %-8s %-13s %10s %12s %14s %12s\n", "apps", "layout", "writer", "bytes", "allocs", "alloc bytes",
+           "usec");
+    for (size_t count : counts) {
+        std::vector<app_result> results = make_sample_results(count);
+        for (results_layout layout : { results_layout::rows, results_layout::columns }) {
+            const char *layout_name = layout == results_layout::rows ? "rows" : "columns";
+            bench("dump()", count, layout_name, [&](std::string &out) {
+                out = report_to_json(results, timestamp, layout, extra).dump();
+            });
+            bench("write_report", count, layout_name, [&](std::string &out) {
+                write_report(out, results, timestamp, layout, extra);
+            });
+            // As the Monitor does it, with room for the report reserved up front.
+            size_t last_size = 0;
+            bench("+ reserve", count, layout_name, [&](std::string &out) {
+                out.reserve(last_size);
+                write_report(out, results, timestamp, layout, extra);
+                last_size = out.size();
+            });
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,340 @@
+// line_sink.cpp
+// This file implements the LineSink class, the results sink (see results_sink.cpp) for
+// metrics pipelines that take UDP line protocol rather than reports:
+//   statsd://HOST:PORT  a gauge per number, named for the app:
+//                         epmon.app.bash.cpu:0.264|g
+//                         epmon.app.bash.memory:13852|g
+//                         epmon.cgroup.nginx.io_write:4096|g
+//                       and so on, for cpu, memory, memory_anon, memory_file, io_read and
+//                       io_write
+//   influx://HOST:PORT  a point per app, in InfluxDB line protocol, stamped with the time
+//                       the round was sampled:
+//                         epmon_app,app=bash,pid=2544 cpu=0.264,memory=13852 1637593371000000000
+//                         epmon_cgroup,app=nginx,cgroup=/sys/fs/cgroup/... cpu=0.264,... 1637593371000000000
+// Sending a datagram costs about the same whether it has one line in it or fifty, so the
+// lines are packed, newline separated, into as few datagrams of up to LINE_DATAGRAM_MAX
+// bytes as they fit in, and the whole round goes out with a single sendmmsg() call. A
+// round is a handful of packets however many apps there are.
+// The sink formats the results itself, so it gets the whole round from the Monitor
+// rather than the report, before any delta filtering (see monitor.cpp). Like the other
+// sinks it has its own bounded queue and its own thread. The queue follows the
+// configured overflow policy, except that block is treated as drop_oldest, as for the
+// StreamSink. If the host can't be looked up the sink waits LINE_RETRY_MIN_MS before
+// trying again, doubling the wait up to LINE_RETRY_MAX_MS, with the round left at the
+// front of the queue. A round that can't be sent is just counted and dropped; UDP doesn't
+// promise delivery anyway. The counters count rounds as reports, and datagrams as posts.
+// What It Doesn't Do
+// Only the per-app numbers are sent; the host metrics, pressure, top processes and the
+// sender counters aren't. There's no prefix, tag or sample rate configuration, and no
+// DogStatsD tags. A single line longer than LINE_DATAGRAM_MAX goes in a datagram by
+// itself, and may be fragmented or dropped on the way.
+// Testing
+// nc -lu PORT shows the lines as they arrive.
+
+#include "line_sink.h"
+#include "stream_sink.h"
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+// The most we put in one datagram: what fits in a 1500 byte Ethernet frame after the
+// IPv6 and UDP headers, with a little to spare for tunnels, so nothing gets fragmented.
+#define LINE_DATAGRAM_MAX       1432
+// The shortest and longest waits before trying to look up the host again.
+#define LINE_RETRY_MIN_MS       1000
+#define LINE_RETRY_MAX_MS       60000
+
+// An anonymous namespace for functions that don't need to be in the LineSink class itself.
+namespace {
+    void append_number(std::string &out, double num)
+    {
+        char buf[32];
+        int len = snprintf(buf, sizeof(buf), "%.10g", num);
+        out.append(buf, len);
+    }
+
+    // StatsD names are dot separated, and can't have the : or | that delimit the value,
+    // so anything but letters, digits, - and _ in an app name becomes _.
+    void append_statsd_name(std::string &out, const std::string &name)
+    {
+        for (char c : name) {
+            if (isalnum((unsigned char) c) || c == '-' || c == '_')
+                out.push_back(c);
+            else
+                out.push_back('_');
+        }
+    }
+
+    void append_statsd_gauge(std::string &out, const std::string &prefix, const char *metric, double value)
+    {
+        if (!std::isfinite(value))
+            return;
+        if (!out.empty())
+            out.push_back('\n');
+        out.append(prefix);
+        out.append(metric);
+        out.push_back(':');
+        append_number(out, value);
+        out.append("|g");
+    }
+
+    // Tag values escape commas, spaces and equals signs with a backslash. A newline
+    // can't be escaped at all, so it becomes a space.
+    void append_influx_tag(std::string &out, const char *key, const std::string &value)
+    {
+        out.push_back(',');
+        out.append(key);
+        out.push_back('=');
+        for (char c : value) {
+            if (c == ',' || c == ' ' || c == '=')
+                out.push_back('\\');
+            out.push_back((c == '\n' || c == '\r') ? ' ' : c);
+        }
+    }
+
+    // Influx has no way to write NaN or infinity, so those fields are left out.
+    void append_influx_field(std::string &out, bool &first, const char *key, double value)
+    {
+        if (!std::isfinite(value))
+            return;
+        out.push_back(first ? ' ' : ',');
+        first = false;
+        out.append(key);
+        out.push_back('=');
+        append_number(out, value);
+    }
+
+    // The lines for one app, newline separated.
+    void statsd_lines(std::string &out, const app_result &result)
+    {
+        std::string prefix(result.is_cgroup ? "epmon.cgroup." : "epmon.app.");
+        append_statsd_name(prefix, result.app);
+        prefix.push_back('.');
+        append_statsd_gauge(out, prefix, "cpu", result.cpu);
+        append_statsd_gauge(out, prefix, "memory", result.memory);
+        if (result.is_cgroup) {
+            append_statsd_gauge(out, prefix, "memory_anon", result.memory_anon);
+            append_statsd_gauge(out, prefix, "memory_file", result.memory_file);
+            append_statsd_gauge(out, prefix, "io_read", result.io_read);
+            append_statsd_gauge(out, prefix, "io_write", result.io_write);
+        }
+    }
+
+    // The point for one app, or nothing if none of its numbers can be written.
+    void influx_line(std::string &out, const app_result &result, const std::string &stamp)
+    {
+        bool first = true;
+        out.append(result.is_cgroup ? "epmon_cgroup" : "epmon_app");
+        append_influx_tag(out, "app", result.app);
+        if (result.is_cgroup)
+            append_influx_tag(out, "cgroup", result.cgroup);
+        else
+            append_influx_tag(out, "pid", std::to_string(result.pid));
+        append_influx_field(out, first, "cpu", result.cpu);
+        append_influx_field(out, first, "memory", result.memory);
+        if (result.is_cgroup) {
+            append_influx_field(out, first, "memory_anon", result.memory_anon);
+            append_influx_field(out, first, "memory_file", result.memory_file);
+            append_influx_field(out, first, "io_read", result.io_read);
+            append_influx_field(out, first, "io_write", result.io_write);
+        }
+        if (first) {
+            out.clear();
+            return;
+        }
+        out.push_back(' ');
+        out.append(stamp);
+    }
+}
+
+// The constructor only parses the destination. The socket isn't opened until the thread
+// is running.
+LineSink::LineSink(std::string dest)
+    : ResultsSink(std::move(dest)), protocol(line_protocol::none), capacity(SENDER_QUEUE_SIZE_DEFAULT),
+      overflow(sender_overflow::drop_oldest), fd(-1), retry_delay(LINE_RETRY_MIN_MS)
+{
+    // Get the shared logger pointer.
+    logger = spdlog::get("epmon");
+    counters.capacity = capacity;
+    line_protocol scheme = line_protocol::none;
+    std::string rest;
+    if (destination.compare(0, 7, "statsd:") == 0)
+        scheme = line_protocol::statsd;
+    else if (destination.compare(0, 7, "influx:") == 0)
+        scheme = line_protocol::influx;
+    rest = destination.substr(std::min(destination.size(), (size_t) 7));
+    if (rest.compare(0, 2, "//") == 0)
+        rest.erase(0, 2);
+    if (scheme != line_protocol::none && split_host_port(rest, host, port))
+        protocol = scheme;
+    else
+        logger->error("LineSink: can't use destination {0}", destination);
+}
+
+LineSink::~LineSink()
+{
+    if (fd >= 0)
+        close(fd);
+}
+
+void LineSink::configure(const Monitor_options &options)
+{
+    std::lock_guard<std::mutex> lck { queue_lock };
+    capacity = options.sender_queue_size;
+    counters.capacity = capacity;
+    overflow = options.sender_overflow_policy;
+}
+
+void LineSink::enqueue_round(std::shared_ptr<const results_round> round)
+{
+    std::unique_lock<std::mutex> lck { queue_lock };
+
+    if (queue.size() >= capacity) {
+        if (overflow == sender_overflow::coalesce) {
+            queue.back() = std::move(round);
+            counters.coalesced++;
+            counters.enqueued++;
+            return;
+        }
+        while (queue.size() >= capacity) {
+            queue.pop_front();
+            counters.dropped++;
+        }
+    }
+    queue.push_back(std::move(round));
+    counters.enqueued++;
+    counters.depth = queue.size();
+    lck.unlock();
+    not_empty.notify_one();
+}
+
+sender_stats LineSink::stats()
+{
+    std::lock_guard<std::mutex> lck { queue_lock };
+    counters.depth = queue.size();
+    return counters;
+}
+
+// Format the round's lines into packed, starting a new datagram whenever the next line
+// won't fit in the current one.
+void LineSink::pack_round(const results_round &round)
+{
+    std::string lines;
+    std::string stamp = std::to_string(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(round.when.time_since_epoch()).count());
+    size_t start = 0;
+
+    packed.clear();
+    packet_ends.clear();
+    for (const app_result &result : round.results) {
+        lines.clear();
+        if (protocol == line_protocol::statsd)
+            statsd_lines(lines, result);
+        else
+            influx_line(lines, result, stamp);
+        // The StatsD lines for one app go in the same datagram if they fit, but may be
+        // split between two.
+        size_t pos = 0;
+        while (pos < lines.size()) {
+            size_t end = lines.find('\n', pos);
+            if (end == std::string::npos)
+                end = lines.size();
+            size_t len = end - pos;
+            if (packed.size() > start && packed.size() - start + 1 + len > LINE_DATAGRAM_MAX) {
+                packet_ends.push_back(packed.size());
+                start = packed.size();
+            }
+            if (packed.size() > start)
+                packed.push_back('\n');
+            packed.append(lines, pos, len);
+            pos = end + 1;
+        }
+    }
+    if (packed.size() > start)
+        packet_ends.push_back(packed.size());
+}
+
+// Send all of the datagrams, as few sendmmsg() calls as it takes; usually one.
+bool LineSink::send_packets()
+{
+    size_t count = packet_ends.size();
+    std::vector<struct mmsghdr> msgs(count);
+    std::vector<struct iovec> iovs(count);
+    size_t start = 0;
+
+    for (size_t ii = 0; ii < count; ii++) {
+        iovs[ii].iov_base = &packed[start];
+        iovs[ii].iov_len = packet_ends[ii] - start;
+        msgs[ii].msg_hdr.msg_iov = &iovs[ii];
+        msgs[ii].msg_hdr.msg_iovlen = 1;
+        start = packet_ends[ii];
+    }
+    size_t done = 0;
+    while (done < count) {
+        int nsent = sendmmsg(fd, &msgs[done], (unsigned int) (count - done), MSG_NOSIGNAL);
+        if (nsent < 0) {
+            if (errno == EINTR)
+                continue;
+            logger->warn("LineSink: sending {0} datagrams to {1} failed: {2}", count - done, destination,
+                         strerror(errno));
+            return false;
+        }
+        done += nsent;
+    }
+    return true;
+}
+
+// This is the thread function. It runs forever, sending the round at the front of the
+// queue whenever there is one and we're not waiting to retry. The queue is only locked
+// while we look at it, never while we format or send.
+void LineSink::send_loop()
+{
+    logger->info("begin LineSink::send_loop for {0}", destination);
+    retry_at = std::chrono::steady_clock::now();
+    std::unique_lock<std::mutex> lck { queue_lock };
+    while(true) {
+        not_empty.wait(lck, [this] { return !queue.empty(); });
+        if (std::chrono::steady_clock::now() < retry_at) {
+            not_empty.wait_until(lck, retry_at);
+            continue;
+        }
+        std::shared_ptr<const results_round> round = queue.front();
+        lck.unlock();
+        if (fd < 0) {
+            std::string error;
+            fd = connect_udp(host, port, error);
+            if (fd < 0) {
+                logger->error("LineSink: can't connect to {0}: {1}", destination, error);
+                retry_at = std::chrono::steady_clock::now() + retry_delay;
+                retry_delay = std::min(retry_delay * 2, std::chrono::milliseconds(LINE_RETRY_MAX_MS));
+                lck.lock();
+                continue;
+            }
+            retry_delay = std::chrono::milliseconds(LINE_RETRY_MIN_MS);
+        }
+        pack_round(*round);
+        bool ok = send_packets();
+        // Start again with a new socket next time, in case the host has moved.
+        if (!ok) {
+            close(fd);
+            fd = -1;
+        }
+        lck.lock();
+        if (ok) {
+            counters.sent++;
+            counters.posts += packet_ends.size();
+        }
+        else
+            counters.failed++;
+        // Take the round off the queue, if the overflow policy hasn't already.
+        if (!queue.empty() && queue.front() == round)
+            queue.pop_front();
+        counters.depth = queue.size();
+    }
+}
@@ -0,0 +1,74 @@
+// line_sink.h
+// This file defines the LineSink class. See line_sink.cpp for more information.
+
+#ifndef EPMON_LINE_SINK_H
+#define EPMON_LINE_SINK_H
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <spdlog/spdlog.h>
+#include "results_sink.h"
+
+class LineSink : public ResultsSink {
+public:
+    // dest is statsd://HOST:PORT or influx://HOST:PORT.
+    explicit LineSink(std::string dest);
+    ~LineSink() override;
+    LineSink(const LineSink &) = delete;
+    LineSink &operator=(const LineSink &) = delete;
+
+    // False if the destination couldn't be parsed.
+    bool valid() const { return protocol != line_protocol::none; }
+
+    std::thread run() override { return std::thread([this] { this->send_loop(); }); }
+    // Pick up the queue size and overflow policy.
+    void configure(const Monitor_options &options) override;
+    // The reports aren't any use to us; see enqueue_round().
+    void enqueue(std::shared_ptr<const results_report> /*report*/) override {}
+    sender_stats stats() override;
+    bool wants_rounds() const override { return true; }
+    void enqueue_round(std::shared_ptr<const results_round> round) override;
+
+private:
+    enum class line_protocol {
+        none,
+        statsd,
+        influx
+    };
+
+    line_protocol protocol;
+    std::string host;
+    std::string port;
+    // The queue and what to do when it's full, protected by queue_lock.
+    std::deque<std::shared_ptr<const results_round>> queue;
+    size_t capacity;
+    sender_overflow overflow;
+    sender_stats counters;
+    std::mutex queue_lock;
+    std::condition_variable not_empty;
+    // The logger.
+    std::shared_ptr<spdlog::logger> logger;
+    // The connected socket, or -1. Only used by the sender thread.
+    int fd;
+    // After a failure to connect, how long to wait before trying again, and when that
+    // is. Only used by the sender thread.
+    std::chrono::milliseconds retry_delay;
+    std::chrono::steady_clock::time_point retry_at;
+    // The lines of the round being sent, packed into datagrams: the end of each one in
+    // packed. Kept between rounds so they don't have to grow every time. Only used by the
+    // sender thread.
+    std::string packed;
+    std::vector<size_t> packet_ends;
+
+    void pack_round(const results_round &round);
+    bool send_packets();
+    void send_loop();
+};
+
+#endif //EPMON_LINE_SINK_H
@@ -0,0 +1,440 @@
+// metrics_server.cpp
+// This file implements the MetricsServer class, which lets Prometheus (or anything else
+// that scrapes) pull the results instead of having them pushed to a results server. When
+// the configuration turns it on, with
+//   "metrics": { "port": 9105, "address": "127.0.0.1" }
+// (the address is optional and defaults to METRICS_ADDRESS_DEFAULT), GET /metrics returns
+// the latest round of results in the text exposition format:
+//   # TYPE epmon_app_cpu_percent gauge
+//   epmon_app_cpu_percent{app="bash",pid="2544"} 0.264
+//   # TYPE epmon_app_memory_kbytes gauge
+//   epmon_app_memory_kbytes{app="bash",pid="2544"} 13852672
+//   ...
+// Processes are epmon_app_*, cgroups epmon_cgroup_* (labelled with the cgroup path, and
+// including their pressure), the host metrics epmon_host_* and the system-wide pressure
+// epmon_pressure_*. Those last ones are named after their place in the JSON report, and
+// arrays, like the per-CPU numbers and the load averages, get an "index" label.
+// A scrape never samples anything, and never takes the shared mutex. The Monitor renders
+// the page once per cycle, after sampling, and publishes it with std::atomic_store(); a
+// scrape just takes a reference to whatever page is current with std::atomic_load() and
+// writes it out. So any number of scrapers cost a read() and a writev() each, and the
+// page they get is never a mix of two cycles.
+// The server is a single thread with an epoll loop over non-blocking sockets. It only
+// speaks enough HTTP/1.1 for a scraper: one GET (or HEAD) per connection, answered with
+// "Connection: close". A connection that doesn't finish its request within
+// METRICS_CLIENT_TIMEOUT_MS, or sends one longer than METRICS_REQUEST_MAX, is closed.
+// Like the EventWatcher, the server copies its settings from the shared options every
+// METRICS_REFRESH_INTERVAL seconds, and opens, moves or closes the listening socket to
+// match.
+// The only public methods besides publish() and enabled() are the constructor and the
+// run() method, which starts a thread running the private serve_loop() method. This
+// method runs forever.
+// What It Doesn't Do
+// There's no TLS or authentication, which is why it listens on localhost by default.
+// Top processes and the sender counters aren't exported.
+// Testing
+// curl http://127.0.0.1:9105/metrics, or promtool check metrics on the output.
+
+#include "metrics_server.h"
+#include <cctype>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <netdb.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#define METRICS_REFRESH_INTERVAL    5
+#define METRICS_BACKLOG             64
+#define METRICS_MAX_CONNECTIONS     64
+#define METRICS_CLIENT_TIMEOUT_MS   5000
+#define METRICS_REQUEST_MAX         8192
+#define METRICS_EVENTS_MAX          32
+#define METRICS_CONTENT_TYPE        "text/plain; version=0.0.4; charset=utf-8"
+
+// An anonymous namespace for functions that don't need to be in the MetricsServer class itself.
+namespace {
+    // The sample lines of each metric, by name. Prometheus wants all the samples of a
+    // metric together, after its TYPE line.
+    typedef std::map<std::string, std::string> metric_families;
+
+    void append_number(std::string &out, double value)
+    {
+        char buf[32];
+        if (std::isnan(value))
+            out.append("NaN");
+        else if (std::isinf(value))
+            out.append(value > 0 ? "+Inf" : "-Inf");
+        else {
+            int len = snprintf(buf, sizeof(buf), "%.10g", value);
+            out.append(buf, len);
+        }
+    }
+
+    // Add a label to a list of them, escaping the value.
+    void add_label(std::string &labels, const char *name, const std::string &value)
+    {
+        if (!labels.empty())
+            labels.push_back(',');
+        labels.append(name);
+        labels.append("=\"");
+        for (char c : value) {
+            if (c == '\\' || c == '"') {
+                labels.push_back('\\');
+                labels.push_back(c);
+            }
+            else if (c == '\n')
+                labels.append("\\n");
+            else
+                labels.push_back(c);
+        }
+        labels.push_back('"');
+    }
+
+    void add_sample(metric_families &families, const std::string &name, const std::string &labels, double value)
+    {
+        std::string &lines = families[name];
+        lines.append(name);
+        if (!labels.empty()) {
+            lines.push_back('{');
+            lines.append(labels);
+            lines.push_back('}');
+        }
+        lines.push_back(' ');
+        append_number(lines, value);
+        lines.push_back('\n');
+    }
+
+    // Add every number in a JSON value, named after where it is in the value.
+    void add_json(metric_families &families, const std::string &name, const std::string &labels, const json &j)
+    {
+        if (j.is_number())
+            add_sample(families, name, labels, j.get<double>());
+        else if (j.is_object()) {
+            for (auto it = j.begin(); it != j.end(); ++it) {
+                std::string member(it.key());
+                for (char &c : member) {
+                    if (!isalnum((unsigned char) c))
+                        c = '_';
+                }
+                add_json(families, name + "_" + member, labels, it.value());
+            }
+        }
+        else if (j.is_array()) {
+            for (size_t ii = 0; ii < j.size(); ii++) {
+                std::string index_labels(labels);
+                add_label(index_labels, "index", std::to_string(ii));
+                add_json(families, name, index_labels, j[ii]);
+            }
+        }
+    }
+}
+
+void render_metrics(std::string &out, const std::vector<app_result> &results, const json &extra)
+{
+    metric_families families;
+
+    for (const app_result &result : results) {
+        std::string labels;
+        add_label(labels, "app", result.app);
+        if (!result.is_cgroup) {
+            add_label(labels, "pid", std::to_string(result.pid));
+            add_sample(families, "epmon_app_cpu_percent", labels, result.cpu);
+            add_sample(families, "epmon_app_memory_kbytes", labels, result.memory);
+            continue;
+        }
+        add_label(labels, "cgroup", result.cgroup);
+        add_sample(families, "epmon_cgroup_cpu_percent", labels, result.cpu);
+        add_sample(families, "epmon_cgroup_memory_kbytes", labels, result.memory);
+        add_sample(families, "epmon_cgroup_memory_anon_kbytes", labels, result.memory_anon);
+        add_sample(families, "epmon_cgroup_memory_file_kbytes", labels, result.memory_file);
+        add_sample(families, "epmon_cgroup_io_read_bytes_per_second", labels, result.io_read);
+        add_sample(families, "epmon_cgroup_io_write_bytes_per_second", labels, result.io_write);
+        add_json(families, "epmon_cgroup_pressure", labels, result.pressure);
+    }
+    auto it = extra.find("host");
+    if (it != extra.end())
+        add_json(families, "epmon_host", std::string(), *it);
+    it = extra.find("pressure");
+    if (it != extra.end())
+        add_json(families, "epmon_pressure", std::string(), *it);
+    for (auto &family : families) {
+        out.append("# TYPE ");
+        out.append(family.first);
+        out.append(" gauge\n");
+        out.append(family.second);
+    }
+}
+
+// The constructor sets up the epoll instance. The listening socket isn't opened until
+// the thread is running and has read the settings.
+MetricsServer::MetricsServer(Monitor_options *options, std::mutex &mut)
+    : shared_options(options), data_lock(mut), listen_fd(-1), listen_port(0)
+{
+    // Get the shared logger pointer.
+    logger = spdlog::get("epmon");
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0)
+        logger->error("MetricsServer: epoll_create1 failed: {0}", strerror(errno));
+}
+
+MetricsServer::~MetricsServer()
+{
+    while (!connections.empty())
+        close_connection(connections.begin()->first);
+    if (listen_fd >= 0)
+        close(listen_fd);
+    if (epoll_fd >= 0)
+        close(epoll_fd);
+}
+
+void MetricsServer::publish(std::shared_ptr<const std::string> new_page)
+{
+    std::atomic_store(&page, std::move(new_page));
+}
+
+// Make the listening socket match the configured address and port: open it, move it, or
+// close it if /metrics has been turned off.
+void MetricsServer::update_listener()
+{
+    std::string address;
+    unsigned int port;
+    {
+        std::lock_guard<std::mutex> lck { data_lock };
+        address = shared_options->metrics_address;
+        port = shared_options->metrics_port;
+    }
+    if (port == listen_port && address == listen_address)
+        return;
+    if (listen_fd >= 0) {
+        close(listen_fd);
+        listen_fd = -1;
+        logger->info("MetricsServer: stopped listening on {0} port {1}", listen_address, listen_port);
+    }
+    // Remember the settings even if they don't work, so we don't try again until they
+    // change.
+    listen_address = address;
+    listen_port = port;
+    if (port == 0 || epoll_fd < 0)
+        return;
+
+    struct addrinfo hints = {};
+    struct addrinfo *addrs = nullptr;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    int ret = getaddrinfo(address.c_str(), std::to_string(port).c_str(), &hints, &addrs);
+    if (ret != 0) {
+        logger->error("MetricsServer: can't resolve {0}: {1}", address, gai_strerror(ret));
+        return;
+    }
+    for (struct addrinfo *ai = addrs; ai && listen_fd < 0; ai = ai->ai_next) {
+        int one = 1;
+        listen_fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, ai->ai_protocol);
+        if (listen_fd < 0)
+            continue;
+        setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (bind(listen_fd, ai->ai_addr, ai->ai_addrlen) < 0 || listen(listen_fd, METRICS_BACKLOG) < 0) {
+            logger->error("MetricsServer: can't listen on {0} port {1}: {2}", address, port, strerror(errno));
+            close(listen_fd);
+            listen_fd = -1;
+        }
+    }
+    freeaddrinfo(addrs);
+    if (listen_fd < 0)
+        return;
+    struct epoll_event ev = {};
+    ev.events = EPOLLIN;
+    ev.data.fd = listen_fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev);
+    logger->info("MetricsServer: listening on {0} port {1}", address, port);
+}
+
+void MetricsServer::accept_connections()
+{
+    while (true) {
+        int fd = accept4(listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                logger->warn("MetricsServer: accept failed: {0}", strerror(errno));
+            if (errno != EINTR)
+                return;
+            continue;
+        }
+        if (connections.size() >= METRICS_MAX_CONNECTIONS) {
+            close(fd);
+            continue;
+        }
+        struct epoll_event ev = {};
+        ev.events = EPOLLIN;
+        ev.data.fd = fd;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            close(fd);
+            continue;
+        }
+        connection &conn = connections[fd];
+        conn.written = 0;
+        conn.responding = false;
+        conn.last_active = std::chrono::steady_clock::now();
+    }
+}
+
+// Read what there is of the request. Once we have all of its headers, work out the
+// response and start writing it.
+void MetricsServer::read_request(int fd, connection &conn)
+{
+    char buf[2048];
+    while (true) {
+        ssize_t nread = read(fd, buf, sizeof(buf));
+        if (nread == 0 || (nread < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+            close_connection(fd);
+            return;
+        }
+        if (nread < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        conn.request.append(buf, nread);
+        if (conn.request.size() > METRICS_REQUEST_MAX) {
+            close_connection(fd);
+            return;
+        }
+    }
+    conn.last_active = std::chrono::steady_clock::now();
+    if (conn.request.find("\r\n\r\n") == std::string::npos && conn.request.find("\n\n") == std::string::npos)
+        return;
+
+    // We only need the request line: METHOD TARGET VERSION.
+    std::string line = conn.request.substr(0, conn.request.find_first_of("\r\n"));
+    size_t sp1 = line.find(' ');
+    size_t sp2 = (sp1 == std::string::npos) ? std::string::npos : line.find(' ', sp1 + 1);
+    std::string method = line.substr(0, sp1);
+    std::string target = (sp1 == std::string::npos) ? std::string() : line.substr(sp1 + 1, sp2 - sp1 - 1);
+    target = target.substr(0, target.find('?'));
+    const char *status = "200 OK";
+    std::shared_ptr<const std::string> body;
+    if (method != "GET" && method != "HEAD")
+        status = "405 Method Not Allowed";
+    else if (target != "/metrics")
+        status = "404 Not Found";
+    else {
+        body = std::atomic_load(&page);
+        // Nothing to serve until the Monitor has finished its first cycle.
+        if (!body)
+            status = "503 Service Unavailable";
+    }
+    size_t length = body ? body->size() : 0;
+    conn.head = std::string("HTTP/1.1 ") + status + "\r\nContent-Type: " METRICS_CONTENT_TYPE "\r\nContent-Length: " +
+                std::to_string(length) + "\r\nConnection: close\r\n\r\n";
+    if (method != "HEAD")
+        conn.body = body;
+    conn.request.clear();
+    conn.responding = true;
+    write_response(fd, conn);
+}
+
+// Write as much of the response as the socket will take. If it won't take all of it,
+// wait for it to be writable; once it's all written, close the connection.
+void MetricsServer::write_response(int fd, connection &conn)
+{
+    while (true) {
+        struct iovec iov[2];
+        int iovcnt = 0;
+        size_t offset = conn.written;
+        if (offset < conn.head.size()) {
+            iov[iovcnt].iov_base = (void *) (conn.head.data() + offset);
+            iov[iovcnt].iov_len = conn.head.size() - offset;
+            iovcnt++;
+            offset = 0;
+        }
+        else
+            offset -= conn.head.size();
+        if (conn.body && offset < conn.body->size()) {
+            iov[iovcnt].iov_base = (void *) (conn.body->data() + offset);
+            iov[iovcnt].iov_len = conn.body->size() - offset;
+            iovcnt++;
+        }
+        if (iovcnt == 0) {
+            close_connection(fd);
+            return;
+        }
+        struct msghdr msg = {};
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovcnt;
+        ssize_t nwritten = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (nwritten < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                struct epoll_event ev = {};
+                ev.events = EPOLLOUT;
+                ev.data.fd = fd;
+                epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev);
+                return;
+            }
+            close_connection(fd);
+            return;
+        }
+        conn.written += nwritten;
+        conn.last_active = std::chrono::steady_clock::now();
+    }
+}
+
+void MetricsServer::close_connection(int fd)
+{
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+    close(fd);
+    connections.erase(fd);
+}
+
+// This is the thread function. It runs forever, waiting for connections and requests on
+// the epoll instance. epoll_wait() times out every second so we can close connections
+// that have gone quiet and notice changes to the configuration.
+void MetricsServer::serve_loop()
+{
+    struct epoll_event events[METRICS_EVENTS_MAX];
+    auto last_refresh = std::chrono::steady_clock::time_point();
+
+    logger->info("begin MetricsServer::serve_loop");
+    if (epoll_fd < 0)
+        return;
+    while(true) {
+        auto now = std::chrono::steady_clock::now();
+        if (now - last_refresh >= std::chrono::seconds(METRICS_REFRESH_INTERVAL)) {
+            update_listener();
+            last_refresh = now;
+        }
+        for (auto it = connections.begin(); it != connections.end(); ) {
+            int fd = it->first;
+            ++it;
+            if (now - connections[fd].last_active > std::chrono::milliseconds(METRICS_CLIENT_TIMEOUT_MS))
+                close_connection(fd);
+        }
+        int count = epoll_wait(epoll_fd, events, METRICS_EVENTS_MAX, 1000);
+        if (count < 0 && errno != EINTR) {
+            logger->error("MetricsServer::serve_loop: epoll_wait failed: {0}", strerror(errno));
+            sleep(1);
+            continue;
+        }
+        for (int ii = 0; ii < count; ii++) {
+            int fd = events[ii].data.fd;
+            if (fd == listen_fd) {
+                accept_connections();
+                continue;
+            }
+            auto it = connections.find(fd);
+            if (it == connections.end())
+                continue;
+            if (events[ii].events & (EPOLLERR | EPOLLHUP))
+                close_connection(fd);
+            else if (it->second.responding)
+                write_response(fd, it->second);
+            else
+                read_request(fd, it->second);
+        }
+    }
+}
@@ -0,0 +1,75 @@
+// metrics_server.h
+// This file defines the MetricsServer class. See metrics_server.cpp for more information.
+
+#ifndef EPMON_METRICS_SERVER_H
+#define EPMON_METRICS_SERVER_H
+
+#include <chrono>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include "nlohmann_json/json.hpp"
+#include <spdlog/spdlog.h>
+#include "monitor_options.h"
+#include "results.h"
+
+using json = nlohmann::json;
+
+class MetricsServer {
+public:
+    MetricsServer(Monitor_options *options, std::mutex &mut);
+    ~MetricsServer();
+    MetricsServer(const MetricsServer &) = delete;
+    MetricsServer &operator=(const MetricsServer &) = delete;
+
+    std::thread run() { return std::thread([this] { this->serve_loop(); }); }
+
+    // Whether /metrics is turned on. The Monitor doesn't render the page if it isn't.
+    bool enabled(const Monitor_options &options) const { return options.metrics_port != 0; }
+    // Replace the page served at /metrics. The Monitor calls this after each cycle.
+    void publish(std::shared_ptr<const std::string> new_page);
+
+private:
+    // A scraper's connection: the request so far, then the response being written. The
+    // connection holds on to the page it's sending, in case a new one is published.
+    struct connection {
+        std::string request;
+        std::string head;
+        std::shared_ptr<const std::string> body;
+        size_t written;
+        bool responding;
+        std::chrono::steady_clock::time_point last_active;
+    };
+
+    // The shared monitoring options.
+    Monitor_options *shared_options;
+    // The shared mutex.
+    std::mutex &data_lock;
+    // The logger.
+    std::shared_ptr<spdlog::logger> logger;
+    // The page to serve. Only ever read or written with std::atomic_load() and
+    // std::atomic_store(), never under a lock.
+    std::shared_ptr<const std::string> page;
+    // The rest is only used by the server thread: the epoll instance, the listening
+    // socket and the address it's bound to, and the open connections by descriptor.
+    int epoll_fd;
+    int listen_fd;
+    std::string listen_address;
+    unsigned int listen_port;
+    std::map<int, connection> connections;
+
+    void update_listener();
+    void accept_connections();
+    void read_request(int fd, connection &conn);
+    void write_response(int fd, connection &conn);
+    void close_connection(int fd);
+    void serve_loop();
+};
+
+// Render a round of results, and the host metrics and pressure in extra, as a page in the
+// Prometheus text exposition format.
+void render_metrics(std::string &out, const std::vector<app_result> &results, const json &extra);
+
+#endif //EPMON_METRICS_SERVER_H
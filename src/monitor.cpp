@@ -7,20 +7,23 @@
 // of app names and copy them to a local list. I felt that was the safest / easiest way
 // to deal with the possibility of the list changing while we're looping through it,
 // and to minimize the time spent with the data locked.
-// Once we have an updated list of app names, we loop through it, getting the process
-// info for the app (if the app exists) and creating a JSON object with the results.
-// The results of each app are added to a local vector of JSON objects, then when we
-// have collected info on all the apps, the individual results are combined into a
-// single JSON object. That object is converted to a string and sent via a POST message
-// to the results server.
+// Once we have an updated list of app names, we hand it to the collector backend (see
+// collector.cpp), which finds and samples all the apps in one batch, and create a JSON
+// result with the results for each app that exists.
+// The results of each app are added to a local vector, then when we have collected info
+// on all the apps, they are written out as a single JSON report (see results.cpp). That
+// string is queued for the results sinks (see results_sink.cpp), which send it to the
+// results server and any other destinations, each on its own thread.
+// Each pass through the work loop starts monitor_interval seconds after the previous one
+// started, however long the sending takes.
 // The only public method is the run() method, which starts a thread running the
 // private work_loop() method. This method runs forever, getting process information
 // on an interval passed into the constructor.
 // What It Doesn't Do
 // There is no way to update the process info collection interval. The interval is
 // passed into the constructor, there is no mechanism to update it at runtime.
-// Likewise the results server URL is passed into the constructor and there is no
-// mechanism to update it at runtime, either. Both of these should be configurable
+// Likewise the results server URL is given to the results sender when it's created and
+// there is no mechanism to update it at runtime, either. Both of these should be configurable
 // and updatable at runtime.
 // I think error handling could be more robust, which is something that would probably
 // be made more obvious by more extensive testing.
@@ -34,124 +37,215 @@
 // Ideally we want a way to test that doesn't always require starting the work loop
 // thread.
 
+#include <algorithm>
+#include <ctime>
 #include <unistd.h>
-#include <curl/curl.h>
 #include "monitor.h"
 #include "process_info.h"
+#include "pressure.h"
+#include "otlp.h"
 
-// This struct is used by the curl_output_cb function to store the response data
-// from a call to curl_easy_perform().
-struct curl_response {
-    char *response;
-    size_t size;
-};
+// The number of seconds between the two samples used to calculate CPU usage.
+#define CPU_SAMPLE_WINDOW   1
 
 // An anonymous namespace for functions that don't need to be in the Monitor class itself.
 namespace {
-    // A simple function to combine process info into a single JSON object in the form
-    // {
-    //   "app": "bash",
-    //   "timestamp": true,
-    //   "PID": 2544,
-    //   "CPU": 0.264,
-    //   "Memory": 13852672.0
-    // }
-    json make_single_result(std::string proc_name, int pid, double pcpu, double mem)
+    // A simple function to fill in the results for a process (see results.cpp for how
+    // they're reported). The timestamp is the round's, added when it's written.
+    void make_single_result(app_result &result, const std::string &proc_name, int pid, double pcpu, double mem)
     {
-        // create the timestamp string
-        auto right_now = std::chrono::system_clock::now();
-        std::time_t the_time = std::chrono::system_clock::to_time_t(right_now);
-        std::string timestamp(std::ctime(&the_time));
-        // If there's a trailing newline on the timestamp, get the time string without it.
-        if (timestamp.at(timestamp.length() - 1) == '\n')
-            timestamp = timestamp.substr(0,timestamp.length() - 1);
-        json jres = {
-                {"app", proc_name},
-                {"timestamp", timestamp},
-                {"PID", pid},
-                {"CPU", pcpu},
-                {"Memory", mem},
-        };
+        result.app = proc_name;
+        result.pid = pid;
+        result.cpu = pcpu;
+        result.memory = mem;
+    }
+
+    // The CPU time a process has used, its children's included, and when it started.
+    // /proc/<pid>/stat counts both in clock ticks, the start time from when the system
+    // booted.
+    void add_cpu_time(app_result &result, const struct pstat &stat, std::chrono::system_clock::time_point booted)
+    {
+        static const double ticks_per_sec = (double) sysconf(_SC_CLK_TCK);
+        result.cpu_seconds = (double) (stat.utime_ticks + stat.stime_ticks + stat.cutime_ticks + stat.cstime_ticks) /
+                             ticks_per_sec;
+        result.cpu_start = booted + std::chrono::duration_cast<std::chrono::system_clock::duration>(
+                std::chrono::duration<double>((double) stat.starttime / ticks_per_sec));
+    }
+
+    // When the system booted, by the wall clock.
+    std::chrono::system_clock::time_point boot_time()
+    {
+        struct timespec since_boot;
+        clock_gettime(CLOCK_BOOTTIME, &since_boot);
+        return std::chrono::system_clock::now() - std::chrono::duration_cast<std::chrono::system_clock::duration>(
+                std::chrono::seconds(since_boot.tv_sec) + std::chrono::nanoseconds(since_boot.tv_nsec));
+    }
+
+    // The cgroup equivalent of make_single_result(). A cgroup has no single PID, so we
+    // report its path instead, plus the memory breakdown and I/O rates (bytes/second).
+    // The pressure is added by the caller, if the cgroup has pressure files.
+    void make_cgroup_result(app_result &result, const std::string &name, const std::string &dir, double pcpu,
+                            const cgroup_stat &cur, const cgroup_stat &last, double seconds)
+    {
+        make_single_result(result, name, 0, pcpu, static_cast<double>(cur.memory_current) / 1024.0);
+        result.is_cgroup = true;
+        result.cgroup = dir;
+        result.memory_anon = static_cast<double>(cur.memory_anon) / 1024.0;
+        result.memory_file = static_cast<double>(cur.memory_file) / 1024.0;
+        result.cpu_seconds = static_cast<double>(cur.usage_usec) / 1000000.0;
+        result.io_read = seconds > 0.0 ? static_cast<double>(cur.io_rbytes - last.io_rbytes) / seconds : 0.0;
+        result.io_write = seconds > 0.0 ? static_cast<double>(cur.io_wbytes - last.io_wbytes) / seconds : 0.0;
+    }
+
+    // Convert the contents of a pressure file to JSON in the form
+    // { "some": { "avg10": 0.12, "avg60": 0.05, "avg300": 0.01, "total": 2134876 },
+    //   "full": { ... } }
+    json pressure_to_json(const psi_stats &stats)
+    {
+        json jres;
+        const psi_line *lines[] = { &stats.some, &stats.full };
+        const char *names[] = { "some", "full" };
+        for (int ii = 0; ii < 2; ii++) {
+            if (!lines[ii]->valid)
+                continue;
+            jres[names[ii]] = {
+                    {"avg10", lines[ii]->avg10},
+                    {"avg60", lines[ii]->avg60},
+                    {"avg300", lines[ii]->avg300},
+                    {"total", lines[ii]->total},
+            };
+        }
         return jres;
     }
 
-    // Simple function to create a single JSON object from a vector of JSON objects in the form
-    // { "healthcheck" : [
-    //   { "app": "bash",
-    //     "timestamp": true,
-    //     "PID": 2544,
-    //     "CPU": 0.264,
-    //     "Memory": 13852672.0 },
-    //   { "app": "nautilus",
-    //      ... },
-    //   ...
-    //   ]
-    // }
-    json combine_results(std::vector<json> &results_vec)
+    // Read the cpu, memory and io pressure, system-wide if cgroup_dir is empty, into a
+    // single JSON object keyed by resource. Resources without a pressure file are left out.
+    json read_all_pressure(const std::string &cgroup_dir)
     {
-        json jres, jvec(results_vec);
-        if (!results_vec.empty()) {
-            jres["healthcheck"] = jvec;
+        json jres;
+        psi_stats stats;
+        for (auto &resource : psi_resources) {
+            if (read_pressure(pressure_path(resource, cgroup_dir), stats))
+                jres[resource] = pressure_to_json(stats);
         }
         return jres;
     }
 
-    // This callback function captures the output of the curl_easy_perform() call.
-    // Without it, the output is written to stdout, which is not helpful in this case.
-    size_t curl_output_cb(void *data, size_t size, size_t nmemb, void *userp)
+    // Convert a list of top processes to JSON in the form
+    // [ { "app": "firefox", "PID": 2544, "CPU": 12.5, "Memory": 13852672.0, "RSS": 402116.0 }, ... ]
+    // Memory and RSS are in Kbytes.
+    json top_to_json(const std::vector<top_entry> &entries)
     {
-        size_t realsize = size * nmemb;
-        auto *mem = (struct curl_response *)userp;
-        char *ptr = (char *)realloc(mem->response, mem->size + realsize + 1);
-        if (ptr == nullptr)
-            return 0;  /* out of memory! */
-        mem->response = ptr;
-        memcpy(&(mem->response[mem->size]), data, realsize);
-        mem->size += realsize;
-        mem->response[mem->size] = 0;
-        return realsize;
-    }
-
-    // Send a POST message containing the JSON app monitoring results to the results URL.
-    bool send_app_results(const std::string &url, json &json_results, const std::shared_ptr<spdlog::logger> &logger)
+        json jres = json::array();
+        for (auto &entry : entries) {
+            jres.push_back({
+                    {"app", entry.comm},
+                    {"PID", entry.pid},
+                    {"CPU", entry.pcpu},
+                    {"Memory", static_cast<double>(entry.vsize) / 1024.0},
+                    {"RSS", static_cast<double>(entry.rss) / 1024.0},
+            });
+        }
+        return jres;
+    }
+
+    // Convert the host metrics to JSON in the form
+    // { "cpu": { "user": 12.1, "system": 3.2, "iowait": 0.4, "steal": 0.0, "idle": 84.3, "busy": 15.3 },
+    //   "per_cpu": [ 20.5, 10.1, ... ],
+    //   "loadavg": [ 0.52, 0.61, 0.58 ],
+    //   "memory": { "total": 16314248, "available": 9125532, ... } }
+    // The CPU values are percentages, the memory values Kbytes.
+    json host_to_json(const host_info &info)
     {
-        bool ret = false;
-        char post_buf[4096];
-        CURL *curl;
-        CURLcode res;
-        struct curl_response resp = { nullptr };
-
-        curl = curl_easy_init();
-        if (curl) {
-            // Set the results server URL. Hard-coded for now but really should be configurable.
-            curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
-            curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curl_output_cb);
-            curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)&resp);
-            // Convert the JSON results to a single string.
-            strncpy(post_buf, json_results.dump().c_str(), 4096);
-            // Pass the JSON string as the POST data.
-            curl_easy_setopt(curl, CURLOPT_POSTFIELDS, post_buf);
-            // POST it!
-            res = curl_easy_perform(curl);
-            if (res != CURLE_OK)
-                logger->error("Monitor send_app_results failed: {}", curl_easy_strerror(res));
-            curl_easy_cleanup(curl);
-            ret = (res == CURLE_OK);
+        json jres;
+        if (info.have_cpu) {
+            jres["cpu"] = {
+                    {"user", info.cpu.user},
+                    {"system", info.cpu.system},
+                    {"iowait", info.cpu.iowait},
+                    {"steal", info.cpu.steal},
+                    {"idle", info.cpu.idle},
+                    {"busy", info.cpu.busy},
+            };
+            jres["per_cpu"] = info.per_cpu_busy;
         }
-        else
-            logger->error("Monitor send_app_results curl_easy_init failed");
-        return ret;
+        jres["loadavg"] = { info.loadavg[0], info.loadavg[1], info.loadavg[2] };
+        jres["memory"] = {
+                {"total", info.memory.total},
+                {"free", info.memory.free},
+                {"available", info.memory.available},
+                {"buffers", info.memory.buffers},
+                {"cached", info.memory.cached},
+                {"swap_total", info.memory.swap_total},
+                {"swap_free", info.memory.swap_free},
+        };
+        return jres;
+    }
+
+    // A results sink's counters, as of the time the report was made.
+    json sender_to_json(const sender_stats &stats)
+    {
+        json jres = {
+                {"depth", stats.depth},
+                {"capacity", stats.capacity},
+                {"enqueued", stats.enqueued},
+                {"sent", stats.sent},
+                {"failed", stats.failed},
+                {"posts", stats.posts},
+                {"dropped", stats.dropped},
+                {"coalesced", stats.coalesced},
+                {"blocked", stats.blocked},
+                {"throttled", stats.throttled},
+                {"batch_scale", stats.batch_scale},
+                {"spooled", stats.spooled},
+                {"replayed", stats.replayed},
+                {"spool_bytes", stats.spool_bytes},
+                {"spool_evicted_bytes", stats.spool_evicted_bytes},
+                {"compressed", stats.compressed},
+                {"compress_ms", stats.compress_usec / 1000.0},
+        };
+        if (stats.compress_out_bytes > 0)
+            jres["compression_ratio"] = (double) stats.compress_in_bytes / (double) stats.compress_out_bytes;
+        return jres;
     }
+
+    // The counters of the sinks other than the first, by destination. Only the counters
+    // that every kind of sink keeps.
+    json sinks_to_json(const std::vector<ResultsSink *> &sinks)
+    {
+        json jres = json::array();
+        for (size_t ii = 1; ii < sinks.size(); ii++) {
+            sender_stats stats = sinks[ii]->stats();
+            jres.push_back({
+                    {"destination", sinks[ii]->name()},
+                    {"depth", stats.depth},
+                    {"enqueued", stats.enqueued},
+                    {"sent", stats.sent},
+                    {"failed", stats.failed},
+                    {"dropped", stats.dropped + stats.coalesced},
+            });
+        }
+        return jres;
+    }
+
 }
 
 // The constructor doesn't really do any work, just sets local variables. I wanted
 // to minimize the places where locking would be required, so I don't populate the
 // local app list from the shared app list until the thread is actually running.
-Monitor::Monitor(int interval, std::string url, std::vector<std::string> *app_list, std::mutex &mut)
-    : monitor_interval(interval), results_url(std::move(url)), shared_app_list(app_list), data_lock(mut)
+Monitor::Monitor(int interval, std::vector<ResultsSink *> results_sinks, MetricsServer *metrics,
+                 std::vector<std::string> *app_list, Monitor_options *options, std::mutex &mut)
+    : monitor_interval(interval), sinks(std::move(results_sinks)), metrics_server(metrics), shared_app_list(app_list),
+      shared_options(options), data_lock(mut), last_report_bytes(0)
 {
     // Get the shared logger pointer.
     logger = spdlog::get("epmon");
+    // Pick the fastest process info backend that works here.
+    collector = select_collector(logger);
+    std::string reason;
+    have_cgroups = cgroup_collector.probe(reason);
+    if (!have_cgroups)
+        logger->warn("Monitor: cgroup selectors will be ignored: {0}", reason);
 }
 
 // We don't really need to clear the local app list, so there's probably no reason
@@ -160,31 +254,141 @@ Monitor::~Monitor() {
     local_app_list.clear();
 }
 
-// Loop through the (local) list of applications to monitor and get the desired
-// process info for each. Combine the individual results into a single JSON object
-// and return it.
-json Monitor::get_all_app_info()
+// Sample every process on the system and pick the top_n by CPU and by RSS, in the form
+// { "cpu": [ ... ], "rss": [ ... ] }
+// This is one walk of /proc with one read per process. There's no sample window: CPU
+// usage is measured against the previous cycle's samples (see top_processes.cpp), so it
+// covers the whole monitor interval. Returns an empty object if top_n isn't set.
+json Monitor::get_top_processes()
 {
-    int pid = 0;
-    double pcpu = 0.0, mem = 0.0;
     json jres;
-    std::vector<json> results_vec;
+    std::vector<pid_t> all_pids;
+    std::vector<top_entry> by_cpu, by_rss;
 
-    for (auto &app : local_app_list) {
-        logger->info("Monitor::get_all_app_info: getting info for {0}", app);
-        get_proc_info(app, &pid, &pcpu, &mem);
+    if (local_options.top_n <= 0 || !collector)
+        return jres;
+    auto start = std::chrono::steady_clock::now();
+    if (collector->enumerate(all_pids) != 0 || collector->sample(all_pids, top_round) != 0) {
+        logger->error("Monitor::get_top_processes: sampling failed");
+        return jres;
+    }
+    top_processes.rank(top_round, (size_t) local_options.top_n, by_cpu, by_rss);
+    logger->info("Monitor::get_top_processes: {0} collector sampled {1} processes in {2} us",
+                 collector->name(), all_pids.size(),
+                 std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count());
+    jres["cpu"] = top_to_json(by_cpu);
+    jres["rss"] = top_to_json(by_rss);
+    return jres;
+}
+
+// Get the desired process info for all the apps in the (local) list in one batch: the
+// collector finds all of them in a single walk of /proc, then we sample the matched
+// processes and the monitored cgroups, sleep for CPU_SAMPLE_WINDOW seconds and sample
+// them again. The only way to get the CPU usage is to calculate it from two different
+// times, but this way there's one window per round instead of one per app. Combine the
+// individual results in results, and the once-per-report members (the top processes, the
+// host metrics and the system-wide pressure) in extra. The whole round gets one timestamp,
+// the time of the second sample. Returns false if there's nothing to report.
+// Memory use is reported in Kbytes.
+bool Monitor::get_all_app_info(std::vector<app_result> &results, json &timestamp, json &extra)
+{
+    double ucpu_usage = 0.0, scpu_usage = 0.0, mem = 0.0;
+    std::vector<pid_t> app_pids, sample_pids;
+    sample_round before, after;
+    std::vector<std::string> cgroup_dirs;
+    std::vector<cgroup_stat> cgroups_before, cgroups_after;
+
+    results.clear();
+    extra = json::object();
+    if (!collector) {
+        logger->error("Monitor::get_all_app_info: no collector backend available");
+        return false;
+    }
+    json top = get_top_processes();
+    auto start = std::chrono::steady_clock::now();
+    collector->match(local_app_list, app_pids);
+    for (pid_t pid : app_pids) {
+        if (pid > 0)
+            sample_pids.push_back(pid);
+    }
+    if (have_cgroups) {
+        for (auto &selector : local_options.cgroups)
+            cgroup_dirs.push_back(cgroup_collector.resolve(selector));
+    }
+    collector->sample(sample_pids, before);
+    cgroup_collector.sample(cgroup_dirs, cgroups_before);
+    auto window_start = std::chrono::steady_clock::now();
+    auto elapsed = window_start - start;
+    if (!sample_pids.empty() || !cgroup_dirs.empty())
+        sleep(CPU_SAMPLE_WINDOW);
+    start = std::chrono::steady_clock::now();
+    int ret = collector->sample(sample_pids, after);
+    cgroup_collector.sample(cgroup_dirs, cgroups_after);
+    round_time = std::chrono::system_clock::now();
+    timestamp = format_timestamp(local_options.timestamp_format, round_time);
+    double window_secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - window_start).count();
+    elapsed += std::chrono::steady_clock::now() - start;
+    logger->info("Monitor::get_all_app_info: {0} collector matched {1} apps and sampled {2} processes "
+                 "and {3} cgroups in {4} us",
+                 collector->name(), local_app_list.size(), sample_pids.size(), cgroup_dirs.size(),
+                 std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count());
+    if (ret != 0 || before.procs.size() != after.procs.size()) {
+        logger->error("Monitor::get_all_app_info: sampling failed");
+        return false;
+    }
+
+    size_t next_sample = 0;
+    std::chrono::system_clock::time_point booted = boot_time();
+    for (size_t ii = 0; ii < local_app_list.size(); ii++) {
+        const std::string &app = local_app_list[ii];
         // Only add results if we actually got some.
-        if (pid > 0) {
-            jres = make_single_result(app, pid, pcpu, mem);
-            results_vec.push_back(jres);
-        }
-        else
+        if (app_pids[ii] <= 0) {
             logger->warn("Monitor::get_all_app_info: process {0} not found", app);
+            continue;
+        }
+        const proc_sample &ps_before = before.procs[next_sample];
+        const proc_sample &ps_after = after.procs[next_sample];
+        next_sample++;
+        if (!ps_before.valid || !ps_after.valid) {
+            logger->warn("Monitor::get_all_app_info: failed to read process info for {0}", app);
+            continue;
+        }
+        calc_cpu_usage_pct(&ps_after.stat, &ps_before.stat, &ucpu_usage, &scpu_usage);
+        mem = static_cast<double>(ps_after.stat.vsize) / 1024.0;
+        results.emplace_back();
+        make_single_result(results.back(), app, app_pids[ii], scpu_usage, mem);
+        add_cpu_time(results.back(), ps_after.stat, booted);
     }
-    // Combine the individual results into a single JSON object. If there are no
-    // results to combine, jres will be empty.
-    jres = combine_results(results_vec);
-    return jres;
+    for (size_t ii = 0; ii < cgroup_dirs.size(); ii++) {
+        const std::string &name = local_options.cgroups[ii].name;
+        if (cgroup_dirs[ii].empty()) {
+            logger->warn("Monitor::get_all_app_info: cgroup {0} ({1}) not found", name, local_options.cgroups[ii].path);
+            continue;
+        }
+        if (!cgroups_before[ii].valid || !cgroups_after[ii].valid) {
+            logger->warn("Monitor::get_all_app_info: failed to read cgroup info for {0}", name);
+            continue;
+        }
+        double pcpu = calc_cgroup_cpu_pct(cgroups_after[ii], cgroups_before[ii],
+                                          after.cpu_total_time - before.cpu_total_time);
+        results.emplace_back();
+        make_cgroup_result(results.back(), name, cgroup_dirs[ii], pcpu, cgroups_after[ii], cgroups_before[ii],
+                           window_secs);
+        results.back().pressure = read_all_pressure(cgroup_dirs[ii]);
+    }
+    // The top processes, the host metrics and the system-wide pressure go in once per
+    // report, next to the healthcheck list.
+    if (!top.empty())
+        extra["top"] = top;
+    if (results.empty() && extra.empty())
+        return false;
+    host_info host;
+    host_metrics.collect(before, after, host);
+    extra["host"] = host_to_json(host);
+    json pressure = read_all_pressure(std::string());
+    if (!pressure.empty())
+        extra["pressure"] = pressure;
+    return true;
 }
 
 // Copy from the shared list of applications to monitor to a local list. I went round
@@ -193,7 +397,8 @@ json Monitor::get_all_app_info()
 // this is that if the list of applications to monitor changes while I'm still
 // processing the local list, I won't know about it until the next time through the
 // work loop. It's also a duplication of data, but I don't think it's likely to be
-// a huge amount of data.
+// a huge amount of data. The shared monitoring options are copied the same way.
+// Returns the number of apps and cgroups to monitor.
 int Monitor::update_app_list()
 {
     local_app_list.clear();
@@ -201,47 +406,142 @@ int Monitor::update_app_list()
     for (auto &app : *shared_app_list) {
         local_app_list.push_back(app);
     }
-    return (int) local_app_list.size();
+    local_options = *shared_options;
+    return (int) (local_app_list.size() + local_options.cgroups.size());
+}
+
+// Render the round as a page for /metrics and hand it to the metrics server, which serves
+// it until the next round replaces it. This is done whether or not there are results, so
+// apps that have gone away don't stay on the page.
+void Monitor::publish_metrics(const std::vector<app_result> &results, const json &extra)
+{
+    std::shared_ptr<std::string> page(new std::string);
+    render_metrics(*page, results, extra);
+    metrics_server->publish(page);
+}
+
+// Hand the round to the sinks that format the results themselves (see line_sink.cpp).
+// They get every result, before any delta filtering: a line protocol has no way to say
+// "unchanged". One copy is shared by all of them.
+void Monitor::queue_round(const std::vector<app_result> &results)
+{
+    std::shared_ptr<results_round> round;
+    for (ResultsSink *sink : sinks) {
+        if (!sink->wants_rounds())
+            continue;
+        if (!round) {
+            round.reset(new results_round);
+            round->results = results;
+            round->when = round_time;
+        }
+        sink->enqueue_round(round);
+    }
+}
+
+// Serialize the report and hand it to each of the results sinks. It's serialized once, and
+// the same copy is shared by all of them. The counters of the first sink, the results
+// server's sender, go in every report as "sender", so the results server can see when
+// reports are being dropped, and any other sinks' go in as "sinks". The report
+// is serialized as JSON text, or as CBOR or MessagePack if the configuration asks for
+// them; those are smaller and quicker for the server to parse, with the same schema. The
+// otlp format is OpenTelemetry metrics instead (see otlp.cpp), for a collector. A
+// report bigger than max_payload_bytes is not queued at all, since cutting it short
+// would just make it invalid.
+// With delta reporting on, the results that haven't changed are left out first (see
+// delta_filter.cpp).
+// JSON text is written straight from the results (see results.cpp), into a string that
+// starts out as big as the last report so it doesn't have to grow as it's written.
+void Monitor::queue_results(std::vector<app_result> &results, const json &timestamp, json &extra)
+{
+    if (std::none_of(sinks.begin(), sinks.end(), [](ResultsSink *sink) { return !sink->wants_rounds(); }))
+        return;
+    json delta = delta_filter.filter(results, local_options.delta_epsilon, local_options.delta_keyframe_interval);
+    if (!delta.is_null())
+        extra["delta"] = delta;
+    extra["sender"] = sender_to_json(sinks.front()->stats());
+    if (sinks.size() > 1)
+        extra["sinks"] = sinks_to_json(sinks);
+    std::shared_ptr<results_report> queued(new results_report);
+    queued->format = local_options.format;
+    switch (local_options.format) {
+        case results_format::cbor:
+            json::to_cbor(report_to_json(results, timestamp, local_options.layout, extra), queued->body);
+            break;
+        case results_format::msgpack:
+            json::to_msgpack(report_to_json(results, timestamp, local_options.layout, extra), queued->body);
+            break;
+        case results_format::otlp:
+            queued->body.reserve(last_report_bytes);
+            write_otlp(queued->body, results, round_time);
+            last_report_bytes = queued->body.size();
+            break;
+        default:
+            queued->body.reserve(last_report_bytes);
+            write_report(queued->body, results, timestamp, local_options.layout, extra);
+            last_report_bytes = queued->body.size();
+            break;
+    }
+    if (queued->body.size() > local_options.max_payload_bytes) {
+        logger->error("Monitor::queue_results: {0} byte payload exceeds the {1} byte maximum, not sent",
+                      queued->body.size(), local_options.max_payload_bytes);
+        return;
+    }
+    for (ResultsSink *sink : sinks) {
+        if (!sink->wants_rounds())
+            sink->enqueue(queued);
+    }
+    logger->info("Monitor::queue_results: queued app monitor results");
 }
 
 // This is the thread function. It runs forever because I didn't want to spend the time
 // working out a clever "stop" mechanism. Each time through the loop we update our local
 // copy of the list of applications to monitor, then get the process info for each. We
-// create a single JSON object with the results and POST it to the results server, then
-// nap until it's time to run again.
+// create a single JSON object with the results and queue it for the results server, then
+// nap until it's time to run again. The nap is timed from the start of the pass, so the
+// interval between samples stays the same however long the pass took.
 void Monitor::work_loop()
 {
-    json jres;
+    std::vector<app_result> results;
+    json timestamp, extra;
+    auto next_pass = std::chrono::steady_clock::now();
 
     logger->info("begin Monitor::work_loop");
     while(true) {
+        next_pass += std::chrono::seconds(monitor_interval);
         // Copy the shared app list to a local list.
         logger->info("Monitor::work_loop: calling update_app_list");
         int num_apps = update_app_list();
+        for (ResultsSink *sink : sinks)
+            sink->configure(local_options);
+        shm_publisher.set_name(local_options.shm_name);
         // It's possible there are no apps to monitor. This may happen if this thread
         // runs before the MonitorConfig thread can read the app list, or maybe
         // Something Bad happened reading from the configuration server. Whatever,
         // we'll just sleep and hope things are better next time around.
-        if (num_apps == 0) {
+        if (num_apps == 0 && local_options.top_n <= 0) {
             logger->warn("Monitor::work_loop: no apps specified");
         }
         else {
-            // Get the process info for the monitored apps in a single JSON object.
-            jres = get_all_app_info();
-            if (jres.empty()) {
+            // Get the process info for the monitored apps.
+            bool have_results = get_all_app_info(results, timestamp, extra);
+            if (metrics_server && metrics_server->enabled(local_options))
+                publish_metrics(results, extra);
+            if (shm_publisher.is_open())
+                shm_publisher.publish(results, round_time);
+            if (!have_results)
                 logger->warn("Monitor::work_loop: no results to send");
-            }
             else {
-                // Send the collected results to the results server.
-                bool ret = send_app_results(results_url, jres, logger);
-                if (ret)
-                    logger->info("Monitor::work_loop: successfully sent app monitor results");
-                else
-                    logger->warn("Monitor::work_loop: failed to send app monitor results");
+                queue_round(results);
+                queue_results(results, timestamp, extra);
             }
         }
-        logger->info("Monitor::work_loop: sleeping for {0} seconds", monitor_interval);
-        // Sleep for the configured interval.
-        sleep(monitor_interval);
+        // If the pass took longer than the interval (the block overflow policy can do
+        // that), start the next one straight away and pick up the schedule from there.
+        auto now = std::chrono::steady_clock::now();
+        if (next_pass < now)
+            next_pass = now;
+        logger->info("Monitor::work_loop: sleeping for {0} ms",
+                     std::chrono::duration_cast<std::chrono::milliseconds>(next_pass - now).count());
+        std::this_thread::sleep_until(next_pass);
     }
 }
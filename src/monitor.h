@@ -4,16 +4,31 @@
 #ifndef EPMON_MONITOR_H
 #define EPMON_MONITOR_H
 
+#include <memory>
 #include <mutex>
 #include <thread>
 #include "nlohmann_json/json.hpp"
 #include <spdlog/spdlog.h>
+#include "collector.h"
+#include "cgroup_collector.h"
+#include "monitor_options.h"
+#include "top_processes.h"
+#include "host_metrics.h"
+#include "results_sink.h"
+#include "results.h"
+#include "delta_filter.h"
+#include "metrics_server.h"
+#include "shm_publisher.h"
 
 using json = nlohmann::json;
 
 class Monitor {
 public:
-    Monitor(int interval, std::string url, std::vector<std::string> *app_list, std::mutex &mut);
+    // The reports go to each of the sinks. There's always at least one, and the first
+    // is the results server. Each round is also published to the metrics server, if
+    // there is one.
+    Monitor(int interval, std::vector<ResultsSink *> results_sinks, MetricsServer *metrics,
+            std::vector<std::string> *app_list, Monitor_options *options, std::mutex &mut);
     ~Monitor();
 
     std::thread run() { return std::thread([this] { this->work_loop(); }); }
@@ -21,19 +36,47 @@ public:
 private:
     // Number of seconds between calls to get process info.
     int monitor_interval;
-    // URL of results server.
-    std::string results_url;
+    // Send the finished reports to the results server and the other destinations.
+    std::vector<ResultsSink *> sinks;
+    // Serves the latest round at /metrics, or nullptr.
+    MetricsServer *metrics_server;
     // The shared list of apps to monitor.
     std::vector<std::string> *shared_app_list;
     // The local copy of the shared list of apps to monitor.
     std::vector<std::string> local_app_list;
+    // The shared monitoring options.
+    Monitor_options *shared_options;
+    // The local copy of the shared monitoring options.
+    Monitor_options local_options;
     // The shared mutex.
     std::mutex &data_lock;
     // The logger.
     std::shared_ptr<spdlog::logger> logger;
+    // The process info backend, chosen at startup.
+    std::unique_ptr<Collector> collector;
+    // The cgroup backend, and whether cgroup v2 is available at all.
+    CgroupCollector cgroup_collector;
+    bool have_cgroups;
+    // Picks the top processes, and the round of samples it picks them from.
+    TopProcesses top_processes;
+    sample_round top_round;
+    // Works out the host metrics from each round.
+    HostMetrics host_metrics;
+    // Leaves out the results that haven't changed, when delta reporting is on.
+    DeltaFilter delta_filter;
+    // Publishes each round in shared memory, when that's turned on.
+    ShmPublisher shm_publisher;
+    // When the current round was sampled.
+    std::chrono::system_clock::time_point round_time;
+    // The size of the last JSON report, to size the next one's buffer.
+    size_t last_report_bytes;
 
     int update_app_list();
-    json get_all_app_info();
+    json get_top_processes();
+    bool get_all_app_info(std::vector<app_result> &results, json &timestamp, json &extra);
+    void publish_metrics(const std::vector<app_result> &results, const json &extra);
+    void queue_round(const std::vector<app_result> &results);
+    void queue_results(std::vector<app_result> &results, const json &timestamp, json &extra);
     void work_loop();
 };
 
@@ -1,12 +1,13 @@
 // monitor_config.cpp
 // This file implements the MonitorConfig class methods and associated support functions.
 // This class is responsible for periodically getting configuration information that
-// consists of a list of process names to monitor. The process names are stored in a shared
-// vector of strings. This vector is also used by the Monitor class to know which processes
-// to monitor. When it's time to read from the configuration server, we do the GET operation,
-// and if that succeeds, lock the shared vector of app names and update it. We do as
-// little as possible while the data is locked; no external functions or methods are called
-// while we're locked.
+// consists of a list of process names to monitor, plus some optional monitoring settings
+// (see monitor_options.h). The process names are stored in a shared vector of strings,
+// and the settings in a shared Monitor_options object. The Monitor class uses both, the
+// vector to know which processes to monitor and the options to know how. When it's time
+// to read from the configuration server, we do the GET operation, and if that succeeds,
+// lock the shared data and update it. We do as little as possible while the data is
+// locked; no external functions or methods are called while we're locked.
 // The only public method is the run() method, which starts a thread running the private
 // config_loop() method. This method runs forever, getting the configuration info on an
 // interval passed into the constructor.
@@ -31,80 +32,468 @@
 // Ideally we want a way to test that doesn't always require starting the work loop
 // thread.
 
+#include <algorithm>
 #include <iostream>
-#include <curl/curl.h>
 #include <unistd.h>
 #include "monitor_config.h"
+#include "compress.h"
+
+// The largest number of top processes we'll report.
+#define TOP_N_MAX   100
+// The largest send queue we'll allow. Each queued report is a whole serialized report.
+#define SENDER_QUEUE_SIZE_MAX   1024
+// The most reports we'll put in one batch.
+#define BATCH_MAX_REPORTS_MAX   1000
+// The longest we'll go between full reports when delta reporting is on.
+#define DELTA_KEYFRAME_INTERVAL_MAX 10000
+// The most POSTs a results sender may have going at once. Replaying the spool holds a
+// batch of up to a megabyte in memory for each of them.
+#define HTTP_MAX_CONNECTIONS_MAX    32
+// The longest we'll let a POST take, in milliseconds.
+#define HTTP_TIMEOUT_MS_MAX         600000
 
 // An anonymous namespace for functions that don't need to be in the MonitorConfig class itself.
 namespace {
-    // This callback function puts the GET results data into a string.
-    size_t curl_write_cb(void *ptr, size_t size, size_t nmemb, std::string *data)
+    // Make a GET request to the configuration URL and convert the returned data
+    // to a JSON object.
+    bool get_config(HttpClient &http, const std::string &url, json &json_config,
+                    const std::shared_ptr<spdlog::logger> &logger)
     {
-        data->append((char *) ptr, size * nmemb);
-        return size * nmemb;
+        std::string response_string;
+
+        bool ret = http.get(url, response_string);
+        if (!ret)
+            logger->error("MonitorConfig get_config failed");
+        else {
+            // Convert the GET results into a JSON object.
+            if (!response_string.empty())
+                json_config = json::parse(response_string);
+            else
+                logger->warn("MonitorConfig get_config: response_string is empty");
+        }
+        return ret;
     }
 
-    // Make a GET request to the configuration URL and convert the returned data
-    // to a JSON object.
-    bool get_config(const std::string &url, json &json_config, const std::shared_ptr<spdlog::logger> &logger)
+    // Read the optional "cgroups" list from the configuration. Each entry is either an
+    // object naming a cgroup path or a systemd unit,
+    //   { "name": "nginx", "unit": "nginx.service" }
+    //   { "name": "db", "path": "/system.slice/docker-1234.scope" }
+    // or just a string, which is taken as a path if it starts with '/' and as a unit name
+    // otherwise. If there's no name, the path or unit name is used.
+    std::vector<cgroup_selector> parse_cgroups(const json &cfg, const std::shared_ptr<spdlog::logger> &logger)
     {
-        bool ret = false;
-        CURL *curl;
-        CURLcode res;
-
-        curl = curl_easy_init();
-        if (curl) {
-            curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
-            curl_easy_setopt(curl, CURLOPT_HTTPGET, 1L);
-
-            std::string response_string;
-            curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curl_write_cb);
-            curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response_string);
-
-            res = curl_easy_perform(curl);
-            if (res != CURLE_OK)
-                logger->error("MonitorConfig get_config failed: {}", curl_easy_strerror(res));
+        std::vector<cgroup_selector> cgroups;
+        auto it = cfg.find("cgroups");
+        if (it == cfg.end() || !it->is_array())
+            return cgroups;
+        for (auto &element : *it) {
+            cgroup_selector sel;
+            if (element.is_string()) {
+                sel.path = element.get<std::string>();
+                sel.is_unit = (sel.path.empty() || sel.path[0] != '/');
+            }
+            else if (element.is_object() && element.contains("unit") && element["unit"].is_string()) {
+                sel.path = element["unit"].get<std::string>();
+                sel.is_unit = true;
+            }
+            else if (element.is_object() && element.contains("path") && element["path"].is_string()) {
+                sel.path = element["path"].get<std::string>();
+                sel.is_unit = false;
+            }
             else {
-                // Convert the GET results into a JSON object.
-                if (!response_string.empty())
-                    json_config = json::parse(response_string);
-                else
-                    logger->warn("MonitorConfig get_config: response_string is empty");
+                logger->warn("MonitorConfig parse_cgroups: ignoring invalid cgroup selector {0}", element.dump());
+                continue;
             }
-            curl_easy_cleanup(curl);
-            ret = (res == CURLE_OK);
+            if (element.is_object() && element.contains("name") && element["name"].is_string())
+                sel.name = element["name"].get<std::string>();
+            else
+                sel.name = sel.path;
+            cgroups.push_back(sel);
+        }
+        return cgroups;
+    }
+
+    // Read the optional "psi_triggers" list from the configuration, for example
+    //   { "resource": "memory", "type": "some", "threshold_us": 150000, "window_us": 1000000 }
+    // which asks for an event when tasks are stalled on memory for more than 150ms in any
+    // one second window. An optional "cgroup" names one of the monitored cgroups; without
+    // it the trigger is on system-wide pressure. The kernel checks the values itself, but
+    // we catch the obvious mistakes here so they're logged once instead of every refresh.
+    std::vector<psi_trigger> parse_psi_triggers(const json &cfg, const std::shared_ptr<spdlog::logger> &logger)
+    {
+        std::vector<psi_trigger> triggers;
+        auto it = cfg.find("psi_triggers");
+        if (it == cfg.end() || !it->is_array())
+            return triggers;
+        for (auto &element : *it) {
+            psi_trigger trig;
+            if (!element.is_object() || !element.contains("resource") || !element["resource"].is_string() ||
+                !element.contains("threshold_us") || !element["threshold_us"].is_number_unsigned() ||
+                !element.contains("window_us") || !element["window_us"].is_number_unsigned() ||
+                (element.contains("type") && !element["type"].is_string()) ||
+                (element.contains("cgroup") && !element["cgroup"].is_string())) {
+                logger->warn("MonitorConfig parse_psi_triggers: ignoring invalid trigger {0}", element.dump());
+                continue;
+            }
+            trig.resource = element["resource"].get<std::string>();
+            trig.type = element.value("type", std::string("some"));
+            trig.threshold_us = element["threshold_us"].get<unsigned long>();
+            trig.window_us = element["window_us"].get<unsigned long>();
+            trig.cgroup = element.value("cgroup", std::string());
+            if ((trig.resource != "cpu" && trig.resource != "memory" && trig.resource != "io") ||
+                (trig.type != "some" && trig.type != "full") ||
+                trig.threshold_us == 0 || trig.threshold_us > trig.window_us) {
+                logger->warn("MonitorConfig parse_psi_triggers: ignoring invalid trigger {0}", element.dump());
+                continue;
+            }
+            triggers.push_back(trig);
+        }
+        return triggers;
+    }
+
+    // Read the optional "sender" settings from the configuration, for example
+    //   { "queue_size": 16, "overflow": "drop_oldest" }
+    // where "overflow" is one of "drop_oldest", "coalesce" or "block". Anything missing
+    // or invalid keeps its default.
+    void parse_sender(const json &cfg, size_t &queue_size, sender_overflow &overflow,
+                      const std::shared_ptr<spdlog::logger> &logger)
+    {
+        auto it = cfg.find("sender");
+        if (it == cfg.end() || !it->is_object())
+            return;
+        if (it->contains("queue_size")) {
+            const json &size = (*it)["queue_size"];
+            if (size.is_number_unsigned() && size.get<size_t>() > 0)
+                queue_size = std::min(size.get<size_t>(), (size_t) SENDER_QUEUE_SIZE_MAX);
+            else
+                logger->warn("MonitorConfig parse_sender: ignoring invalid queue_size {0}", size.dump());
+        }
+        if (it->contains("overflow")) {
+            const json &value = (*it)["overflow"];
+            std::string policy = value.is_string() ? value.get<std::string>() : std::string();
+            if (policy == "drop_oldest")
+                overflow = sender_overflow::drop_oldest;
+            else if (policy == "coalesce")
+                overflow = sender_overflow::coalesce;
+            else if (policy == "block")
+                overflow = sender_overflow::block;
+            else
+                logger->warn("MonitorConfig parse_sender: ignoring invalid overflow {0}", value.dump());
+        }
+    }
+
+    // Read the optional "spool" settings from the configuration, for example
+    //   { "max_bytes": 67108864, "replay_interval_ms": 1000 }
+    // A max_bytes of zero turns the spool off.
+    void parse_spool(const json &cfg, size_t &max_bytes, unsigned int &replay_interval_ms,
+                     const std::shared_ptr<spdlog::logger> &logger)
+    {
+        auto it = cfg.find("spool");
+        if (it == cfg.end() || !it->is_object())
+            return;
+        if (it->contains("max_bytes")) {
+            if ((*it)["max_bytes"].is_number_unsigned())
+                max_bytes = (*it)["max_bytes"].get<size_t>();
+            else
+                logger->warn("MonitorConfig parse_spool: ignoring invalid max_bytes {0}", (*it)["max_bytes"].dump());
+        }
+        if (it->contains("replay_interval_ms")) {
+            if ((*it)["replay_interval_ms"].is_number_unsigned())
+                replay_interval_ms = (*it)["replay_interval_ms"].get<unsigned int>();
+            else
+                logger->warn("MonitorConfig parse_spool: ignoring invalid replay_interval_ms {0}",
+                             (*it)["replay_interval_ms"].dump());
+        }
+    }
+
+    // Read the optional "batch" settings from the configuration, for example
+    //   { "max_reports": 10, "max_bytes": 1048576, "max_delay_ms": 10000 }
+    // which sends a batch when it has 10 reports in it, when it reaches 1MB, or when its
+    // first report is 10 seconds old, whichever comes first. A max_reports of 1 (the
+    // default) sends every report on its own.
+    void parse_batch(const json &cfg, size_t &max_reports, size_t &max_bytes, unsigned int &max_delay_ms,
+                     const std::shared_ptr<spdlog::logger> &logger)
+    {
+        auto it = cfg.find("batch");
+        if (it == cfg.end() || !it->is_object())
+            return;
+        if (it->contains("max_reports")) {
+            const json &value = (*it)["max_reports"];
+            if (value.is_number_unsigned() && value.get<size_t>() > 0)
+                max_reports = std::min(value.get<size_t>(), (size_t) BATCH_MAX_REPORTS_MAX);
+            else
+                logger->warn("MonitorConfig parse_batch: ignoring invalid max_reports {0}", value.dump());
+        }
+        if (it->contains("max_bytes")) {
+            const json &value = (*it)["max_bytes"];
+            if (value.is_number_unsigned() && value.get<size_t>() > 0)
+                max_bytes = value.get<size_t>();
+            else
+                logger->warn("MonitorConfig parse_batch: ignoring invalid max_bytes {0}", value.dump());
+        }
+        if (it->contains("max_delay_ms")) {
+            const json &value = (*it)["max_delay_ms"];
+            if (value.is_number_unsigned())
+                max_delay_ms = value.get<unsigned int>();
+            else
+                logger->warn("MonitorConfig parse_batch: ignoring invalid max_delay_ms {0}", value.dump());
+        }
+    }
+
+    // Read the optional "delta" settings from the configuration, for example
+    //   { "keyframe_interval": 10, "epsilon": 0.05 }
+    // A keyframe_interval of 1 (the default) means every report is a full one.
+    void parse_delta(const json &cfg, unsigned int &keyframe_interval, double &epsilon,
+                     const std::shared_ptr<spdlog::logger> &logger)
+    {
+        auto it = cfg.find("delta");
+        if (it == cfg.end() || !it->is_object())
+            return;
+        if (it->contains("keyframe_interval")) {
+            const json &value = (*it)["keyframe_interval"];
+            if (value.is_number_unsigned() && value.get<unsigned int>() > 0)
+                keyframe_interval = std::min(value.get<unsigned int>(), (unsigned int) DELTA_KEYFRAME_INTERVAL_MAX);
+            else
+                logger->warn("MonitorConfig parse_delta: ignoring invalid keyframe_interval {0}", value.dump());
+        }
+        if (it->contains("epsilon")) {
+            const json &value = (*it)["epsilon"];
+            if (value.is_number() && value.get<double>() >= 0.0)
+                epsilon = value.get<double>();
+            else
+                logger->warn("MonitorConfig parse_delta: ignoring invalid epsilon {0}", value.dump());
+        }
+    }
+
+    // Read the optional "metrics" settings from the configuration, for example
+    //   { "port": 9105, "address": "0.0.0.0" }
+    // Without a port, /metrics isn't served.
+    void parse_metrics(const json &cfg, std::string &address, unsigned int &port,
+                       const std::shared_ptr<spdlog::logger> &logger)
+    {
+        auto it = cfg.find("metrics");
+        if (it == cfg.end() || !it->is_object())
+            return;
+        if (it->contains("port")) {
+            const json &value = (*it)["port"];
+            if (value.is_number_unsigned() && value.get<unsigned int>() <= 65535)
+                port = value.get<unsigned int>();
+            else
+                logger->warn("MonitorConfig parse_metrics: ignoring invalid port {0}", value.dump());
+        }
+        if (it->contains("address")) {
+            const json &value = (*it)["address"];
+            if (value.is_string() && !value.get<std::string>().empty())
+                address = value.get<std::string>();
+            else
+                logger->warn("MonitorConfig parse_metrics: ignoring invalid address {0}", value.dump());
+        }
+    }
+
+    // Read the optional "http" settings from the configuration, for example
+    //   { "max_connections": 4, "timeout_ms": 30000 }
+    // which lets a results sender run four POSTs at once and gives each 30 seconds. Bigger
+    // values than HTTP_MAX_CONNECTIONS_MAX and HTTP_TIMEOUT_MS_MAX are cut down to them.
+    void parse_http(const json &cfg, unsigned int &max_connections, unsigned int &timeout_ms,
+                    const std::shared_ptr<spdlog::logger> &logger)
+    {
+        auto it = cfg.find("http");
+        if (it == cfg.end() || !it->is_object())
+            return;
+        if (it->contains("max_connections")) {
+            const json &value = (*it)["max_connections"];
+            if (value.is_number_unsigned() && value.get<unsigned long long>() > 0)
+                max_connections = (unsigned int) std::min(value.get<unsigned long long>(),
+                                                          (unsigned long long) HTTP_MAX_CONNECTIONS_MAX);
+            else
+                logger->warn("MonitorConfig parse_http: ignoring invalid max_connections {0}", value.dump());
+        }
+        if (it->contains("timeout_ms")) {
+            const json &value = (*it)["timeout_ms"];
+            if (value.is_number_unsigned() && value.get<unsigned long long>() > 0)
+                timeout_ms = (unsigned int) std::min(value.get<unsigned long long>(),
+                                                     (unsigned long long) HTTP_TIMEOUT_MS_MAX);
+            else
+                logger->warn("MonitorConfig parse_http: ignoring invalid timeout_ms {0}", value.dump());
+        }
+    }
+
+    // Read the optional "compression" settings from the configuration, for example
+    //   { "type": "gzip", "level": 6, "min_bytes": 1024 }
+    // where "type" is "none", "gzip" or "zstd". zstd falls back to gzip if this build
+    // doesn't have it. "level" is -1 for the library's default, or one the type takes (see
+    // compression_levels()); any other level is ignored with a warning.
+    void parse_compression(const json &cfg, compression_type &type, int &level, size_t &min_bytes,
+                           const std::shared_ptr<spdlog::logger> &logger)
+    {
+        auto it = cfg.find("compression");
+        if (it == cfg.end() || !it->is_object())
+            return;
+        if (it->contains("type")) {
+            const json &value = (*it)["type"];
+            std::string name = value.is_string() ? value.get<std::string>() : std::string();
+            if (name == "none")
+                type = compression_type::none;
+            else if (name == "gzip")
+                type = compression_type::gzip;
+            else if (name == "zstd" && have_zstd())
+                type = compression_type::zstd;
+            else if (name == "zstd") {
+                logger->warn("MonitorConfig parse_compression: zstd isn't available, using gzip");
+                type = compression_type::gzip;
+            }
+            else
+                logger->warn("MonitorConfig parse_compression: ignoring invalid type {0}", value.dump());
+        }
+        if (it->contains("level")) {
+            const json &value = (*it)["level"];
+            int min_level = 0;
+            int max_level = 0;
+            if (!value.is_number_integer())
+                logger->warn("MonitorConfig parse_compression: ignoring invalid level {0}", value.dump());
+            else if (value.get<long long>() == -1 || !compression_levels(type, min_level, max_level))
+                level = -1;
+            else if (value.get<long long>() < min_level || value.get<long long>() > max_level)
+                logger->warn("MonitorConfig parse_compression: ignoring level {0}, {1} takes {2} to {3}",
+                             value.dump(), content_encoding(type), min_level, max_level);
+            else
+                level = value.get<int>();
+        }
+        if (it->contains("min_bytes")) {
+            const json &value = (*it)["min_bytes"];
+            if (value.is_number_unsigned())
+                min_bytes = value.get<size_t>();
+            else
+                logger->warn("MonitorConfig parse_compression: ignoring invalid min_bytes {0}", value.dump());
         }
-        else
-            logger->error("MonitorConfig get_config curl_easy_init failed");
-        return ret;
     }
 }
 
 // The constructor doesn't really do any work, just sets local variables. I wanted
 // to minimize the places where locking would be required, so I don't do the first
 // GET until the thread is actually running.
-MonitorConfig::MonitorConfig(int interval, std::string url, std::vector<std::string> *app_list, std::mutex &mut)
-    : read_interval(interval), server_url(std::move(url)), apps(app_list), data_lock(mut)
+MonitorConfig::MonitorConfig(int interval, std::string url, std::vector<std::string> *app_list,
+                             Monitor_options *options, std::mutex &mut)
+    : read_interval(interval), server_url(std::move(url)), apps(app_list), options(options), data_lock(mut)
 {
     // Get the shared logger pointer.
     logger = spdlog::get("epmon");
 }
 
-// This method updates the shared list of application names to monitor. Note that it
-// only attempts to lock and update the shared list if the GET call was successful.
+// This method updates the shared list of application names to monitor, and the shared
+// monitoring options. Note that it only attempts to lock and update the shared data if
+// the GET call was successful. The options are parsed before we take the lock.
 void MonitorConfig::update_config()
 {
     json cfg;
     bool ret = false;
 
-    ret = get_config(server_url, cfg, logger);
+    ret = get_config(http, server_url, cfg, logger);
     if (ret) {
+        std::vector<cgroup_selector> cgroups = parse_cgroups(cfg, logger);
+        std::vector<psi_trigger> psi_triggers = parse_psi_triggers(cfg, logger);
+        int top_n = 0;
+        if (cfg.contains("top_n") && cfg["top_n"].is_number_integer() && cfg["top_n"].get<int>() > 0)
+            top_n = std::min(cfg["top_n"].get<int>(), TOP_N_MAX);
+        size_t max_payload_bytes = MAX_PAYLOAD_BYTES_DEFAULT;
+        if (cfg.contains("max_payload_bytes") && cfg["max_payload_bytes"].is_number_unsigned() &&
+            cfg["max_payload_bytes"].get<size_t>() > 0)
+            max_payload_bytes = cfg["max_payload_bytes"].get<size_t>();
+        size_t sender_queue_size = SENDER_QUEUE_SIZE_DEFAULT;
+        sender_overflow sender_overflow_policy = sender_overflow::drop_oldest;
+        parse_sender(cfg, sender_queue_size, sender_overflow_policy, logger);
+        size_t spool_max_bytes = SPOOL_MAX_BYTES_DEFAULT;
+        unsigned int spool_replay_interval_ms = SPOOL_REPLAY_INTERVAL_MS_DEFAULT;
+        parse_spool(cfg, spool_max_bytes, spool_replay_interval_ms, logger);
+        size_t batch_max_reports = BATCH_MAX_REPORTS_DEFAULT;
+        size_t batch_max_bytes = BATCH_MAX_BYTES_DEFAULT;
+        unsigned int batch_max_delay_ms = BATCH_MAX_DELAY_MS_DEFAULT;
+        parse_batch(cfg, batch_max_reports, batch_max_bytes, batch_max_delay_ms, logger);
+        unsigned int http_max_connections = HTTP_MAX_CONNECTIONS_DEFAULT;
+        unsigned int http_timeout_ms = HTTP_TIMEOUT_MS_DEFAULT;
+        parse_http(cfg, http_max_connections, http_timeout_ms, logger);
+        compression_type compression = compression_type::none;
+        int compression_level = -1;
+        size_t compression_min_bytes = COMPRESSION_MIN_BYTES_DEFAULT;
+        parse_compression(cfg, compression, compression_level, compression_min_bytes, logger);
+        // The optional "format" is "json" (the default), "cbor", "msgpack" or "otlp".
+        results_format format = results_format::json;
+        if (cfg.contains("format")) {
+            std::string name = cfg["format"].is_string() ? cfg["format"].get<std::string>() : std::string();
+            if (name == "cbor")
+                format = results_format::cbor;
+            else if (name == "msgpack")
+                format = results_format::msgpack;
+            else if (name == "otlp")
+                format = results_format::otlp;
+            else if (name != "json")
+                logger->warn("MonitorConfig::update_config: ignoring invalid format {0}", cfg["format"].dump());
+        }
+        unsigned int delta_keyframe_interval = DELTA_KEYFRAME_INTERVAL_DEFAULT;
+        double delta_epsilon = DELTA_EPSILON_DEFAULT;
+        parse_delta(cfg, delta_keyframe_interval, delta_epsilon, logger);
+        std::string metrics_address = METRICS_ADDRESS_DEFAULT;
+        unsigned int metrics_port = 0;
+        parse_metrics(cfg, metrics_address, metrics_port, logger);
+        // The optional "layout" is "rows" (the default) or "columns".
+        results_layout layout = results_layout::rows;
+        if (cfg.contains("layout")) {
+            std::string name = cfg["layout"].is_string() ? cfg["layout"].get<std::string>() : std::string();
+            if (name == "columns")
+                layout = results_layout::columns;
+            else if (name != "rows")
+                logger->warn("MonitorConfig::update_config: ignoring invalid layout {0}", cfg["layout"].dump());
+        }
+        // The optional "shm_name" is the shared-memory segment to publish the results in.
+        std::string shm_name;
+        if (cfg.contains("shm_name")) {
+            if (cfg["shm_name"].is_string())
+                shm_name = cfg["shm_name"].get<std::string>();
+            else
+                logger->warn("MonitorConfig::update_config: ignoring invalid shm_name {0}", cfg["shm_name"].dump());
+        }
+        // The optional "timestamp_format" is "ctime" (the default), "epoch_ns" or "rfc3339".
+        time_format timestamp_format = time_format::ctime;
+        if (cfg.contains("timestamp_format")) {
+            std::string name = cfg["timestamp_format"].is_string() ? cfg["timestamp_format"].get<std::string>()
+                                                                    : std::string();
+            if (name == "epoch_ns")
+                timestamp_format = time_format::epoch_ns;
+            else if (name == "rfc3339")
+                timestamp_format = time_format::rfc3339;
+            else if (name != "ctime")
+                logger->warn("MonitorConfig::update_config: ignoring invalid timestamp_format {0}",
+                             cfg["timestamp_format"].dump());
+        }
         std::lock_guard<std::mutex> lck { data_lock };
         apps->clear();
         for (auto &element: cfg["applications"]) {
             apps->push_back(element);
         }
+        options->cgroups.swap(cgroups);
+        options->psi_triggers.swap(psi_triggers);
+        options->top_n = top_n;
+        options->max_payload_bytes = max_payload_bytes;
+        options->sender_queue_size = sender_queue_size;
+        options->sender_overflow_policy = sender_overflow_policy;
+        options->spool_max_bytes = spool_max_bytes;
+        options->spool_replay_interval_ms = spool_replay_interval_ms;
+        options->batch_max_reports = batch_max_reports;
+        options->batch_max_bytes = batch_max_bytes;
+        options->batch_max_delay_ms = batch_max_delay_ms;
+        options->http_max_connections = http_max_connections;
+        options->http_timeout_ms = http_timeout_ms;
+        options->compression = compression;
+        options->compression_level = compression_level;
+        options->compression_min_bytes = compression_min_bytes;
+        options->format = format;
+        options->layout = layout;
+        options->delta_keyframe_interval = delta_keyframe_interval;
+        options->delta_epsilon = delta_epsilon;
+        options->metrics_address.swap(metrics_address);
+        options->metrics_port = metrics_port;
+        options->shm_name.swap(shm_name);
+        options->timestamp_format = timestamp_format;
     }
     else
         logger->warn("MonitorConfig::update_config: get_config failed");
@@ -8,12 +8,15 @@
 #include <thread>
 #include "nlohmann_json/json.hpp"
 #include <spdlog/spdlog.h>
+#include "monitor_options.h"
+#include "http_client.h"
 
 using json = nlohmann::json;
 
 class MonitorConfig {
 public:
-    MonitorConfig(int interval, std::string url, std::vector<std::string> *app_list, std::mutex &mut);
+    MonitorConfig(int interval, std::string url, std::vector<std::string> *app_list, Monitor_options *options,
+                  std::mutex &mut);
     ~MonitorConfig() = default;     // Nothing to clean up.
 
     std::thread run() { return std::thread([this] { this->config_loop(); }); }
@@ -25,10 +28,14 @@ private:
     std::string server_url;
     // The shared list of apps to monitor.
     std::vector<std::string> *apps;
+    // The shared monitoring options.
+    Monitor_options *options;
     // The shared mutex.
     std::mutex &data_lock;
     // The logger.
     std::shared_ptr<spdlog::logger> logger;
+    // The connection to the configuration server.
+    HttpClient http;
 
     void update_config();
     void config_loop();
@@ -0,0 +1,156 @@
+// monitor_options.h
+// This file defines the monitoring options, other than the list of app names, that come
+// from the configuration server. Like the app list, a single Monitor_options object is
+// shared by the MonitorConfig class, which fills it in, and the Monitor class, which
+// copies it while holding the shared mutex.
+
+#ifndef EPMON_MONITOR_OPTIONS_H
+#define EPMON_MONITOR_OPTIONS_H
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+// A cgroup to monitor as a single app. It is named in the config JSON either by its
+// cgroup path (relative to the cgroup2 mount) or by the name of a systemd unit.
+struct cgroup_selector {
+    // The name the results are reported under.
+    std::string name;
+    // The cgroup path or unit name.
+    std::string path;
+    bool is_unit;
+};
+
+// A Pressure Stall Information trigger. The kernel signals us when tasks are stalled on
+// the resource for more than threshold_us in any window_us period.
+struct psi_trigger {
+    // "cpu", "memory" or "io".
+    std::string resource;
+    // "some" or "full".
+    std::string type;
+    unsigned long threshold_us;
+    unsigned long window_us;
+    // The name of one of the monitored cgroups, or empty for system-wide pressure.
+    std::string cgroup;
+};
+
+// The default limit on the size of a report sent to the results server.
+#define MAX_PAYLOAD_BYTES_DEFAULT   (16 * 1024 * 1024)
+// The default number of reports that can wait to be sent.
+#define SENDER_QUEUE_SIZE_DEFAULT   16
+// The default limit on the disk space used to keep reports that couldn't be sent, and the
+// default minimum time between replayed batches of them.
+#define SPOOL_MAX_BYTES_DEFAULT             (64 * 1024 * 1024)
+#define SPOOL_REPLAY_INTERVAL_MS_DEFAULT    1000
+// By default each report is sent on its own. When batching is turned on, these are the
+// default limits on the size and age of a batch.
+#define BATCH_MAX_REPORTS_DEFAULT   1
+#define BATCH_MAX_BYTES_DEFAULT     (1024 * 1024)
+#define BATCH_MAX_DELAY_MS_DEFAULT  10000
+// By default a results sender runs up to this many HTTP transfers at once, and gives any
+// one of them this long to finish.
+#define HTTP_MAX_CONNECTIONS_DEFAULT    4
+#define HTTP_TIMEOUT_MS_DEFAULT         30000
+// Payloads smaller than this aren't worth compressing.
+#define COMPRESSION_MIN_BYTES_DEFAULT   1024
+// By default every report is a full one (a keyframe). With delta reporting turned on,
+// this is the default for the smallest change that's worth sending.
+#define DELTA_KEYFRAME_INTERVAL_DEFAULT 1
+#define DELTA_EPSILON_DEFAULT           0.01
+// Where /metrics listens by default, when it's turned on.
+#define METRICS_ADDRESS_DEFAULT         "127.0.0.1"
+
+// How to compress the payloads sent to the results server.
+enum class compression_type {
+    none,
+    gzip,
+    // Only if the build found libzstd.
+    zstd
+};
+
+// What to do with a new report when the send queue is full.
+enum class sender_overflow {
+    // Throw away the oldest queued report.
+    drop_oldest,
+    // Replace the newest queued report with the new one.
+    coalesce,
+    // Make the sampling thread wait for room. Only the first sink, the results server's
+    // sender, does; the others drop the oldest report instead.
+    block
+};
+
+// How reports are serialized. The schema is the same for the first three.
+enum class results_format {
+    json,
+    cbor,
+    msgpack,
+    // OpenTelemetry metrics in OTLP/HTTP JSON (see otlp.cpp): a different schema.
+    otlp
+};
+
+// How the healthcheck entries are laid out in a report (see results.cpp).
+enum class results_layout {
+    // An array of objects, one per app, as epmon has always sent them.
+    rows,
+    // One array per field, with a single shared timestamp.
+    columns
+};
+
+// How the timestamps in the reports are written.
+enum class time_format {
+    // "Mon Nov 22 15:02:51 2021", local time, as epmon has always written them.
+    ctime,
+    // Nanoseconds since the epoch, as a number.
+    epoch_ns,
+    // "2021-11-22T15:02:51.123456789-05:00", local time with its UTC offset.
+    rfc3339
+};
+
+struct Monitor_options {
+    // The cgroups to monitor, in addition to the named applications.
+    std::vector<cgroup_selector> cgroups;
+    // The PSI triggers to register.
+    std::vector<psi_trigger> psi_triggers;
+    // If not zero, also report the top_n processes on the system by CPU and by RSS.
+    int top_n = 0;
+    // The largest report, in bytes, we'll send to the results server.
+    size_t max_payload_bytes = MAX_PAYLOAD_BYTES_DEFAULT;
+    // How many reports can wait to be sent, and what to do when that many are waiting.
+    size_t sender_queue_size = SENDER_QUEUE_SIZE_DEFAULT;
+    sender_overflow sender_overflow_policy = sender_overflow::drop_oldest;
+    // The most disk space to use for reports that couldn't be sent (zero turns spooling
+    // off), and the minimum time between batches when sending them later.
+    size_t spool_max_bytes = SPOOL_MAX_BYTES_DEFAULT;
+    unsigned int spool_replay_interval_ms = SPOOL_REPLAY_INTERVAL_MS_DEFAULT;
+    // Send reports in batches of up to batch_max_reports reports or batch_max_bytes bytes,
+    // holding the first report of a batch for no more than batch_max_delay_ms.
+    size_t batch_max_reports = BATCH_MAX_REPORTS_DEFAULT;
+    size_t batch_max_bytes = BATCH_MAX_BYTES_DEFAULT;
+    unsigned int batch_max_delay_ms = BATCH_MAX_DELAY_MS_DEFAULT;
+    // The most transfers (and connections) a results sender runs at once, when it has a
+    // spool backlog to send, and the longest any one POST may take.
+    unsigned int http_max_connections = HTTP_MAX_CONNECTIONS_DEFAULT;
+    unsigned int http_timeout_ms = HTTP_TIMEOUT_MS_DEFAULT;
+    // How to compress payloads of at least compression_min_bytes, and at what level
+    // (-1 for the library's default).
+    compression_type compression = compression_type::none;
+    int compression_level = -1;
+    size_t compression_min_bytes = COMPRESSION_MIN_BYTES_DEFAULT;
+    // How to serialize the reports, and how to lay out the results in them.
+    results_format format = results_format::json;
+    results_layout layout = results_layout::rows;
+    // Send a full report every delta_keyframe_interval reports, and in between only the
+    // results that changed by more than delta_epsilon (see delta_filter.cpp).
+    unsigned int delta_keyframe_interval = DELTA_KEYFRAME_INTERVAL_DEFAULT;
+    double delta_epsilon = DELTA_EPSILON_DEFAULT;
+    // Where to serve /metrics (see metrics_server.cpp). A port of 0 turns it off.
+    std::string metrics_address = METRICS_ADDRESS_DEFAULT;
+    unsigned int metrics_port = 0;
+    // The shared-memory segment to publish the latest results in (see shm_publisher.cpp),
+    // or empty for none.
+    std::string shm_name;
+    // How to write the timestamps.
+    time_format timestamp_format = time_format::ctime;
+};
+
+#endif //EPMON_MONITOR_OPTIONS_H
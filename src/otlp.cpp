@@ -0,0 +1,229 @@
+// otlp.cpp
+// This file implements the "otlp" results format: the round's results as an OTLP/HTTP
+// JSON ExportMetricsServiceRequest, which an OpenTelemetry collector's otlphttp receiver
+// takes as it is (POST it to /v1/metrics). Each app or cgroup is a resource, with its
+// host and app in the resource attributes, and its numbers as metrics:
+// { "resourceMetrics": [
+//   { "resource": { "attributes": [
+//       { "key": "host.name", "value": { "stringValue": "web1" } },
+//       { "key": "epmon.app", "value": { "stringValue": "bash" } },
+//       { "key": "process.pid", "value": { "intValue": "2544" } } ] },
+//     "scopeMetrics": [ { "scope": { "name": "epmon" }, "metrics": [
+//       { "name": "epmon.cpu.time", "unit": "s",
+//         "sum": { "aggregationTemporality": 2, "isMonotonic": true, "dataPoints": [
+//           { "startTimeUnixNano": "...", "timeUnixNano": "...", "asDouble": 1.25 } ] } },
+//       { "name": "epmon.memory.usage", "unit": "By",
+//         "gauge": { "dataPoints": [ { "timeUnixNano": "...", "asDouble": 14184620032.0 } ] } } ] } ] },
+//   ...
+//   ]
+// }
+// The CPU time is a cumulative sum, so the collector and whatever is behind it can work
+// out the rate over any interval they like, and a lost report loses nothing. It starts
+// when the process did; a cgroup's start isn't known, so its sum starts when epmon did.
+// Memory is a gauge in bytes. A cgroup's resource has epmon.cgroup (its path) instead of
+// process.pid, and gauges for its memory breakdown, epmon.memory.anon and
+// epmon.memory.file, and its I/O rates, epmon.io.read.rate and epmon.io.write.rate
+// ("By/s").
+// The 64-bit times are strings and the temporality is the enum's number, as the OTLP
+// JSON encoding says. With batching on (see results_sender.cpp), the resourceMetrics of
+// the batched requests are merged into one request, since OTLP has no batch wrapper.
+// With delta reporting on (see delta_filter.cpp), the apps that haven't changed are
+// simply left out of the request.
+// What It Doesn't Do
+// Only the per-app results are sent. The host metrics, pressure, top processes and the
+// sender counters have no place in this format and are left out. There's no protobuf
+// encoding; the collector takes JSON just as well.
+// Testing
+// otelcol with an otlp receiver and the debug exporter (verbosity: detailed) prints what
+// it makes of each request.
+
+#include "otlp.h"
+#include <cmath>
+#include <unistd.h>
+#include "json_writer.h"
+
+// The start of an encoded request, and the end.
+#define OTLP_REQUEST_PREFIX     "{\"resourceMetrics\":["
+#define OTLP_REQUEST_SUFFIX     "]}"
+// AGGREGATION_TEMPORALITY_CUMULATIVE.
+#define OTLP_CUMULATIVE         2
+
+// An anonymous namespace for functions that don't need to be visible outside this file.
+namespace {
+    // When epmon started, for the sums with no better start time.
+    const std::chrono::system_clock::time_point epmon_start = std::chrono::system_clock::now();
+
+    const std::string &host_name()
+    {
+        static const std::string name = [] {
+            char buf[256] = {};
+            if (gethostname(buf, sizeof(buf) - 1) != 0)
+                return std::string();
+            return std::string(buf);
+        }();
+        return name;
+    }
+
+    std::string unix_nano(std::chrono::system_clock::time_point when)
+    {
+        return std::to_string(std::chrono::duration_cast<std::chrono::nanoseconds>(when.time_since_epoch()).count());
+    }
+
+    void write_attribute(JsonWriter &writer, const char *key, const std::string &value)
+    {
+        writer.begin_object();
+        writer.key("key");
+        writer.value(key);
+        writer.key("value");
+        writer.begin_object();
+        writer.key("stringValue");
+        writer.value(value);
+        writer.end_object();
+        writer.end_object();
+    }
+
+    // OTLP JSON writes 64-bit integers as strings.
+    void write_attribute(JsonWriter &writer, const char *key, long long value)
+    {
+        writer.begin_object();
+        writer.key("key");
+        writer.value(key);
+        writer.key("value");
+        writer.begin_object();
+        writer.key("intValue");
+        writer.value(std::to_string(value));
+        writer.end_object();
+        writer.end_object();
+    }
+
+    void write_data_point(JsonWriter &writer, const std::string *start, const std::string &time, double value)
+    {
+        writer.key("dataPoints");
+        writer.begin_array();
+        writer.begin_object();
+        if (start) {
+            writer.key("startTimeUnixNano");
+            writer.value(*start);
+        }
+        writer.key("timeUnixNano");
+        writer.value(time);
+        writer.key("asDouble");
+        writer.value(value);
+        writer.end_object();
+        writer.end_array();
+    }
+
+    void write_gauge(JsonWriter &writer, const char *name, const char *unit, const std::string &time, double value)
+    {
+        if (!std::isfinite(value))
+            return;
+        writer.begin_object();
+        writer.key("name");
+        writer.value(name);
+        writer.key("unit");
+        writer.value(unit);
+        writer.key("gauge");
+        writer.begin_object();
+        write_data_point(writer, nullptr, time, value);
+        writer.end_object();
+        writer.end_object();
+    }
+
+    void write_cumulative_sum(JsonWriter &writer, const char *name, const char *unit, const std::string &start,
+                              const std::string &time, double value)
+    {
+        if (!std::isfinite(value))
+            return;
+        writer.begin_object();
+        writer.key("name");
+        writer.value(name);
+        writer.key("unit");
+        writer.value(unit);
+        writer.key("sum");
+        writer.begin_object();
+        writer.key("aggregationTemporality");
+        writer.value(OTLP_CUMULATIVE);
+        writer.key("isMonotonic");
+        writer.raw("true");
+        write_data_point(writer, &start, time, value);
+        writer.end_object();
+        writer.end_object();
+    }
+
+    void write_resource_metrics(JsonWriter &writer, const app_result &result, const std::string &time)
+    {
+        writer.begin_object();
+        writer.key("resource");
+        writer.begin_object();
+        writer.key("attributes");
+        writer.begin_array();
+        if (!host_name().empty())
+            write_attribute(writer, "host.name", host_name());
+        write_attribute(writer, "epmon.app", result.app);
+        if (result.is_cgroup)
+            write_attribute(writer, "epmon.cgroup", result.cgroup);
+        else
+            write_attribute(writer, "process.pid", (long long) result.pid);
+        writer.end_array();
+        writer.end_object();
+        writer.key("scopeMetrics");
+        writer.begin_array();
+        writer.begin_object();
+        writer.key("scope");
+        writer.begin_object();
+        writer.key("name");
+        writer.value("epmon");
+        writer.end_object();
+        writer.key("metrics");
+        writer.begin_array();
+        std::chrono::system_clock::time_point start = result.cpu_start;
+        if (start == std::chrono::system_clock::time_point())
+            start = epmon_start;
+        write_cumulative_sum(writer, "epmon.cpu.time", "s", unix_nano(start), time, result.cpu_seconds);
+        write_gauge(writer, "epmon.memory.usage", "By", time, result.memory * 1024.0);
+        if (result.is_cgroup) {
+            write_gauge(writer, "epmon.memory.anon", "By", time, result.memory_anon * 1024.0);
+            write_gauge(writer, "epmon.memory.file", "By", time, result.memory_file * 1024.0);
+            write_gauge(writer, "epmon.io.read.rate", "By/s", time, result.io_read);
+            write_gauge(writer, "epmon.io.write.rate", "By/s", time, result.io_write);
+        }
+        writer.end_array();
+        writer.end_object();
+        writer.end_array();
+        writer.end_object();
+    }
+}
+
+void write_otlp(std::string &out, const std::vector<app_result> &results, std::chrono::system_clock::time_point when)
+{
+    JsonWriter writer(out);
+    std::string time = unix_nano(when);
+
+    writer.begin_object();
+    writer.key("resourceMetrics");
+    writer.begin_array();
+    for (const app_result &result : results)
+        write_resource_metrics(writer, result, time);
+    writer.end_array();
+    writer.end_object();
+}
+
+// The requests were all written by write_otlp(), so the resourceMetrics are everything
+// between the prefix and the suffix.
+void append_otlp_batch(std::string &out, const std::vector<const std::string *> &requests)
+{
+    static const size_t prefix_len = sizeof(OTLP_REQUEST_PREFIX) - 1;
+    static const size_t suffix_len = sizeof(OTLP_REQUEST_SUFFIX) - 1;
+    bool empty = true;
+
+    out.append(OTLP_REQUEST_PREFIX);
+    for (const std::string *request : requests) {
+        if (request->size() <= prefix_len + suffix_len)
+            continue;
+        if (!empty)
+            out.push_back(',');
+        out.append(*request, prefix_len, request->size() - prefix_len - suffix_len);
+        empty = false;
+    }
+    out.append(OTLP_REQUEST_SUFFIX);
+}
@@ -0,0 +1,18 @@
+// otlp.h
+// This file defines the functions that write the results as OpenTelemetry metrics. See
+// otlp.cpp for more information.
+
+#ifndef EPMON_OTLP_H
+#define EPMON_OTLP_H
+
+#include <chrono>
+#include <string>
+#include <vector>
+#include "results.h"
+
+// Append an OTLP/HTTP JSON ExportMetricsServiceRequest for the round's results to out.
+void write_otlp(std::string &out, const std::vector<app_result> &results, std::chrono::system_clock::time_point when);
+// Append one request made of the resourceMetrics of all of the given requests to out.
+void append_otlp_batch(std::string &out, const std::vector<const std::string *> &requests);
+
+#endif //EPMON_OTLP_H
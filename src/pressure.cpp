@@ -0,0 +1,94 @@
+// pressure.cpp
+// This file implements the Pressure Stall Information (PSI) helpers. CPU usage on its own
+// can't tell a busy service from one that is starved: 50% CPU might be all it needs, or
+// it might be waiting on a saturated CPU, on reclaim or on I/O for the other half of the
+// time. The kernel measures that waiting directly, in /proc/pressure/{cpu,memory,io} for
+// the whole system and in {cpu,memory,io}.pressure for each cgroup, in the form
+//   some avg10=0.00 avg60=0.00 avg300=0.00 total=0
+//   full avg10=0.00 avg60=0.00 avg300=0.00 total=0
+// The Monitor reads these files in each round. The same files also accept triggers:
+// writing "some 150000 1000000" asks the kernel to signal the open descriptor with
+// POLLPRI when tasks stall for more than 150ms in any one second window. The EventWatcher
+// keeps the configured triggers open and polls them along with its inotify descriptor,
+// so a pressure spike is reported within milliseconds instead of at the next cycle.
+// What It Doesn't Do
+// Kernels without CONFIG_PSI, or booted with psi=0, have no pressure files; then there's
+// nothing to report and triggers fail to register. Without CAP_SYS_RESOURCE, recent
+// kernels only accept trigger windows that are a multiple of 2 seconds; other triggers
+// are rejected with EINVAL, which the EventWatcher logs.
+
+#include "pressure.h"
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define SYSTEM_PRESSURE_DIR     "/proc/pressure/"
+#define PRESSURE_FILE_LEN       256
+
+const std::vector<std::string> psi_resources = { "cpu", "memory", "io" };
+
+// An anonymous namespace for functions that don't need to be visible outside this file.
+namespace {
+    // Parse a "some ..." or "full ..." line. Anything else leaves the line invalid.
+    void parse_psi_line(const char *line, psi_stats &stats)
+    {
+        char type[8];
+        psi_line pl = { false, 0.0, 0.0, 0.0, 0 };
+
+        if (sscanf(line, "%7s avg10=%lf avg60=%lf avg300=%lf total=%llu",
+                   type, &pl.avg10, &pl.avg60, &pl.avg300, &pl.total) != 5)
+            return;
+        pl.valid = true;
+        if (strcmp(type, "some") == 0)
+            stats.some = pl;
+        else if (strcmp(type, "full") == 0)
+            stats.full = pl;
+    }
+}
+
+std::string pressure_path(const std::string &resource, const std::string &cgroup_dir)
+{
+    if (cgroup_dir.empty())
+        return SYSTEM_PRESSURE_DIR + resource;
+    return cgroup_dir + "/" + resource + ".pressure";
+}
+
+bool read_pressure(const std::string &path, psi_stats &stats)
+{
+    char buf[PRESSURE_FILE_LEN];
+
+    memset(&stats, 0, sizeof(stats));
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+    ssize_t nread = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (nread <= 0)
+        return false;
+    buf[nread] = '\0';
+    char *full_line = strchr(buf, '\n');
+    if (full_line != nullptr)
+        *full_line++ = '\0';
+    parse_psi_line(buf, stats);
+    if (full_line != nullptr)
+        parse_psi_line(full_line, stats);
+    return stats.some.valid;
+}
+
+int open_psi_trigger(const std::string &path, const std::string &type,
+                     unsigned long threshold_us, unsigned long window_us)
+{
+    char trigger[64];
+
+    int fd = open(path.c_str(), O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    // The trigger string must be written, including its NUL, in a single write.
+    int len = snprintf(trigger, sizeof(trigger), "%s %lu %lu", type.c_str(), threshold_us, window_us);
+    if (write(fd, trigger, len + 1) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
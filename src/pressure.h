@@ -0,0 +1,42 @@
+// pressure.h
+// This file declares the Pressure Stall Information helpers. See pressure.cpp for more information.
+
+#ifndef EPMON_PRESSURE_H
+#define EPMON_PRESSURE_H
+
+#include <string>
+#include <vector>
+
+// One line of a pressure file: the share of time, in percent, that some (or all) tasks
+// were stalled on the resource, averaged over 10, 60 and 300 seconds, and the total
+// stall time in microseconds.
+struct psi_line {
+    bool valid;
+    double avg10;
+    double avg60;
+    double avg300;
+    unsigned long long total;
+};
+
+// The contents of a pressure file. The system-wide cpu file has no "full" line on older
+// kernels, in which case full.valid is false.
+struct psi_stats {
+    psi_line some;
+    psi_line full;
+};
+
+// The resources we report pressure for, in the order we report them.
+extern const std::vector<std::string> psi_resources;
+
+// The path of the pressure file for a resource, system-wide if cgroup_dir is empty.
+std::string pressure_path(const std::string &resource, const std::string &cgroup_dir);
+// Read and parse a pressure file. Returns false if it can't be read.
+bool read_pressure(const std::string &path, psi_stats &stats);
+// Register a PSI trigger on a pressure file: the kernel signals the returned descriptor
+// with POLLPRI whenever the stall time of the given type ("some" or "full") exceeds
+// threshold_us within any window_us period. Returns -1 on error. Closing the descriptor
+// removes the trigger.
+int open_psi_trigger(const std::string &path, const std::string &type,
+                     unsigned long threshold_us, unsigned long window_us);
+
+#endif //EPMON_PRESSURE_H
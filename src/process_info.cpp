@@ -3,42 +3,25 @@
 // https://ubuntuforums.org/showthread.php?t=657097
 // https://raw.githubusercontent.com/fho/code_snippets/master/c/getusage.c
 // It is mostly roughly polished C code, not really C++ at all.
-// It is intended that the single entry point into this module is the get_proc_info() function.
-// It is expected that this entire module be replaced with something more robust, but this will
-// have to do for now. The thing that bothers me most is the need to do "before" and "after"
-// calls to get proc data to calculate the percent of CPU used by the process. There should be
-// a better way but I couldn't find it in a reasonable time frame.
+// This module used to be the whole process info implementation, with a single entry point,
+// get_proc_info(), that found one process, read its stat file with stdio, slept for a
+// second and read it again. That work is now done in batches by the Collector backends
+// (see collector.cpp), and what's left here are the parsing and calculation helpers they
+// share. None of these functions do any I/O; the backends read the /proc files however
+// they like and hand the text to these functions.
 // Testing
 // This code is probably fairly easy to test. Since it's C code, we can create a test module
-// to call the various functions individually. It would also be nice to have fake versions
-// of some functions, to create fake process data and see how the rest of the code handles it.
+// to call the various functions individually. Now that the parsers take a buffer instead of
+// a file, it's easy to feed them fake process data and see how the rest of the code handles it.
 
 #include "process_info.h"
-#include <unistd.h>
-#include <dirent.h>
+#include <algorithm>
+#include <cerrno>
 #include <climits>
+#include <cstdio>
 #include <cstdlib>
 #include <cstring>
-
-#define PROC_DIRECTORY      "/proc/"
-#define STAT_DIRECTORY      "/stat"
-#define CASE_SENSITIVE      1
-#define CASE_INSENSITIVE    0
-#define MAX_CMDLINE_LEN     4096
-#define MAX_PROCNAME_LEN    1024
-#define MAX_STATPATH_LEN    128
-
-// This struct is used to store a subset of the data available in the /proc/<pid>/stat file.
-struct pstat
-{
-    long unsigned int utime_ticks;
-    long int cutime_ticks;
-    long unsigned int stime_ticks;
-    long int cstime_ticks;
-    long unsigned int vsize;    // virtual memory size in bytes
-    long unsigned int rss;      // Resident Set Size in bytes
-    long unsigned int cpu_total_time;
-};
+#include <unistd.h>
 
 // Return true if the given string contains only digits, false otherwise.
 bool IsNumeric(const char *pstr)
@@ -60,128 +43,83 @@ bool contains_proc_name(const char *haystack, const char *needle, bool case_sens
         return strcasestr(haystack, needle) != nullptr;
 }
 
-// Given a process name, search the process directories in the /proc directory for
-// a directory/process with a matching (or containing) name. If a match is found,
-// convert the directory name to a PID and return it. Return -2 if an error occurs
-// with the proc directory, or -1 if no matching process is found.
-pid_t GetPIDbyName(const char *pproc_name, bool check_case)
+// Convert a /proc directory name to a PID. Return -1 if the name isn't a valid PID.
+pid_t parse_pid(const char *pid_str)
 {
-    char cmdline_path[MAX_CMDLINE_LEN];
-    char proc_name[MAX_PROCNAME_LEN];
     char *endptr = nullptr;
-    auto pid = (pid_t) -1;
-    struct dirent *dir_entry = nullptr;
-    DIR *dir_proc = nullptr;
 
-    dir_proc = opendir(PROC_DIRECTORY);
-    if (dir_proc == nullptr)
-    {
-        perror("Unable to open the " PROC_DIRECTORY " directory.");
-        return (pid_t) -2;
+    errno = 0;
+    long pid_tmp = strtol(pid_str, &endptr, 10);
+    if ((errno == ERANGE && (pid_tmp == LONG_MAX || pid_tmp == LONG_MIN)) ||
+        (errno != 0 && pid_tmp == 0)) {
+        fprintf(stderr, "ERROR: failed to extract PID: invalid range.\n");
+        pid_tmp = -1;
     }
-
-    // Loop through the entries in the proc directory, looking for directories with
-    // names consisting of only digits.
-    while ( (dir_entry = readdir(dir_proc)) )
-    {
-        if (dir_entry->d_type == DT_DIR)
-        {
-            if (IsNumeric(dir_entry->d_name))
-            {
-                // Found a process directory. Read the cmdline file inside the directory
-                // to find the executable name.
-                strcpy(cmdline_path, PROC_DIRECTORY);
-                strcat(cmdline_path, dir_entry->d_name);
-                strcat(cmdline_path, "/cmdline");
-                FILE *cmdline_file = fopen(cmdline_path, "rt");  // open the file for reading text
-                if (cmdline_file)
-                {
-                    // The command line could be really long, make sure we don't overflow the buffer.
-                    fgets(proc_name, MAX_PROCNAME_LEN, cmdline_file);
-                    // Only look at the first entry in the command line string, which should be
-                    // the executable name.
-                    char *p = strchr(proc_name, ' ');
-                    if (p != nullptr)
-                        *p = '\0';
-                    // See if the process's executable name contains the process name we're
-                    // looking for. The executable name probably contains the path info,
-                    // which we may not have been given for the process we're looking for.
-                    if (contains_proc_name(proc_name, pproc_name, check_case))
-                    {
-                        // Found a matching process name. The name of the containing
-                        // directory is the PID, so convert it to a pid_t and return it.
-                        errno = 0;
-                        long pid_tmp = strtol(dir_entry->d_name, &endptr, 10);
-                        if ((errno == ERANGE && (pid_tmp == LONG_MAX || pid_tmp == LONG_MIN)) ||
-                            (errno != 0 && pid_tmp == 0)) {
-                            fprintf(stderr, "ERROR: failed to extract PID: invalid range.\n");
-                            pid_tmp = -1;
-                        }
-                        if (endptr == dir_entry->d_name) {
-                            fprintf(stderr, "ERROR: failed to extract PID: no digits were found.\n");
-                            pid_tmp = -1;
-                        }
-                        fclose(cmdline_file);
-                        closedir(dir_proc);
-                        return (pid_t) pid_tmp;
-                    }
-                    fclose(cmdline_file);
-                }
-            }
-        }
+    if (endptr == pid_str) {
+        fprintf(stderr, "ERROR: failed to extract PID: no digits were found.\n");
+        pid_tmp = -1;
     }
-    closedir(dir_proc);
-    return pid;
+    return (pid_t) pid_tmp;
 }
 
-// Read the proc stat data for the given PID into the passed-in struct. Return 0
-// if successful, -1 otherwise.
-int get_proc_data(const pid_t pid, struct pstat *result)
+// Parse the contents of a /proc/<pid>/stat file into the passed-in struct. The second
+// field is the command name in parentheses, and it can contain spaces and parentheses
+// of its own, so we take everything up to the last ')' as the name before scanning the
+// numeric fields. The cpu_total_time member is left alone; it comes from /proc/stat,
+// not the process. Return 0 if successful, -1 otherwise.
+int parse_proc_stat(const char *buf, struct pstat *result)
 {
-    char stat_filepath[MAX_STATPATH_LEN];
-    // Create the path to the process.
-    snprintf(stat_filepath, MAX_STATPATH_LEN, "%s%d%s", PROC_DIRECTORY, pid, STAT_DIRECTORY);
-    FILE *fprocess_stat = fopen(stat_filepath, "r");
-    if (fprocess_stat == nullptr) {
-        perror("Failed to open the process's stat directory ");
+    const char *name = strchr(buf, '(');
+    const char *fields = strrchr(buf, ')');
+    if (name == nullptr || fields == nullptr || fields < name)
         return -1;
-    }
-    FILE *fstat = fopen("/proc/stat", "r");
-    if (fstat == nullptr) {
-        perror("Failed to open /proc/stat ");
-        fclose(fprocess_stat);
-        return -1;
-    }
-    // Read values from /proc/pid/stat
+    long unsigned int cpu_total_time = result->cpu_total_time;
     bzero(result, sizeof(struct pstat));
+    result->cpu_total_time = cpu_total_time;
+    size_t name_len = std::min((size_t) (fields - name - 1), sizeof(result->comm) - 1);
+    memcpy(result->comm, name + 1, name_len);
+    result->comm[name_len] = '\0';
     long int rss;
-    if (fscanf(fprocess_stat, "%*d %*s %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu"
-                       "%lu %ld %ld %*d %*d %*d %*d %*u %lu %ld",
+    if (sscanf(fields + 1, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu"
+                           "%lu %ld %ld %*d %*d %*d %*d %llu %lu %ld",
                &result->utime_ticks, &result->stime_ticks,
                &result->cutime_ticks, &result->cstime_ticks,
-               &result->vsize, &rss) == EOF) {
-        fclose(fprocess_stat);
-        fclose(fstat);
+               &result->starttime, &result->vsize, &rss) != 7)
         return -1;
-    }
-    fclose(fprocess_stat);
     result->rss = rss * getpagesize();
+    return 0;
+}
 
-    // Read the individual state time values.
-    long unsigned int cpu_time[10];
-    bzero(cpu_time, sizeof(cpu_time));
-    if (fscanf(fstat, "%*s %lu %lu %lu %lu %lu %lu %lu %lu %lu %lu",
-               &cpu_time[0], &cpu_time[1], &cpu_time[2], &cpu_time[3],
-               &cpu_time[4], &cpu_time[5], &cpu_time[6], &cpu_time[7],
-               &cpu_time[8], &cpu_time[9]) == EOF) {
-        fclose(fstat);
-        return -1;
+// Parse the "cpu" lines at the start of /proc/stat: the first is the total for all CPUs,
+// followed by one line per CPU. cpus[0] gets the total and cpus[n + 1] CPU n. Older
+// kernels have fewer columns; the missing ones are left at zero. Return 0 if successful,
+// -1 otherwise.
+int parse_cpu_lines(const char *buf, std::vector<cpu_times> &cpus)
+{
+    cpus.clear();
+    for (const char *line = buf; line != nullptr && strncmp(line, "cpu", 3) == 0; ) {
+        cpu_times times;
+        bzero(&times, sizeof(times));
+        if (sscanf(line, "%*s %lu %lu %lu %lu %lu %lu %lu %lu %lu %lu",
+                   &times.user, &times.nice, &times.system, &times.idle,
+                   &times.iowait, &times.irq, &times.softirq, &times.steal,
+                   &times.guest, &times.guest_nice) < 4)
+            break;
+        // Only keep complete lines, in case the buffer was too small for all of them.
+        line = strchr(line, '\n');
+        if (line == nullptr)
+            break;
+        line++;
+        cpus.push_back(times);
     }
-    fclose(fstat);
-    // Sum up the time spent in the various states to get total CPU time.
-    for (int ii = 0; ii < 10; ii++)
-        result->cpu_total_time += cpu_time[ii];
-    return 0;
+    return cpus.empty() ? -1 : 0;
+}
+
+// Sum up the time spent in the various states to get total CPU time.
+long unsigned int cpu_times_total(const cpu_times &times)
+{
+    return times.user + times.nice + times.system + times.idle + times.iowait
+           + times.irq + times.softirq + times.steal + times.guest + times.guest_nice;
 }
 
 // Given two sets of proc stat data, calculate the CPU usage between them and return
@@ -199,35 +137,3 @@ void calc_cpu_usage_pct(const struct pstat *cur_usage, const struct pstat *last_
                            - (last_usage->stime_ticks + last_usage->cstime_ticks))) /
                          (double) total_time_diff;
 }
-
-// The external function to call to get information about the given process name.
-// Returns the PID for the given process name, or -1 if no matching process is found,
-// or -2 if there's an error dealing with the proc directory.
-// The only way to get the CPU usage is to calculate it from two different times.
-// We get the process's stat data, sleep for 1 second, then get the data again.
-// With those two sets of data we can calculate CPU usage.
-// Memory use is reported in Kbytes.
-int get_proc_info(const std::string &proc_name, int *pid, double *pcpu, double *mem)
-{
-    int ret = 0;
-    struct pstat before = { 0 }, after = { 0 };
-    double ucpu_usage = 0.0;
-
-    pid_t pid_tmp = GetPIDbyName(proc_name.c_str(), CASE_INSENSITIVE);
-    *pid = (int) pid_tmp;
-    *pcpu = 0.0;
-    *mem = 0.0;
-    if (pid_tmp > 0) {
-        ret = get_proc_data(pid_tmp, &before);
-        if (ret != 0)
-            return ret;
-        sleep(1);
-        ret = get_proc_data(pid_tmp, &after);
-        if (ret != 0)
-            return ret;
-        calc_cpu_usage_pct(&after, &before, pcpu, &ucpu_usage);
-        *pcpu = ucpu_usage;
-        *mem = static_cast<double>(after.vsize) / 1024.0;
-    }
-    return 0;
-}
@@ -1,11 +1,50 @@
-// process_info.cpp
+// process_info.h
 // See process_info.cpp for more information.
 
 #ifndef EPMON_PROCESS_INFO_H
 #define EPMON_PROCESS_INFO_H
 
 #include <string>
+#include <vector>
+#include <sys/types.h>
 
-int get_proc_info(const std::string &proc_name, int *pid, double *pcpu, double *mem);
+// This struct is used to store a subset of the data available in the /proc/<pid>/stat file.
+struct pstat
+{
+    long unsigned int utime_ticks;
+    long int cutime_ticks;
+    long unsigned int stime_ticks;
+    long int cstime_ticks;
+    long unsigned int vsize;    // virtual memory size in bytes
+    long unsigned int rss;      // Resident Set Size in bytes
+    long long unsigned int starttime;   // ticks after boot, to tell reused PIDs apart
+    long unsigned int cpu_total_time;
+    char comm[16];              // the command name, truncated by the kernel to 15 characters
+};
+
+// The time, in ticks, that one CPU (or all of them, for the "cpu" line) spent in each
+// state, from a line of /proc/stat.
+struct cpu_times
+{
+    long unsigned int user;
+    long unsigned int nice;
+    long unsigned int system;
+    long unsigned int idle;
+    long unsigned int iowait;
+    long unsigned int irq;
+    long unsigned int softirq;
+    long unsigned int steal;
+    long unsigned int guest;
+    long unsigned int guest_nice;
+};
+
+bool IsNumeric(const char *pstr);
+bool contains_proc_name(const char *haystack, const char *needle, bool case_sensitive);
+pid_t parse_pid(const char *pid_str);
+int parse_proc_stat(const char *buf, struct pstat *result);
+int parse_cpu_lines(const char *buf, std::vector<cpu_times> &cpus);
+long unsigned int cpu_times_total(const cpu_times &times);
+void calc_cpu_usage_pct(const struct pstat *cur_usage, const struct pstat *last_usage,
+                        double *ucpu_usage, double *scpu_usage);
 
 #endif //EPMON_PROCESS_INFO_H
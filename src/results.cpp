@@ -0,0 +1,306 @@
+// results.cpp
+// This file implements the serialization of a round of results. The Monitor fills in an
+// app_result for each app and cgroup, and when it's time to send them write_report()
+// writes the whole report as JSON text with a JsonWriter (see json_writer.cpp):
+// { "healthcheck" : [
+//   { "app": "bash",
+//     "timestamp": "Mon Nov 22 15:02:51 2021",
+//     "PID": 2544,
+//     "CPU": 0.264,
+//     "Memory": 13852672.0 },
+//   { "app": "nginx",
+//     "timestamp": "Mon Nov 22 15:02:51 2021",
+//     "cgroup": "/sys/fs/cgroup/system.slice/nginx.service",
+//     "CPU": 0.264,
+//     "Memory": 13852.0,
+//     "MemoryAnon": 9216.0,
+//     "MemoryFile": 4096.0,
+//     "IORead": 0.0,
+//     "IOWrite": 4096.0,
+//     "pressure": { "cpu": { "some": { ... }, "full": { ... } }, "memory": ..., "io": ... } },
+//   ...
+//   ],
+//   "host": { ... }, "pressure": { ... }, "top": { ... }, ...
+// }
+// The healthcheck entries are written straight from the structs. The other top-level
+// members are small, once-per-report objects, so they are still built as json objects
+// and written with dump(). The text is the same as dump() would produce for the whole
+// report, keys in sorted order and all.
+// The binary formats are written by nlohmann json itself, so for them report_to_json()
+// builds the report as a json object instead.
+// The example above is the "rows" layout. With the "columns" layout the results are sent as one array
+// per field instead, in two groups since processes and cgroups don't have the same fields,
+// and the timestamp is only sent once:
+// { "healthcheck_columns" : {
+//     "processes": { "CPU": [0.264, ...], "Memory": [13852672.0, ...], "PID": [2544, ...],
+//                    "app": ["bash", ...] },
+//     "cgroups": { "CPU": [...], "IORead": [...], "IOWrite": [...], "Memory": [...],
+//                  "MemoryAnon": [...], "MemoryFile": [...], "app": [...], "cgroup": [...],
+//                  "pressure": [{ ... }, null, ...] },
+//     "timestamp": "Mon Nov 22 15:02:51 2021",
+//     "version": 1 },
+//   "host": { ... }, ...
+// }
+// The i'th element of each array in a group belongs to the same app. A group with no
+// results is left out. The key is different from the rows layout's, and "version" goes
+// up if the columns ever change, so the results server can tell what it's been sent.
+// The keys are only sent once per report instead of once per app, so for a long list of
+// apps this is a fraction of the size, and quicker to parse.
+// The whole round is sampled at once, so it has a single timestamp. It's taken and
+// formatted once per round (see format_timestamp()), and written into each entry as is.
+// The legacy ctime format is the default; epoch_ns and rfc3339 sort properly and say
+// which time zone they're in, so the results server doesn't have to guess.
+// What It Doesn't Do
+// The key order is hard-coded; a new field has to go in its sorted place in both
+// functions.
+// Testing
+// write_report() and report_to_json().dump() should give the same string for any set of
+// results.
+
+#include <cstdio>
+#include <ctime>
+#include "results.h"
+#include "json_writer.h"
+
+// The version of the columns layout. Bump it when the columns change.
+#define COLUMNS_LAYOUT_VERSION  1
+
+// An anonymous namespace for functions that don't need to be visible outside this file.
+namespace {
+    // Write one healthcheck entry, keys in the order dump() sorts them into. The
+    // timestamp is already JSON text.
+    void write_result(JsonWriter &writer, const app_result &result, const std::string &timestamp)
+    {
+        writer.begin_object();
+        writer.key("CPU");
+        writer.value(result.cpu);
+        if (result.is_cgroup) {
+            writer.key("IORead");
+            writer.value(result.io_read);
+            writer.key("IOWrite");
+            writer.value(result.io_write);
+        }
+        writer.key("Memory");
+        writer.value(result.memory);
+        if (result.is_cgroup) {
+            writer.key("MemoryAnon");
+            writer.value(result.memory_anon);
+            writer.key("MemoryFile");
+            writer.value(result.memory_file);
+        }
+        else {
+            writer.key("PID");
+            writer.value(result.pid);
+        }
+        writer.key("app");
+        writer.value(result.app);
+        if (result.is_cgroup) {
+            writer.key("cgroup");
+            writer.value(result.cgroup);
+            if (!result.pressure.empty()) {
+                writer.key("pressure");
+                writer.value(result.pressure);
+            }
+        }
+        writer.key("timestamp");
+        writer.raw(timestamp);
+        writer.end_object();
+    }
+
+    json result_to_json(const app_result &result, const json &timestamp)
+    {
+        json jres = {
+                {"app", result.app},
+                {"timestamp", timestamp},
+                {"CPU", result.cpu},
+                {"Memory", result.memory},
+        };
+        if (result.is_cgroup) {
+            jres["cgroup"] = result.cgroup;
+            jres["MemoryAnon"] = result.memory_anon;
+            jres["MemoryFile"] = result.memory_file;
+            jres["IORead"] = result.io_read;
+            jres["IOWrite"] = result.io_write;
+            if (!result.pressure.empty())
+                jres["pressure"] = result.pressure;
+        }
+        else
+            jres["PID"] = result.pid;
+        return jres;
+    }
+
+    void split_results(const std::vector<app_result> &results, std::vector<const app_result *> &processes,
+                       std::vector<const app_result *> &cgroups)
+    {
+        for (const app_result &result : results) {
+            if (result.is_cgroup)
+                cgroups.push_back(&result);
+            else
+                processes.push_back(&result);
+        }
+    }
+
+    // Write one column: the same field of each of the results.
+    template <typename T>
+    void write_column(JsonWriter &writer, const char *name, const std::vector<const app_result *> &results,
+                      T app_result::*field)
+    {
+        writer.key(name);
+        writer.begin_array();
+        for (const app_result *result : results)
+            writer.value(result->*field);
+        writer.end_array();
+    }
+
+    template <typename T>
+    json column_to_json(const std::vector<const app_result *> &results, T app_result::*field)
+    {
+        json jcol = json::array();
+        for (const app_result *result : results)
+            jcol.push_back(result->*field);
+        return jcol;
+    }
+
+    // Write the results in the columns layout, keys in the order dump() sorts them into.
+    // The timestamp is already JSON text.
+    void write_columns(JsonWriter &writer, const std::vector<app_result> &results, const std::string &timestamp)
+    {
+        std::vector<const app_result *> processes, cgroups;
+
+        split_results(results, processes, cgroups);
+        writer.begin_object();
+        if (!cgroups.empty()) {
+            writer.key("cgroups");
+            writer.begin_object();
+            write_column(writer, "CPU", cgroups, &app_result::cpu);
+            write_column(writer, "IORead", cgroups, &app_result::io_read);
+            write_column(writer, "IOWrite", cgroups, &app_result::io_write);
+            write_column(writer, "Memory", cgroups, &app_result::memory);
+            write_column(writer, "MemoryAnon", cgroups, &app_result::memory_anon);
+            write_column(writer, "MemoryFile", cgroups, &app_result::memory_file);
+            write_column(writer, "app", cgroups, &app_result::app);
+            write_column(writer, "cgroup", cgroups, &app_result::cgroup);
+            write_column(writer, "pressure", cgroups, &app_result::pressure);
+            writer.end_object();
+        }
+        if (!processes.empty()) {
+            writer.key("processes");
+            writer.begin_object();
+            write_column(writer, "CPU", processes, &app_result::cpu);
+            write_column(writer, "Memory", processes, &app_result::memory);
+            write_column(writer, "PID", processes, &app_result::pid);
+            write_column(writer, "app", processes, &app_result::app);
+            writer.end_object();
+        }
+        writer.key("timestamp");
+        writer.raw(timestamp);
+        writer.key("version");
+        writer.value(COLUMNS_LAYOUT_VERSION);
+        writer.end_object();
+    }
+
+    json columns_to_json(const std::vector<app_result> &results, const json &timestamp)
+    {
+        std::vector<const app_result *> processes, cgroups;
+        json jres = {
+                {"timestamp", timestamp},
+                {"version", COLUMNS_LAYOUT_VERSION},
+        };
+
+        split_results(results, processes, cgroups);
+        if (!cgroups.empty()) {
+            jres["cgroups"] = {
+                    {"CPU", column_to_json(cgroups, &app_result::cpu)},
+                    {"IORead", column_to_json(cgroups, &app_result::io_read)},
+                    {"IOWrite", column_to_json(cgroups, &app_result::io_write)},
+                    {"Memory", column_to_json(cgroups, &app_result::memory)},
+                    {"MemoryAnon", column_to_json(cgroups, &app_result::memory_anon)},
+                    {"MemoryFile", column_to_json(cgroups, &app_result::memory_file)},
+                    {"app", column_to_json(cgroups, &app_result::app)},
+                    {"cgroup", column_to_json(cgroups, &app_result::cgroup)},
+                    {"pressure", column_to_json(cgroups, &app_result::pressure)},
+            };
+        }
+        if (!processes.empty()) {
+            jres["processes"] = {
+                    {"CPU", column_to_json(processes, &app_result::cpu)},
+                    {"Memory", column_to_json(processes, &app_result::memory)},
+                    {"PID", column_to_json(processes, &app_result::pid)},
+                    {"app", column_to_json(processes, &app_result::app)},
+            };
+        }
+        return jres;
+    }
+}
+
+json format_timestamp(time_format format, std::chrono::system_clock::time_point when)
+{
+    long long ns = std::chrono::duration_cast<std::chrono::nanoseconds>(when.time_since_epoch()).count();
+    if (format == time_format::epoch_ns)
+        return ns;
+    std::time_t the_time = std::chrono::system_clock::to_time_t(when);
+    struct tm tm;
+    char buf[64];
+    localtime_r(&the_time, &tm);
+    if (format == time_format::rfc3339) {
+        size_t len = strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%S", &tm);
+        long offset = tm.tm_gmtoff / 60;
+        char sign = offset < 0 ? '-' : '+';
+        if (offset < 0)
+            offset = -offset;
+        long long frac = ns % 1000000000LL;
+        if (frac < 0)
+            frac += 1000000000LL;
+        snprintf(buf + len, sizeof(buf) - len, ".%09lld%c%02ld:%02ld", frac, sign, offset / 60, offset % 60);
+        return std::string(buf);
+    }
+    // The same as ctime(), without the trailing newline.
+    strftime(buf, sizeof(buf), "%a %b %e %H:%M:%S %Y", &tm);
+    return std::string(buf);
+}
+
+void write_report(std::string &out, const std::vector<app_result> &results, const json &timestamp,
+                  results_layout layout, const json &extra)
+{
+    JsonWriter writer(out);
+    const char *name = (layout == results_layout::columns) ? "healthcheck_columns" : "healthcheck";
+    bool healthcheck_done = results.empty();
+    std::string stamp = timestamp.dump();
+
+    writer.begin_object();
+    for (auto it = extra.begin(); ; ++it) {
+        // The results go in their sorted place among the other members.
+        if (!healthcheck_done && (it == extra.end() || it.key() > name)) {
+            writer.key(name);
+            if (layout == results_layout::columns)
+                write_columns(writer, results, stamp);
+            else {
+                writer.begin_array();
+                for (const app_result &result : results)
+                    write_result(writer, result, stamp);
+                writer.end_array();
+            }
+            healthcheck_done = true;
+        }
+        if (it == extra.end())
+            break;
+        writer.key(it.key());
+        writer.value(it.value());
+    }
+    writer.end_object();
+}
+
+json report_to_json(const std::vector<app_result> &results, const json &timestamp, results_layout layout,
+                    const json &extra)
+{
+    json jres = extra.is_object() ? extra : json::object();
+    if (!results.empty() && layout == results_layout::columns)
+        jres["healthcheck_columns"] = columns_to_json(results, timestamp);
+    else if (!results.empty()) {
+        json jvec = json::array();
+        for (const app_result &result : results)
+            jvec.push_back(result_to_json(result, timestamp));
+        jres["healthcheck"] = jvec;
+    }
+    return jres;
+}
@@ -0,0 +1,52 @@
+// results.h
+// This file defines the typed results of a monitoring round and the functions that
+// serialize them. See results.cpp for more information.
+
+#ifndef EPMON_RESULTS_H
+#define EPMON_RESULTS_H
+
+#include <chrono>
+#include <string>
+#include <vector>
+#include "nlohmann_json/json.hpp"
+#include "monitor_options.h"
+
+using json = nlohmann::json;
+
+// The results for one monitored app or cgroup: one entry in the healthcheck list.
+struct app_result {
+    std::string app;
+    // The process, or 0 for a cgroup.
+    int pid = 0;
+    double cpu = 0.0;
+    // Kbytes.
+    double memory = 0.0;
+    // The CPU time used since the process started, or since the cgroup was created, in
+    // seconds, and when the process started (left at the epoch for a cgroup, where we
+    // don't know). Only the OTLP format (see otlp.cpp) sends these.
+    double cpu_seconds = 0.0;
+    std::chrono::system_clock::time_point cpu_start;
+    // The rest are only for cgroups: the cgroup directory, the memory breakdown (Kbytes),
+    // the I/O rates (bytes/second) and the cgroup's pressure, if it has any.
+    bool is_cgroup = false;
+    std::string cgroup;
+    double memory_anon = 0.0;
+    double memory_file = 0.0;
+    double io_read = 0.0;
+    double io_write = 0.0;
+    json pressure;
+};
+
+// The timestamp for a round of results (or an event) in the configured format: a string,
+// or a number for epoch_ns.
+json format_timestamp(time_format format, std::chrono::system_clock::time_point when);
+// Append the report, the results in the given layout plus the other top-level members in
+// extra (host, top and so on), to out as JSON text, exactly as dump() would write it.
+// Every result gets the same timestamp, the one the round was sampled at.
+void write_report(std::string &out, const std::vector<app_result> &results, const json &timestamp,
+                  results_layout layout, const json &extra);
+// Build the same report as a json object, for the binary formats.
+json report_to_json(const std::vector<app_result> &results, const json &timestamp, results_layout layout,
+                    const json &extra);
+
+#endif //EPMON_RESULTS_H
@@ -0,0 +1,591 @@
+// results_sender.cpp
+// This file implements the ResultsSender class. This class is responsible for POSTing
+// finished reports to the results server, so the Monitor doesn't have to wait on the
+// network. The Monitor serializes each report and hands it to enqueue(), which puts it
+// on a bounded queue and returns straight away; the sender thread takes reports off the
+// front of the queue and sends them. A slow or hung results server then only backs up
+// the queue, and the Monitor keeps sampling on schedule.
+// This is the HTTP kind of results sink (see results_sink.cpp). There's one for the
+// results server, and one for each other HTTP destination, each with its own queue,
+// spool directory and thread.
+// Normally each report is sent on its own. With batching turned on, the sender takes
+// reports off the queue into a batch and sends them together, as
+// { "batch" : [ { "healthcheck": [ ... ], ... }, { "healthcheck": [ ... ], ... }, ... ] }
+// (or the CBOR or MessagePack equivalent, if that's the format the reports are in; OTLP
+// requests are merged into one request instead, see otlp.cpp)
+// once the batch has batch_max_reports reports in it, once the next report would take it
+// past batch_max_bytes, once its first report has waited batch_max_delay_ms, or when the
+// next report is in a different format, whichever comes first. With a short monitor
+// interval that turns many small POSTs into a few big ones, at the cost of reports
+// reaching the server up to batch_max_delay_ms late.
+// When the queue is full, what happens to a new report depends on the overflow policy
+// from the configuration:
+//   drop_oldest  the oldest queued report is thrown away to make room. This is the
+//                default; the server gets the most recent reports once it catches up.
+//   coalesce     the newest queued report is replaced by the new one. The oldest
+//                reports are kept, and the server still gets the latest state.
+//   block        the Monitor waits until there is room, which gives up a fixed sampling
+//                interval in exchange for never losing a report. Only the results
+//                server's sender, the first sink, blocks; for the other HTTP
+//                destinations block is treated as drop_oldest, as it is for the other
+//                kinds of sink, so a slow one can't hold up sampling or the sinks the
+//                Monitor hands the report to after it. The Monitor is also the thread
+//                that picks up configuration changes, so once it's blocked it waits for
+//                the sender to make room, whatever the configuration says by then; a new
+//                queue size or policy applies from the next report.
+// A report that fails to send is written to a spool on disk (see spool.cpp) rather than
+// lost. Whenever the queue is empty and the spool isn't, the sender sends the oldest
+// spooled reports as batches like the one above, up to SPOOL_REPLAY_BATCH_BYTES (or half
+// of max_payload_bytes) each, and no more often than once per replay_interval_ms. With
+// a big backlog it sends up to http_max_connections batches at once, through an
+// HttpMulti (see http_client.cpp), so draining the spool isn't one round trip after
+// another. New reports always go first, so a big backlog can't hold up live traffic. If
+// a batch fails we leave the spool alone for SPOOL_RETRY_INTERVAL seconds, unless a new
+// report gets through before then. Every POST, live or replayed, gives up after
+// http_timeout_ms.
+// A server that's overloaded can say so with 429 Too Many Requests or 503 Service
+// Unavailable. Then nothing is sent, live or from the spool, until the Retry-After it
+// asked for has passed (at most BACKOFF_MAX_MS), or, without one, for BACKOFF_MIN_MS
+// doubling with each such answer in a row up to BACKOFF_MAX_MS. A random jitter of up to
+// half as long again is added, so a fleet of monitors turned away together doesn't come
+// back together. Each such answer also doubles how big a batch may get, up to
+// BACKOFF_BATCH_SCALE_MAX times batch_max_reports and (within max_payload_bytes)
+// batch_max_bytes, so the reports that come in while we wait go in one bigger POST as
+// soon as the wait is over. Reports that come in once that batch is full go straight in
+// the spool, so the queue doesn't overflow and drop them however long the wait is; with
+// the spool turned off, the batch takes all of them instead, up to max_payload_bytes.
+// Every POST that gets through halves the batch scale again, back to the configured
+// batches, and the spooled reports are replayed behind it. Other failures are treated as
+// before.
+// Every POST, live or replayed, can be compressed (see compress.cpp) if it's at least
+// compression_min_bytes long; smaller ones aren't worth it. The compressed body is sent
+// with a Content-Encoding header. If the server answers 415 Unsupported Media Type, we
+// send the same body again uncompressed and stop compressing until the configuration
+// asks for a different type of compression.
+// The sender keeps counters of the queue depth, of the reports sent, failed, dropped,
+// coalesced, spooled and replayed, of the POSTs, of the 429 and 503 answers and the
+// current batch scale, of the spool size, and of the bytes in
+// and out of the compressor and the time it took. The Monitor adds the results server's
+// to every report as "sender" (and the other sinks' as "sinks"), and every send logs the
+// queue depth.
+// The only public methods besides configure(), enqueue() and stats() are the constructor
+// and the run() method, which starts a thread running the private send_loop() method.
+// This method runs forever.
+// What It Doesn't Do
+// Reports dropped by the overflow policy are not spooled; the spool is only for reports
+// the server didn't take. With the spool turned off, a report that fails to send is just
+// counted and logged.
+// Testing
+// Pointing the results URL at a server that accepts connections but never answers
+// fills the queue, which shows the overflow policies at work in the counters.
+
+#include "results_sender.h"
+#include <algorithm>
+#include <limits>
+#include "compress.h"
+#include "otlp.h"
+
+// The most we'll send from the spool in one POST.
+#define SPOOL_REPLAY_BATCH_BYTES    (1024 * 1024)
+// How long to leave the spool alone after a replayed batch fails, in seconds.
+#define SPOOL_RETRY_INTERVAL        10
+// How often the sender thread wakes up with nothing queued, to sync and replay the spool.
+#define SENDER_IDLE_WAKEUP_MS       1000
+// After a 429 or 503 without a Retry-After, the first wait before sending again, and the
+// longest wait, with or without one, in milliseconds.
+#define BACKOFF_MIN_MS              1000
+#define BACKOFF_MAX_MS              300000
+// The most times bigger than configured a batch may get while the server pushes back.
+#define BACKOFF_BATCH_SCALE_MAX     16
+// The longest batch wrapper, {"batch":[]} or its CBOR or MessagePack equivalent.
+#define BATCH_WRAPPER_LEN           12
+
+// An anonymous namespace for functions that don't need to be in the ResultsSender class itself.
+namespace {
+    // Whether the HTTP status says the server is overloaded, rather than that it failed.
+    bool is_pressure(long status)
+    {
+        return status == 429 || status == 503;
+    }
+
+    // The Content-Type for reports in the given format.
+    const char *content_type(results_format format)
+    {
+        switch (format) {
+            case results_format::cbor:
+                return "application/cbor";
+            case results_format::msgpack:
+                return "application/msgpack";
+            default:
+                return "application/json";
+        }
+    }
+
+    // Append a CBOR or MessagePack array header for count items. The first byte is the
+    // type, with the count in its low bits if it's small, or followed by the count in
+    // the next 1, 2 or 4 bytes (big-endian) if it isn't.
+    void append_array_header(std::string &body, results_format format, size_t count)
+    {
+        int len_bytes;
+        if (format == results_format::cbor) {
+            if (count < 24) {
+                body.push_back((char) (0x80 | count));
+                return;
+            }
+            len_bytes = count < 0x100 ? 1 : count < 0x10000 ? 2 : 4;
+            body.push_back((char) (len_bytes == 1 ? 0x98 : len_bytes == 2 ? 0x99 : 0x9a));
+        }
+        else {
+            if (count < 16) {
+                body.push_back((char) (0x90 | count));
+                return;
+            }
+            len_bytes = count < 0x10000 ? 2 : 4;
+            body.push_back((char) (len_bytes == 2 ? 0xdc : 0xdd));
+        }
+        for (int shift = (len_bytes - 1) * 8; shift >= 0; shift -= 8)
+            body.push_back((char) ((count >> shift) & 0xff));
+    }
+
+    // Wrap some serialized reports in a batch. They're already serialized, so this is
+    // just string concatenation with the right wrapper around it: text for JSON, or a
+    // one-entry map holding an array for CBOR and MessagePack.
+    std::string make_batch(results_format format, const std::vector<const std::string *> &records)
+    {
+        size_t len = BATCH_WRAPPER_LEN;
+        for (const std::string *record : records)
+            len += record->size() + 1;
+        std::string body;
+        body.reserve(len);
+        if (format == results_format::otlp) {
+            append_otlp_batch(body, records);
+            return body;
+        }
+        if (format == results_format::json) {
+            body.append("{\"batch\":[");
+            for (size_t i = 0; i < records.size(); i++) {
+                if (i > 0)
+                    body.push_back(',');
+                body.append(*records[i]);
+            }
+            body.append("]}");
+            return body;
+        }
+        // A map with one entry, then the five character string "batch".
+        if (format == results_format::cbor)
+            body.append("\xa1\x65" "batch");
+        else
+            body.append("\x81\xa5" "batch");
+        append_array_header(body, format, records.size());
+        for (const std::string *record : records)
+            body.append(*record);
+        return body;
+    }
+}
+
+// The constructor doesn't really do any work, just sets local variables. The spool
+// directory isn't opened until the thread is running.
+ResultsSender::ResultsSender(std::string url, std::string spool_dir, bool may_block)
+    : ResultsSink(std::move(url)), capacity(SENDER_QUEUE_SIZE_DEFAULT), overflow(sender_overflow::drop_oldest),
+      may_block(may_block),
+      spool_max_bytes(SPOOL_MAX_BYTES_DEFAULT), replay_interval(SPOOL_REPLAY_INTERVAL_MS_DEFAULT),
+      max_payload_bytes(MAX_PAYLOAD_BYTES_DEFAULT), batch_max_reports(BATCH_MAX_REPORTS_DEFAULT),
+      batch_max_bytes(BATCH_MAX_BYTES_DEFAULT), batch_max_delay(BATCH_MAX_DELAY_MS_DEFAULT),
+      compression(compression_type::none), compression_level(-1),
+      compression_min_bytes(COMPRESSION_MIN_BYTES_DEFAULT), http_max_connections(HTTP_MAX_CONNECTIONS_DEFAULT),
+      http_timeout_ms(HTTP_TIMEOUT_MS_DEFAULT), spool(std::move(spool_dir)), batch_bytes(0),
+      use_compression(compression_type::none), use_compression_level(-1),
+      use_compression_min_bytes(COMPRESSION_MIN_BYTES_DEFAULT), refused_compression(compression_type::none),
+      pressure_failures(0), batch_scale(1), batch_closed(false), jitter_rng(std::random_device()())
+{
+    // Get the shared logger pointer.
+    logger = spdlog::get("epmon");
+    counters.capacity = capacity;
+}
+
+ResultsSender::~ResultsSender() = default;
+
+void ResultsSender::configure(const Monitor_options &options)
+{
+    std::lock_guard<std::mutex> lck { queue_lock };
+    capacity = options.sender_queue_size;
+    counters.capacity = capacity;
+    overflow = options.sender_overflow_policy;
+    if (overflow == sender_overflow::block && !may_block)
+        overflow = sender_overflow::drop_oldest;
+    spool_max_bytes = options.spool_max_bytes;
+    replay_interval = std::chrono::milliseconds(options.spool_replay_interval_ms);
+    max_payload_bytes = options.max_payload_bytes;
+    batch_max_reports = options.batch_max_reports;
+    batch_max_bytes = std::min(options.batch_max_bytes, options.max_payload_bytes);
+    batch_max_delay = std::chrono::milliseconds(options.batch_max_delay_ms);
+    compression = options.compression;
+    compression_level = options.compression_level;
+    compression_min_bytes = options.compression_min_bytes;
+    http_max_connections = options.http_max_connections;
+    http_timeout_ms = options.http_timeout_ms;
+}
+
+void ResultsSender::enqueue(std::shared_ptr<const results_report> report)
+{
+    std::unique_lock<std::mutex> lck { queue_lock };
+
+    if (queue.size() >= capacity) {
+        if (overflow == sender_overflow::block) {
+            counters.blocked++;
+            not_full.wait(lck, [this] { return queue.size() < capacity; });
+        }
+        else if (overflow == sender_overflow::coalesce) {
+            queue.back() = std::move(report);
+            counters.coalesced++;
+            counters.enqueued++;
+            return;
+        }
+        while (queue.size() >= capacity) {
+            queue.pop_front();
+            counters.dropped++;
+        }
+    }
+    queue.push_back(std::move(report));
+    counters.enqueued++;
+    counters.depth = queue.size();
+    lck.unlock();
+    not_empty.notify_one();
+}
+
+sender_stats ResultsSender::stats()
+{
+    std::lock_guard<std::mutex> lck { queue_lock };
+    counters.depth = queue.size();
+    return counters;
+}
+
+// Compress the body into compressed if it's worth it, and return the Content-Encoding
+// to send it with, or null if it's to be sent as it is.
+const char *ResultsSender::compress_body(const std::string &body, std::string &compressed)
+{
+    if (use_compression == compression_type::none || use_compression == refused_compression ||
+        body.size() < use_compression_min_bytes)
+        return nullptr;
+
+    auto start = std::chrono::steady_clock::now();
+    bool ok = compress_payload(use_compression, use_compression_level, body.data(), body.size(), compressed);
+    auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+    if (!ok) {
+        logger->warn("ResultsSender::post: {0} compression failed, sending uncompressed",
+                     content_encoding(use_compression));
+        return nullptr;
+    }
+    std::lock_guard<std::mutex> lck { queue_lock };
+    counters.compressed++;
+    counters.compress_in_bytes += body.size();
+    counters.compress_out_bytes += compressed.size();
+    counters.compress_usec += elapsed.count();
+    return content_encoding(use_compression);
+}
+
+// POST a body to the results server, compressing it first if we're supposed to.
+bool ResultsSender::post(const std::string &body, results_format format)
+{
+    const char *type = content_type(format);
+    std::string compressed;
+    const char *encoding = compress_body(body, compressed);
+    if (encoding == nullptr)
+        return http.post(destination, body.data(), body.size(), type);
+    bool ret = http.post(destination, compressed.data(), compressed.size(), type, encoding);
+    if (!ret && http.last_status() == 415) {
+        logger->warn("ResultsSender::post: the results server doesn't accept {0}, sending uncompressed from now on",
+                     content_encoding(use_compression));
+        refused_compression = use_compression;
+        ret = http.post(destination, body.data(), body.size(), type);
+    }
+    return ret;
+}
+
+// The server is overloaded. Wait as long as it asked, or longer each time if it didn't
+// say, plus some jitter, and let the batches grow meanwhile. The spool waits too.
+void ResultsSender::back_off(long retry_after)
+{
+    pressure_failures++;
+    long delay_ms = BACKOFF_MAX_MS;
+    if (retry_after > 0)
+        delay_ms = std::min(retry_after * 1000, (long) BACKOFF_MAX_MS);
+    else if (pressure_failures <= 16)
+        delay_ms = std::min((long) BACKOFF_MIN_MS << (pressure_failures - 1), (long) BACKOFF_MAX_MS);
+    std::uniform_int_distribution<long> jitter(0, delay_ms / 2);
+    delay_ms += jitter(jitter_rng);
+    backoff_until = std::chrono::steady_clock::now() + std::chrono::milliseconds(delay_ms);
+    next_replay = backoff_until;
+    batch_scale = std::min(batch_scale * 2, (size_t) BACKOFF_BATCH_SCALE_MAX);
+    logger->warn("ResultsSender::back_off: the results server is overloaded, waiting {0} ms, batches up to {1} times "
+                 "bigger", delay_ms, batch_scale);
+    std::lock_guard<std::mutex> lck { queue_lock };
+    counters.throttled++;
+    counters.batch_scale = batch_scale;
+}
+
+// A POST got through, so the server has room again: shrink the batches back a step.
+void ResultsSender::recovered()
+{
+    pressure_failures = 0;
+    if (batch_scale == 1)
+        return;
+    batch_scale /= 2;
+    logger->info("ResultsSender::recovered: batches up to {0} times bigger than configured", batch_scale);
+    std::lock_guard<std::mutex> lck { queue_lock };
+    counters.batch_scale = batch_scale;
+}
+
+// POST the current batch, or the report on its own if there's only one. Any that fail
+// go in the spool. If they got through, the server is up and there's no need to wait
+// to replay the spool.
+void ResultsSender::send_batch(size_t depth)
+{
+    std::string batch_body;
+    const std::string *body = &batch.front()->body;
+    if (batch.size() > 1) {
+        std::vector<const std::string *> records;
+        for (const auto &report : batch)
+            records.push_back(&report->body);
+        batch_body = make_batch(batch.front()->format, records);
+        body = &batch_body;
+    }
+    bool ret = post(*body, batch.front()->format);
+    size_t spooled = 0;
+    if (!ret) {
+        for (const auto &report : batch) {
+            if (spool.append(report->body, report->format))
+                spooled++;
+        }
+    }
+    {
+        std::lock_guard<std::mutex> lck { queue_lock };
+        counters.posts++;
+        if (ret)
+            counters.sent += batch.size();
+        else
+            counters.failed += batch.size();
+        counters.spooled += spooled;
+        counters.spool_bytes = spool.size_bytes();
+        counters.spool_evicted_bytes = spool.evicted_bytes();
+    }
+    if (ret) {
+        logger->info("ResultsSender::send_loop: sent {0} reports in {1} bytes, {2} still queued",
+                     batch.size(), body->size(), depth);
+        next_replay = std::min(next_replay, std::chrono::steady_clock::now());
+        recovered();
+    }
+    else {
+        logger->warn("ResultsSender::send_loop: failed to send {0} reports in {1} bytes, {2} still queued, {3} spooled",
+                     batch.size(), body->size(), depth, spooled);
+        next_replay = std::chrono::steady_clock::now() + std::chrono::seconds(SPOOL_RETRY_INTERVAL);
+        if (is_pressure(http.last_status()))
+            back_off(http.last_retry_after());
+    }
+    batch.clear();
+    batch_bytes = 0;
+    batch_closed = false;
+}
+
+// Put the reports that came in while we were backing off, and didn't fit in the batch,
+// in the spool. They go to the server when the spool is replayed.
+void ResultsSender::spool_overflow()
+{
+    size_t spooled = 0;
+    for (const auto &report : overflow_reports) {
+        if (spool.append(report->body, report->format))
+            spooled++;
+    }
+    if (spooled < overflow_reports.size())
+        logger->warn("ResultsSender::spool_overflow: failed to spool {0} of {1} reports while backing off",
+                     overflow_reports.size() - spooled, overflow_reports.size());
+    {
+        std::lock_guard<std::mutex> lck { queue_lock };
+        counters.spooled += spooled;
+        counters.failed += overflow_reports.size() - spooled;
+        counters.spool_bytes = spool.size_bytes();
+        counters.spool_evicted_bytes = spool.evicted_bytes();
+    }
+    overflow_reports.clear();
+}
+
+// Send the oldest spooled reports, up to parallel batches of them at once, and take the
+// ones that got through out of the spool. The spool can only be consumed from the front,
+// so after a failed batch the ones behind it stay in the spool too, and are sent again
+// next time.
+void ResultsSender::replay_spool(size_t max_bytes, std::chrono::milliseconds interval, unsigned int parallel)
+{
+    struct replay_batch {
+        std::vector<std::string> records;
+        results_format format;
+        Spool::position end;
+        std::string body;
+        std::string compressed;
+    };
+    std::vector<replay_batch> batches(1);
+    if (spool.read_batch(max_bytes, batches[0].records, batches[0].format) == 0) {
+        // Nothing readable was left, only damaged records.
+        spool.commit_batch();
+        return;
+    }
+    batches[0].end = spool.batch_end();
+    while (batches.size() < parallel) {
+        replay_batch next;
+        if (spool.read_next_batch(max_bytes, next.records, next.format) == 0)
+            break;
+        next.end = spool.batch_end();
+        batches.push_back(std::move(next));
+    }
+    std::vector<http_post> posts(batches.size());
+    for (replay_batch &batch : batches) {
+        std::vector<const std::string *> record_ptrs;
+        for (const std::string &record : batch.records)
+            record_ptrs.push_back(&record);
+        batch.body = make_batch(batch.format, record_ptrs);
+    }
+    // A single batch goes on the results server's usual connection; more go all at once.
+    if (posts.size() == 1) {
+        posts[0].ok = post(batches[0].body, batches[0].format);
+        posts[0].status = http.last_status();
+        posts[0].retry_after = http.last_retry_after();
+    }
+    else {
+        for (size_t ii = 0; ii < batches.size(); ii++) {
+            replay_batch &batch = batches[ii];
+            posts[ii].content_type = content_type(batch.format);
+            posts[ii].encoding = compress_body(batch.body, batch.compressed);
+            const std::string &payload = posts[ii].encoding ? batch.compressed : batch.body;
+            posts[ii].data = payload.data();
+            posts[ii].len = payload.size();
+        }
+        replay_http.post_all(destination, posts);
+    }
+    size_t sent_batches = 0;
+    size_t sent_reports = 0;
+    while (sent_batches < posts.size() && posts[sent_batches].ok) {
+        sent_reports += batches[sent_batches].records.size();
+        sent_batches++;
+    }
+    long retry_after = -1;
+    for (const http_post &post : posts) {
+        if (is_pressure(post.status))
+            retry_after = std::max(retry_after, post.retry_after);
+        if (post.status == 415 && post.encoding != nullptr && refused_compression != use_compression) {
+            logger->warn("ResultsSender::replay_spool: the results server doesn't accept {0}, sending uncompressed "
+                         "from now on", post.encoding);
+            refused_compression = use_compression;
+        }
+    }
+    if (sent_batches > 0)
+        spool.commit_to(batches[sent_batches - 1].end);
+    if (sent_batches == posts.size()) {
+        next_replay = std::chrono::steady_clock::now() + interval;
+        logger->info("ResultsSender::replay_spool: sent {0} spooled reports in {1} batches, {2} bytes left in the spool",
+                     sent_reports, sent_batches, spool.size_bytes());
+    }
+    else {
+        next_replay = std::chrono::steady_clock::now() + std::chrono::seconds(SPOOL_RETRY_INTERVAL);
+        logger->warn("ResultsSender::replay_spool: sent {0} of {1} batches of spooled reports", sent_batches,
+                     posts.size());
+    }
+    if (retry_after >= 0)
+        back_off(retry_after);
+    else if (sent_batches > 0)
+        recovered();
+    std::lock_guard<std::mutex> lck { queue_lock };
+    counters.replayed += sent_reports;
+    counters.spool_bytes = spool.size_bytes();
+}
+
+// This is the thread function. It runs forever because I didn't want to spend the time
+// working out a clever "stop" mechanism. Each time through the loop we wait for reports,
+// take them off the queue into the batch, and POST the batch if it's full or due, and
+// the server hasn't asked us to back off. The queue is only locked while we take reports
+// off, never while we're sending. Once the queue is empty we replay the spool, when it's
+// time to.
+void ResultsSender::send_loop()
+{
+    logger->info("begin ResultsSender::send_loop");
+    spool.open();
+    next_replay = std::chrono::steady_clock::now();
+    while(true) {
+        size_t depth;
+        size_t replay_bytes;
+        std::chrono::milliseconds interval;
+        unsigned int parallel;
+        unsigned int timeout_ms;
+        bool full = false;
+        bool took = false;
+        {
+            std::unique_lock<std::mutex> lck { queue_lock };
+            auto wakeup = std::chrono::steady_clock::now() + std::chrono::milliseconds(SENDER_IDLE_WAKEUP_MS);
+            if (!batch.empty())
+                wakeup = std::min(wakeup, std::max(batch_deadline, backoff_until));
+            // While we're backing off, a report that won't fit in the closed batch still
+            // has to come off the queue, into the spool.
+            not_empty.wait_until(lck, wakeup, [this] {
+                return !queue.empty() &&
+                       (!batch_closed || (spool.enabled() && std::chrono::steady_clock::now() < backoff_until));
+            });
+            spool.set_max_bytes(spool_max_bytes);
+            // While the server is pushing back, batches may be bigger than configured. With
+            // nowhere to spool, the batch takes everything it can.
+            bool backing_off = std::chrono::steady_clock::now() < backoff_until;
+            bool absorb = backing_off && !spool.enabled();
+            size_t max_reports = absorb ? std::numeric_limits<size_t>::max() : batch_max_reports * batch_scale;
+            size_t max_bytes = absorb ? max_payload_bytes :
+                std::max(batch_max_bytes, std::min(batch_max_bytes * batch_scale, max_payload_bytes));
+            full = batch_closed;
+            while (!queue.empty() && !full) {
+                const std::shared_ptr<const results_report> &next = queue.front();
+                if (!batch.empty() && (batch_bytes + next->body.size() + 1 > max_bytes ||
+                                       next->format != batch.front()->format)) {
+                    full = true;
+                    break;
+                }
+                if (batch.empty()) {
+                    // A batch started while we're backing off goes as soon as we stop.
+                    auto now = std::chrono::steady_clock::now();
+                    batch_deadline = now + batch_max_delay;
+                    if (backoff_until > now)
+                        batch_deadline = std::min(batch_deadline, backoff_until);
+                    batch_bytes = BATCH_WRAPPER_LEN;
+                }
+                batch_bytes += next->body.size() + 1;
+                batch.push_back(next);
+                queue.pop_front();
+                took = true;
+                full = batch.size() >= max_reports;
+            }
+            batch_closed = full;
+            if (full && backing_off && spool.enabled() && !queue.empty()) {
+                overflow_reports.assign(queue.begin(), queue.end());
+                queue.clear();
+                took = true;
+            }
+            depth = queue.size();
+            counters.depth = depth;
+            // Half the payload limit leaves plenty of room for the batch wrapper.
+            replay_bytes = std::min((size_t) SPOOL_REPLAY_BATCH_BYTES, max_payload_bytes / 2);
+            interval = replay_interval;
+            use_compression = compression;
+            use_compression_level = compression_level;
+            use_compression_min_bytes = compression_min_bytes;
+            parallel = http_max_connections;
+            timeout_ms = http_timeout_ms;
+        }
+        http.set_timeout(timeout_ms);
+        replay_http.set_limits(parallel, timeout_ms);
+        if (took)
+            not_full.notify_all();
+        if (!overflow_reports.empty())
+            spool_overflow();
+        auto now = std::chrono::steady_clock::now();
+        if (!batch.empty() && now >= backoff_until && (full || now >= batch_deadline))
+            send_batch(depth);
+        // Only replay when nothing else was waiting to go.
+        if (depth == 0 && !spool.empty() && std::chrono::steady_clock::now() >= next_replay)
+            replay_spool(replay_bytes, interval, parallel);
+        spool.sync(false);
+    }
+}
@@ -0,0 +1,107 @@
+// results_sender.h
+// This file defines the ResultsSender class. See results_sender.cpp for more information.
+
+#ifndef EPMON_RESULTS_SENDER_H
+#define EPMON_RESULTS_SENDER_H
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <spdlog/spdlog.h>
+#include "monitor_options.h"
+#include "results_sink.h"
+#include "http_client.h"
+#include "spool.h"
+
+class ResultsSender : public ResultsSink {
+public:
+    // Send to the results server at url, spooling to spool_dir. Unless may_block is set,
+    // the block overflow policy is treated as drop_oldest.
+    ResultsSender(std::string url, std::string spool_dir, bool may_block);
+    ~ResultsSender() override;
+
+    std::thread run() override { return std::thread([this] { this->send_loop(); }); }
+
+    // Pick up the queue size, overflow policy, spool, batch, HTTP and compression settings.
+    // Shrinking the queue
+    // doesn't throw away reports that are already queued.
+    void configure(const Monitor_options &options) override;
+    // Queue a report for sending, applying the overflow policy if the queue is full.
+    void enqueue(std::shared_ptr<const results_report> report) override;
+    sender_stats stats() override;
+
+private:
+    // The queue and what to do when it's full, protected by queue_lock. not_empty
+    // wakes the sender thread, not_full wakes a sampling thread blocked in enqueue().
+    std::deque<std::shared_ptr<const results_report>> queue;
+    size_t capacity;
+    sender_overflow overflow;
+    bool may_block;
+    // The spool and batch settings, also protected by queue_lock.
+    size_t spool_max_bytes;
+    std::chrono::milliseconds replay_interval;
+    size_t max_payload_bytes;
+    size_t batch_max_reports;
+    size_t batch_max_bytes;
+    std::chrono::milliseconds batch_max_delay;
+    compression_type compression;
+    int compression_level;
+    size_t compression_min_bytes;
+    unsigned int http_max_connections;
+    unsigned int http_timeout_ms;
+    sender_stats counters;
+    std::mutex queue_lock;
+    std::condition_variable not_empty;
+    std::condition_variable not_full;
+    // The logger.
+    std::shared_ptr<spdlog::logger> logger;
+    // The connection to the results server, and the connections used to replay the
+    // spool several batches at a time. Only used by the sender thread.
+    HttpClient http;
+    HttpMulti replay_http;
+    // Reports that failed to send, kept on disk. Only used by the sender thread.
+    Spool spool;
+    // The earliest we'll send the next batch from the spool.
+    std::chrono::steady_clock::time_point next_replay;
+    // The reports taken off the queue to be sent together, their size as a batch, and
+    // when the batch has to go. Only used by the sender thread.
+    std::vector<std::shared_ptr<const results_report>> batch;
+    size_t batch_bytes;
+    std::chrono::steady_clock::time_point batch_deadline;
+    // Reports taken off the queue while backing off that didn't fit in the batch, on
+    // their way to the spool. Only used by the sender thread.
+    std::vector<std::shared_ptr<const results_report>> overflow_reports;
+    // The compression settings for this pass, copied from the ones above, and the type
+    // of compression the server refused, if it has.
+    compression_type use_compression;
+    int use_compression_level;
+    size_t use_compression_min_bytes;
+    compression_type refused_compression;
+    // When the server says it's overloaded (429 or 503), nothing is sent until
+    // backoff_until. pressure_failures counts those answers in a row, for the backoff
+    // without a Retry-After, and batch_scale is how many times bigger than configured
+    // batches may be until the server has recovered. batch_closed is set when the batch
+    // can't take the next report, so the thread doesn't spin while it waits to send it.
+    std::chrono::steady_clock::time_point backoff_until;
+    unsigned int pressure_failures;
+    size_t batch_scale;
+    bool batch_closed;
+    std::mt19937 jitter_rng;
+
+    const char *compress_body(const std::string &body, std::string &compressed);
+    bool post(const std::string &body, results_format format);
+    void back_off(long retry_after);
+    void recovered();
+    void send_batch(size_t depth);
+    void spool_overflow();
+    void replay_spool(size_t max_bytes, std::chrono::milliseconds interval, unsigned int parallel);
+    void send_loop();
+};
+
+#endif //EPMON_RESULTS_SENDER_H
@@ -0,0 +1,86 @@
+// results_sink.cpp
+// This file implements make_results_sink(), which picks the kind of sink for each
+// destination the reports are to be sent to. The Monitor serializes each report once and
+// hands the same copy to every sink (see monitor.cpp). Each sink has its own queue, its
+// own thread and its own retry state, so one that's slow or down never holds up the
+// others:
+//   http:// or https://  a ResultsSender (see results_sender.cpp), which POSTs the
+//                        reports, with batching, compression and a disk spool. So is
+//                        anything not listed below; it's up to curl what to make of it.
+//   file:PATH            a StreamSink (see stream_sink.cpp) appending the reports to a
+//                        file, one per line (NDJSON, when the format is JSON)
+//   udp://HOST:PORT      a StreamSink sending each report as a datagram
+//   unix:PATH            a StreamSink writing the reports to a Unix domain stream socket,
+//                        one per line, for a local sidecar
+//   stream+http://...    an HttpStreamSink (see http_stream_sink.cpp) writing the reports
+//   stream+https://...   into one long-lived chunked POST, rather than a POST each
+//   statsd://HOST:PORT   a LineSink (see line_sink.cpp) sending each app's numbers over
+//   influx://HOST:PORT   UDP in StatsD or InfluxDB line protocol, rather than the report
+// A LineSink formats the results itself, so the Monitor hands it the round's results
+// instead of the report (see ResultsSink::wants_rounds()).
+// http_destination_url() gives the URL of a destination that is an HTTP server, which the
+// EventWatcher (see event_watcher.cpp) POSTs its events to, since they don't go through
+// the sinks.
+// What It Doesn't Do
+// The destinations are fixed at startup; the configuration server can't add or remove
+// them.
+
+#include "results_sink.h"
+#include "results_sender.h"
+#include "stream_sink.h"
+#include "line_sink.h"
+#include "http_stream_sink.h"
+
+// Where an HTTP sink keeps reports that couldn't be sent, relative to the working
+// directory like the log file. The first HTTP sink, the results server, uses this; any
+// others get a numbered directory next to it.
+#define SPOOL_DIRECTORY     "spool"
+
+namespace {
+    // Whether the destination is one that doesn't go to an HTTP server at all.
+    bool is_local_or_udp(const std::string &destination)
+    {
+        return destination.compare(0, 5, "file:") == 0 || destination.compare(0, 4, "udp:") == 0 ||
+               destination.compare(0, 5, "unix:") == 0 || destination.compare(0, 7, "statsd:") == 0 ||
+               destination.compare(0, 7, "influx:") == 0;
+    }
+}
+
+std::unique_ptr<ResultsSink> make_results_sink(const std::string &destination, size_t index)
+{
+    if (destination.compare(0, 5, "file:") == 0 || destination.compare(0, 4, "udp:") == 0 ||
+        destination.compare(0, 5, "unix:") == 0) {
+        std::unique_ptr<StreamSink> sink(new StreamSink(destination));
+        if (!sink->valid())
+            return nullptr;
+        return std::unique_ptr<ResultsSink>(sink.release());
+    }
+    if (destination.compare(0, 7, "stream+") == 0) {
+        std::unique_ptr<HttpStreamSink> sink(new HttpStreamSink(destination));
+        if (!sink->valid())
+            return nullptr;
+        return std::unique_ptr<ResultsSink>(sink.release());
+    }
+    if (destination.compare(0, 7, "statsd:") == 0 || destination.compare(0, 7, "influx:") == 0) {
+        std::unique_ptr<LineSink> sink(new LineSink(destination));
+        if (!sink->valid())
+            return nullptr;
+        return std::unique_ptr<ResultsSink>(sink.release());
+    }
+    // Anything else is a URL for curl.
+    std::string spool_dir(SPOOL_DIRECTORY);
+    if (index > 0)
+        spool_dir += "-" + std::to_string(index);
+    // Only the first sink, the results server's, may make the Monitor wait for room.
+    return std::unique_ptr<ResultsSink>(new ResultsSender(destination, spool_dir, index == 0));
+}
+
+std::string http_destination_url(const std::string &destination)
+{
+    if (is_local_or_udp(destination))
+        return std::string();
+    // A streaming destination is still an HTTP server, which takes ordinary POSTs too.
+    if (destination.compare(0, 7, "stream+") == 0)
+        return destination.substr(7);
+    return destination;
+}
@@ -0,0 +1,99 @@
+// results_sink.h
+// This file defines the ResultsSink interface, which every destination for the reports
+// implements, and the reports and counters they share. See results_sink.cpp for more
+// information.
+
+#ifndef EPMON_RESULTS_SINK_H
+#define EPMON_RESULTS_SINK_H
+
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include "monitor_options.h"
+#include "results.h"
+
+// A finished report, serialized and ready to send.
+struct results_report {
+    std::string body;
+    results_format format = results_format::json;
+};
+
+// A round of results, for the sinks that format them themselves.
+struct results_round {
+    std::vector<app_result> results;
+    std::chrono::system_clock::time_point when;
+};
+
+// A sink's counters, as reported with each report. Not every sink uses all of them.
+struct sender_stats {
+    // The number of reports waiting to be sent, and the most there can be.
+    size_t depth = 0;
+    size_t capacity = 0;
+    // Reports queued, sent and failed since startup, and the POSTs that sent them.
+    unsigned long long enqueued = 0;
+    unsigned long long sent = 0;
+    unsigned long long failed = 0;
+    unsigned long long posts = 0;
+    // Reports thrown away because the queue was full: dropped from the front of the
+    // queue, or replaced by a newer report at the back.
+    unsigned long long dropped = 0;
+    unsigned long long coalesced = 0;
+    // Times the sampling thread had to wait for room in the queue.
+    unsigned long long blocked = 0;
+    // Responses telling us to slow down (429 or 503), and how many times bigger than
+    // configured batches are allowed to be because of them, right now.
+    unsigned long long throttled = 0;
+    size_t batch_scale = 1;
+    // Reports written to the disk spool after failing to send, and sent from it later.
+    unsigned long long spooled = 0;
+    unsigned long long replayed = 0;
+    // The size of the spool, and the bytes of unsent reports it has had to throw away.
+    size_t spool_bytes = 0;
+    unsigned long long spool_evicted_bytes = 0;
+    // POSTs that were compressed, their sizes before and after, and the time spent
+    // compressing them.
+    unsigned long long compressed = 0;
+    unsigned long long compress_in_bytes = 0;
+    unsigned long long compress_out_bytes = 0;
+    unsigned long long compress_usec = 0;
+};
+
+class ResultsSink {
+public:
+    explicit ResultsSink(std::string dest) : destination(std::move(dest)) {}
+    virtual ~ResultsSink() = default;
+
+    // Start the thread that sends the queued reports. It runs forever.
+    virtual std::thread run() = 0;
+    // Pick up the settings that apply to this sink.
+    virtual void configure(const Monitor_options &options) = 0;
+    // Queue a report for sending. The same report is shared by all the sinks, so it
+    // mustn't be changed.
+    virtual void enqueue(std::shared_ptr<const results_report> report) = 0;
+    virtual sender_stats stats() = 0;
+    // A sink that formats the results itself, instead of sending the report, says so
+    // here, and then gets each round through enqueue_round() instead of enqueue(). The
+    // round is shared by all such sinks too.
+    virtual bool wants_rounds() const { return false; }
+    virtual void enqueue_round(std::shared_ptr<const results_round> /*round*/) {}
+
+    // Where this sink sends the reports, as given on the command line.
+    const std::string &name() const { return destination; }
+
+protected:
+    std::string destination;
+};
+
+// Make the sink for a destination: file:PATH, udp://HOST:PORT, unix:PATH,
+// stream+URL, statsd://HOST:PORT, influx://HOST:PORT or otherwise an http:// or https://
+// URL. Each HTTP sink has its own spool directory; index tells them apart, and only the
+// first (index 0) may block the Monitor when its queue is full. Returns nullptr if a
+// file, UDP or Unix socket destination can't be parsed.
+std::unique_ptr<ResultsSink> make_results_sink(const std::string &destination, size_t index);
+// The http:// or https:// URL a destination POSTs to, for the things that are sent on
+// their own rather than through a sink, or an empty string if it isn't an HTTP one.
+std::string http_destination_url(const std::string &destination);
+
+#endif //EPMON_RESULTS_SINK_H
@@ -0,0 +1,43 @@
+// sample_results.h
+// This file defines make_sample_results(), which makes up a round of results for the test
+// and benchmark programs, so they don't need any real processes or cgroups. Every fourth
+// result is a cgroup with pressure averages, and some of the names have characters in them
+// that JSON has to escape.
+
+#ifndef EPMON_SAMPLE_RESULTS_H
+#define EPMON_SAMPLE_RESULTS_H
+
+#include <string>
+#include <vector>
+#include "results.h"
+
+inline std::vector<app_result> make_sample_results(size_t count)
+{
+    std::vector<app_result> results(count);
+    for (size_t ii = 0; ii < count; ii++) {
+        app_result &result = results[ii];
+        result.app = "app-" + std::to_string(ii);
+        if (ii % 7 == 0)
+            result.app += " \"quoted\" \\ tab\t caf\xc3\xa9";
+        result.cpu = (double) (ii % 1000) / 7.0;
+        result.memory = 13852672.0 + (double) ii * 4096.0;
+        result.cpu_seconds = (double) ii * 0.25;
+        if (ii % 4 == 3) {
+            result.is_cgroup = true;
+            result.cgroup = "/sys/fs/cgroup/system.slice/app-" + std::to_string(ii) + ".service";
+            result.memory_anon = result.memory * 0.75;
+            result.memory_file = result.memory * 0.25;
+            result.io_read = (double) ii * 512.5;
+            result.io_write = 1e-7 * (double) ii;
+            if (ii % 8 == 3) {
+                json some = {{"avg10", 1.5}, {"avg60", 0.25}, {"avg300", 0.0}, {"total", 123456789ULL + ii}};
+                result.pressure = {{"cpu", {{"some", some}}}, {"memory", {{"some", some}, {"full", some}}}};
+            }
+        }
+        else
+            result.pid = 1000 + (int) ii;
+    }
+    return results;
+}
+
+#endif //EPMON_SAMPLE_RESULTS_H
@@ -0,0 +1,126 @@
+// shm_publisher.cpp
+// This file implements the ShmPublisher class, which puts the latest round of results in
+// a shared-memory segment for programs on the same host that need them quickly, like a
+// load balancer's health checks or an autoscaler. They read it with the header-only
+// EpmonShmReader in epmon_shm.h, which also describes the layout and the seqlock that
+// protects it.
+// The configuration turns it on with "shm_name": "/epmon" (any name shm_open() takes),
+// and then after each round the Monitor publishes every result into the segment: the
+// app name, PID, CPU and memory, plus the round's timestamp and a count of rounds. The
+// segment is a fixed size, EPMON_SHM_MAX_ENTRIES entries, so readers can map it once and
+// keep reading it; a round with more results than that only publishes the first ones.
+// Writing is a few stores to memory, with no syscalls once the segment is mapped, and
+// never waits for a reader.
+// If the name changes, or the setting is removed, the old segment is unlinked, so new
+// readers can't find it. Readers that already have it mapped keep seeing its last round,
+// which they can tell from the timestamp.
+// What It Doesn't Do
+// The segment isn't unlinked when epmon exits, so it's there, unchanging, after a crash
+// or a Ctrl-C, until epmon is started again. Only CPU and memory are published, not the
+// cgroup memory breakdown, I/O or pressure.
+// Testing
+// A reader in a loop while the Monitor publishes should never see a torn round: every
+// entry should have the round's timestamp.
+
+#include "shm_publisher.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+ShmPublisher::ShmPublisher()
+    : segment(nullptr)
+{
+    // Get the shared logger pointer.
+    logger = spdlog::get("epmon");
+}
+
+ShmPublisher::~ShmPublisher()
+{
+    close_segment();
+}
+
+void ShmPublisher::set_name(const std::string &name)
+{
+    if (name == shm_name)
+        return;
+    if (segment) {
+        close_segment();
+        shm_unlink(shm_name.c_str());
+        logger->info("ShmPublisher: removed {0}", shm_name);
+    }
+    // Remember the name even if it doesn't work, so we don't try again until it changes.
+    shm_name = name;
+    if (name.empty())
+        return;
+
+    int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        logger->error("ShmPublisher: can't open {0}: {1}", name, strerror(errno));
+        return;
+    }
+    void *addr = MAP_FAILED;
+    if (ftruncate(fd, sizeof(epmon_shm_segment)) == 0)
+        addr = mmap(nullptr, sizeof(epmon_shm_segment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED)
+        logger->error("ShmPublisher: can't map {0}: {1}", name, strerror(errno));
+    close(fd);
+    if (addr == MAP_FAILED)
+        return;
+    segment = static_cast<epmon_shm_segment *>(addr);
+    epmon_shm_header &header = segment->header;
+    // A segment left by an earlier run keeps its sequence number, so a reader that still
+    // has it mapped sees the next round as a change. If that run died in the middle of a
+    // write, the number is odd; make it even again.
+    uint64_t seq = header.seq.load(std::memory_order_relaxed);
+    if (header.magic != EPMON_SHM_MAGIC || header.version != EPMON_SHM_VERSION ||
+        header.entry_size != sizeof(epmon_shm_entry))
+        seq = 0;
+    header.seq.store(seq | 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    header.magic = EPMON_SHM_MAGIC;
+    header.version = EPMON_SHM_VERSION;
+    header.entry_size = sizeof(epmon_shm_entry);
+    header.max_entries = EPMON_SHM_MAX_ENTRIES;
+    header.seq.store((seq | 1) + 1, std::memory_order_release);
+    logger->info("ShmPublisher: publishing to {0}", name);
+}
+
+// Write the round between the two halves of the seqlock. The entries are filled in
+// place, with nothing that can fail or block in between.
+void ShmPublisher::publish(const std::vector<app_result> &results, std::chrono::system_clock::time_point when)
+{
+    if (!segment)
+        return;
+    epmon_shm_header &header = segment->header;
+    uint64_t seq = header.seq.load(std::memory_order_relaxed);
+    uint32_t count = (uint32_t) std::min(results.size(), (size_t) EPMON_SHM_MAX_ENTRIES);
+
+    header.seq.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    for (uint32_t ii = 0; ii < count; ii++) {
+        const app_result &result = results[ii];
+        epmon_shm_entry &entry = segment->entries[ii];
+        size_t len = std::min(result.app.size(), (size_t) EPMON_SHM_APP_LEN - 1);
+        memcpy(entry.app, result.app.data(), len);
+        memset(entry.app + len, 0, EPMON_SHM_APP_LEN - len);
+        entry.pid = result.pid;
+        entry.flags = result.is_cgroup ? EPMON_SHM_CGROUP : 0;
+        entry.cpu = result.cpu;
+        entry.memory = result.memory;
+    }
+    header.count = count;
+    header.timestamp_ns = (uint64_t) std::chrono::duration_cast<std::chrono::nanoseconds>(
+            when.time_since_epoch()).count();
+    header.rounds++;
+    header.seq.store(seq + 2, std::memory_order_release);
+}
+
+void ShmPublisher::close_segment()
+{
+    if (segment)
+        munmap(segment, sizeof(epmon_shm_segment));
+    segment = nullptr;
+}
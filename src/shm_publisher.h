@@ -0,0 +1,37 @@
+// shm_publisher.h
+// This file defines the ShmPublisher class. See shm_publisher.cpp for more information.
+
+#ifndef EPMON_SHM_PUBLISHER_H
+#define EPMON_SHM_PUBLISHER_H
+
+#include <chrono>
+#include <string>
+#include <vector>
+#include <spdlog/spdlog.h>
+#include "epmon_shm.h"
+#include "results.h"
+
+class ShmPublisher {
+public:
+    ShmPublisher();
+    ~ShmPublisher();
+    ShmPublisher(const ShmPublisher &) = delete;
+    ShmPublisher &operator=(const ShmPublisher &) = delete;
+
+    // Publish to the named segment, creating it if need be, or stop publishing if name is
+    // empty. Does nothing if name is the segment already in use.
+    void set_name(const std::string &name);
+    bool is_open() const { return segment != nullptr; }
+    // Replace the snapshot with a round of results.
+    void publish(const std::vector<app_result> &results, std::chrono::system_clock::time_point when);
+
+private:
+    std::string shm_name;
+    epmon_shm_segment *segment;
+    // The logger.
+    std::shared_ptr<spdlog::logger> logger;
+
+    void close_segment();
+};
+
+#endif //EPMON_SHM_PUBLISHER_H
@@ -0,0 +1,355 @@
+// spool.cpp
+// This file implements the Spool class, which keeps reports that couldn't be sent on
+// disk until the results server is back (see results_sender.cpp for how it's used).
+// The spool is a directory of append-only segment files, segment-<n>.log, each holding a
+// run of records. A record is a 12 byte header, the body length, an FNV-1a checksum of
+// the body and the body's format (JSON, CBOR or MessagePack), followed by the body
+// itself. Appends go to the newest segment with a
+// single writev(), and are fsynced in batches: after SPOOL_SYNC_RECORDS appends, or
+// SPOOL_SYNC_INTERVAL seconds after the first unsynced one, whichever comes first. So a
+// crash loses at most a second or so of spooled reports, and a server outage doesn't
+// cost an fsync per report.
+// Replay reads the oldest records first. read_batch() collects records of the same format
+// up to a size limit without consuming them, and commit_batch() moves the cursor past them once they have
+// been sent, deleting segments that have been completely replayed. read_next_batch()
+// carries on from the end of the last batch, so several can be sent at once, and
+// commit_to() consumes those that were sent, up to the first that wasn't. The cursor is saved
+// in the "cursor" file, so a restart carries on where replay left off.
+// The spool has a size limit. A new segment is started whenever the current one reaches
+// a quarter of the limit (or SPOOL_SEGMENT_BYTES, if that's smaller), and when the total
+// goes over the limit the oldest segments are deleted, replayed or not. That keeps the
+// newest reports, and a long outage can't fill the disk.
+// What It Doesn't Do
+// Delivery is at-least-once: a crash between sending a batch and saving the cursor means
+// the batch is sent again after the restart. Eviction is by whole segment, so it can
+// throw away up to a quarter of the spool at a time.
+// A record that fails its checksum (the tail of a segment being written when the machine
+// went down, say) ends that segment; anything after it in the same segment is skipped.
+// Testing
+// Stop the results server for a few cycles and start it again: the log shows the reports
+// being spooled and then replayed, and the spool directory empties.
+
+#include "spool.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+// The largest segment file we'll write.
+#define SPOOL_SEGMENT_BYTES     (4 * 1024 * 1024)
+// fsync after this many appends, or this many seconds after the first unsynced one.
+#define SPOOL_SYNC_RECORDS      32
+#define SPOOL_SYNC_INTERVAL     1
+#define SPOOL_HEADER_LEN        12
+
+// An anonymous namespace for functions that don't need to be in the Spool class itself.
+namespace {
+    uint32_t fnv1a(const char *data, size_t len)
+    {
+        uint32_t hash = 2166136261u;
+        for (size_t i = 0; i < len; i++) {
+            hash ^= (unsigned char) data[i];
+            hash *= 16777619u;
+        }
+        return hash;
+    }
+
+    // Read exactly len bytes at offset, or fail.
+    bool read_at(int fd, char *buf, size_t len, off_t offset)
+    {
+        while (len > 0) {
+            ssize_t nread = pread(fd, buf, len, offset);
+            if (nread <= 0)
+                return false;
+            buf += nread;
+            len -= nread;
+            offset += nread;
+        }
+        return true;
+    }
+
+    // Make a rename or a new file in the directory survive a crash.
+    void sync_dir(const std::string &dir)
+    {
+        int fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd >= 0) {
+            fsync(fd);
+            close(fd);
+        }
+    }
+}
+
+Spool::Spool(std::string dir)
+    : spool_dir(std::move(dir)), usable(false), max_bytes(0), total_bytes(0), evicted(0), append_fd(-1),
+      next_seq(1), unsynced(0), cursor_offset(0), batch_seq(0), batch_offset(0)
+{
+    // Get the shared logger pointer.
+    logger = spdlog::get("epmon");
+}
+
+Spool::~Spool()
+{
+    if (append_fd >= 0) {
+        fsync(append_fd);
+        close(append_fd);
+    }
+}
+
+std::string Spool::segment_path(unsigned long long seq) const
+{
+    return spool_dir + "/segment-" + std::to_string(seq) + ".log";
+}
+
+// Create the spool directory if it isn't there, and pick up the segments and the replay
+// cursor from the last run. New appends always go to a new segment, in case the last
+// one ends with a record that was only half written.
+bool Spool::open()
+{
+    if (mkdir(spool_dir.c_str(), 0755) != 0 && errno != EEXIST) {
+        logger->error("Spool::open: can't create {0}: {1}", spool_dir, strerror(errno));
+        return false;
+    }
+    DIR *dir = opendir(spool_dir.c_str());
+    if (dir == nullptr) {
+        logger->error("Spool::open: can't read {0}: {1}", spool_dir, strerror(errno));
+        return false;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != nullptr) {
+        unsigned long long seq;
+        char tail[8];
+        if (sscanf(entry->d_name, "segment-%llu.%7s", &seq, tail) != 2 || strcmp(tail, "log") != 0)
+            continue;
+        struct stat st;
+        if (stat(segment_path(seq).c_str(), &st) != 0)
+            continue;
+        segments.push_back({seq, (size_t) st.st_size});
+        total_bytes += st.st_size;
+    }
+    closedir(dir);
+    std::sort(segments.begin(), segments.end(),
+              [](const segment &a, const segment &b) { return a.seq < b.seq; });
+
+    // Segments before the cursor's were replayed, we just didn't get to delete them.
+    unsigned long long seq = 0;
+    size_t offset = 0;
+    FILE *cursor_file = fopen((spool_dir + "/cursor").c_str(), "r");
+    if (cursor_file != nullptr) {
+        if (fscanf(cursor_file, "%llu %zu", &seq, &offset) != 2)
+            seq = offset = 0;
+        fclose(cursor_file);
+    }
+    while (!segments.empty() && segments.front().seq < seq) {
+        unlink(segment_path(segments.front().seq).c_str());
+        total_bytes -= segments.front().size;
+        segments.pop_front();
+    }
+    if (!segments.empty() && segments.front().seq == seq)
+        cursor_offset = std::min(offset, segments.front().size);
+    next_seq = std::max(seq, segments.empty() ? 0 : segments.back().seq) + 1;
+    usable = true;
+    if (!segments.empty())
+        logger->info("Spool::open: found {0} bytes in {1} segments to replay", total_bytes, segments.size());
+    return true;
+}
+
+void Spool::set_max_bytes(size_t max)
+{
+    max_bytes = max;
+}
+
+// Close the current segment, if any, and open a new one after it.
+bool Spool::start_segment()
+{
+    unsigned long long seq = next_seq++;
+    if (append_fd >= 0) {
+        fsync(append_fd);
+        close(append_fd);
+        unsynced = 0;
+    }
+    append_fd = ::open(segment_path(seq).c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (append_fd < 0) {
+        logger->error("Spool: can't create {0}: {1}", segment_path(seq), strerror(errno));
+        return false;
+    }
+    sync_dir(spool_dir);
+    segments.push_back({seq, 0});
+    return true;
+}
+
+// Delete the oldest segment, whether it has been replayed or not.
+void Spool::evict_oldest()
+{
+    const segment &oldest = segments.front();
+    logger->warn("Spool: over the {0} byte limit, dropping {1} bytes of unsent reports",
+                 max_bytes, oldest.size - cursor_offset);
+    evicted += oldest.size - cursor_offset;
+    unlink(segment_path(oldest.seq).c_str());
+    total_bytes -= oldest.size;
+    segments.pop_front();
+    cursor_offset = 0;
+    save_cursor();
+}
+
+bool Spool::append(const std::string &body, results_format format)
+{
+    if (!enabled())
+        return false;
+    size_t record_len = SPOOL_HEADER_LEN + body.size();
+    size_t segment_limit = std::max((size_t) 1, std::min((size_t) SPOOL_SEGMENT_BYTES, max_bytes / 4));
+    if (record_len > max_bytes) {
+        logger->warn("Spool::append: {0} byte report is bigger than the whole spool, not spooled", body.size());
+        return false;
+    }
+    if (append_fd < 0 || segments.back().size + record_len > segment_limit) {
+        if (!start_segment())
+            return false;
+    }
+    uint32_t header[3] = { (uint32_t) body.size(), fnv1a(body.data(), body.size()), (uint32_t) format };
+    struct iovec iov[2];
+    iov[0].iov_base = header;
+    iov[0].iov_len = sizeof(header);
+    iov[1].iov_base = (void *) body.data();
+    iov[1].iov_len = body.size();
+    ssize_t nwritten = writev(append_fd, iov, 2);
+    if (nwritten != (ssize_t) record_len) {
+        logger->error("Spool::append: write failed: {0}", nwritten < 0 ? strerror(errno) : "short write");
+        // Whatever did get written would corrupt the next record, so start afresh.
+        if (nwritten > 0) {
+            segments.back().size += nwritten;
+            total_bytes += nwritten;
+        }
+        close(append_fd);
+        append_fd = -1;
+        return false;
+    }
+    segments.back().size += record_len;
+    total_bytes += record_len;
+    if (unsynced++ == 0)
+        last_sync = std::chrono::steady_clock::now();
+    while (total_bytes > max_bytes && segments.size() > 1)
+        evict_oldest();
+    sync(false);
+    return true;
+}
+
+void Spool::sync(bool force)
+{
+    if (append_fd < 0 || unsynced == 0)
+        return;
+    if (force || unsynced >= SPOOL_SYNC_RECORDS ||
+        std::chrono::steady_clock::now() - last_sync >= std::chrono::seconds(SPOOL_SYNC_INTERVAL)) {
+        fdatasync(append_fd);
+        unsynced = 0;
+    }
+}
+
+size_t Spool::read_batch(size_t max_len, std::vector<std::string> &records, results_format &format)
+{
+    return read_from({ segments.empty() ? 0 : segments.front().seq, cursor_offset }, max_len, records, format);
+}
+
+size_t Spool::read_next_batch(size_t max_len, std::vector<std::string> &records, results_format &format)
+{
+    return read_from(batch_end(), max_len, records, format);
+}
+
+size_t Spool::read_from(position start, size_t max_len, std::vector<std::string> &records, results_format &format)
+{
+    size_t batch_len = 0;
+
+    records.clear();
+    format = results_format::json;
+    batch_seq = start.seq;
+    batch_offset = start.offset;
+    for (const segment &seg : segments) {
+        if (seg.seq < start.seq)
+            continue;
+        if (seg.seq != batch_seq) {
+            batch_seq = seg.seq;
+            batch_offset = 0;
+        }
+        if (batch_offset >= seg.size)
+            continue;
+        int fd = ::open(segment_path(seg.seq).c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            logger->error("Spool::read_batch: can't open {0}: {1}", segment_path(seg.seq), strerror(errno));
+            batch_offset = seg.size;
+            continue;
+        }
+        while (batch_offset < seg.size) {
+            uint32_t header[3];
+            if (batch_offset + SPOOL_HEADER_LEN > seg.size ||
+                !read_at(fd, (char *) header, SPOOL_HEADER_LEN, batch_offset) ||
+                batch_offset + SPOOL_HEADER_LEN + header[0] > seg.size ||
+                header[2] > (uint32_t) results_format::otlp) {
+                logger->warn("Spool::read_batch: skipping a damaged record in {0}", segment_path(seg.seq));
+                batch_offset = seg.size;
+                break;
+            }
+            // A batch is all one format.
+            if (!records.empty() && (batch_len + header[0] > max_len || header[2] != (uint32_t) format)) {
+                close(fd);
+                return records.size();
+            }
+            std::string body(header[0], '\0');
+            if (!read_at(fd, &body[0], header[0], batch_offset + SPOOL_HEADER_LEN) ||
+                fnv1a(body.data(), body.size()) != header[1]) {
+                logger->warn("Spool::read_batch: skipping a damaged record in {0}", segment_path(seg.seq));
+                batch_offset = seg.size;
+                break;
+            }
+            batch_offset += SPOOL_HEADER_LEN + header[0];
+            batch_len += body.size();
+            format = (results_format) header[2];
+            records.push_back(std::move(body));
+        }
+        close(fd);
+    }
+    return records.size();
+}
+
+// Move the cursor to end, and delete the segments it finished.
+void Spool::commit_to(position end)
+{
+    while (!segments.empty() && segments.front().seq < end.seq) {
+        unlink(segment_path(segments.front().seq).c_str());
+        total_bytes -= segments.front().size;
+        segments.pop_front();
+    }
+    cursor_offset = end.offset;
+    // The oldest segment can go too if it's finished. If it's the one we append to, the
+    // next append starts a new one.
+    if (!segments.empty() && cursor_offset >= segments.front().size) {
+        if (segments.size() == 1 && append_fd >= 0) {
+            close(append_fd);
+            append_fd = -1;
+            unsynced = 0;
+        }
+        unlink(segment_path(segments.front().seq).c_str());
+        total_bytes -= segments.front().size;
+        segments.pop_front();
+        cursor_offset = 0;
+    }
+    save_cursor();
+}
+
+// Save the cursor by writing a new file and renaming it over the old one, so it is
+// never half written.
+void Spool::save_cursor()
+{
+    std::string path = spool_dir + "/cursor";
+    std::string tmp_path = path + ".tmp";
+    FILE *cursor_file = fopen(tmp_path.c_str(), "w");
+    if (cursor_file == nullptr)
+        return;
+    fprintf(cursor_file, "%llu %zu\n", segments.empty() ? next_seq : segments.front().seq, cursor_offset);
+    fclose(cursor_file);
+    rename(tmp_path.c_str(), path.c_str());
+}
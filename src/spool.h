@@ -0,0 +1,93 @@
+// spool.h
+// This file defines the Spool class. See spool.cpp for more information.
+
+#ifndef EPMON_SPOOL_H
+#define EPMON_SPOOL_H
+
+#include <chrono>
+#include <deque>
+#include <string>
+#include <vector>
+#include <spdlog/spdlog.h>
+#include "monitor_options.h"
+
+class Spool {
+public:
+    // A place in the spool: a segment and an offset in it.
+    struct position {
+        unsigned long long seq;
+        size_t offset;
+    };
+
+
+    explicit Spool(std::string dir);
+    ~Spool();
+    Spool(const Spool &) = delete;
+    Spool &operator=(const Spool &) = delete;
+
+    // Find the segments left by an earlier run. Returns false if the spool directory
+    // can't be used, in which case nothing gets spooled.
+    bool open();
+    // Set the most the spool may hold on disk. Zero turns spooling off, though anything
+    // already spooled is still replayed.
+    void set_max_bytes(size_t max_bytes);
+    bool enabled() const { return usable && max_bytes > 0; }
+    bool empty() const { return segments.empty() || (segments.size() == 1 && cursor_offset >= segments.front().size); }
+
+    // Add a report in the given format to the end of the spool.
+    bool append(const std::string &body, results_format format);
+    // fsync the current segment if there are appends that haven't been synced, and
+    // enough of them or enough time has passed. force syncs them regardless.
+    void sync(bool force);
+    // Read the oldest reports, up to max_bytes worth (but always at least one), all in
+    // the same format. They stay in the spool until commit_batch() is called.
+    size_t read_batch(size_t max_bytes, std::vector<std::string> &records, results_format &format);
+    // Read the batch after the last one read, to have several on their way at once.
+    size_t read_next_batch(size_t max_bytes, std::vector<std::string> &records, results_format &format);
+    // Where the last batch read ends.
+    position batch_end() const { return { batch_seq, batch_offset }; }
+    // Consume everything up to the end of the last batch read, or up to end.
+    void commit_batch() { commit_to(batch_end()); }
+    void commit_to(position end);
+
+    // On-disk bytes, and bytes thrown away to stay under the limit.
+    size_t size_bytes() const { return total_bytes; }
+    unsigned long long evicted_bytes() const { return evicted; }
+
+private:
+    // A segment file, named by its sequence number.
+    struct segment {
+        unsigned long long seq;
+        size_t size;
+    };
+
+    std::string spool_dir;
+    bool usable;
+    size_t max_bytes;
+    // The segments, oldest first. The last one is the one we append to.
+    std::deque<segment> segments;
+    size_t total_bytes;
+    unsigned long long evicted;
+    // The open descriptor of the segment we append to, or -1, and the number the next
+    // segment will get.
+    int append_fd;
+    unsigned long long next_seq;
+    // Appends since the last fsync, and when that was.
+    unsigned int unsynced;
+    std::chrono::steady_clock::time_point last_sync;
+    // Where replay has got to in the oldest segment, and where the batch read by
+    // read_batch() ends.
+    size_t cursor_offset;
+    unsigned long long batch_seq;
+    size_t batch_offset;
+    // The logger.
+    std::shared_ptr<spdlog::logger> logger;
+
+    std::string segment_path(unsigned long long seq) const;
+    bool start_segment();
+    void evict_oldest();
+    size_t read_from(position start, size_t max_bytes, std::vector<std::string> &records, results_format &format);
+    void save_cursor();
+};
+
+#endif //EPMON_SPOOL_H
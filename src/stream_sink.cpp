@@ -0,0 +1,304 @@
+// stream_sink.cpp
+// This file implements the StreamSink class, the results sink (see results_sink.cpp) for
+// destinations that aren't HTTP:
+//   file:PATH        each report is appended to the file as a line, which makes an NDJSON
+//                    file when the format is JSON
+//   udp://HOST:PORT  each report is sent as one datagram
+//   unix:PATH        each report is written to a Unix domain stream socket as a line,
+//                    for a sidecar listening there
+// (file:///PATH and unix:///PATH work too.) A JSON report never has a newline in it, so
+// the newline after each one is all a reader needs to split them. CBOR and MessagePack
+// reports are written one after the other with no separator, since each one says how
+// long it is. OTLP requests are JSON text too, so they get a newline.
+// Like the ResultsSender, a StreamSink has its own bounded queue and its own thread, so
+// a slow file system or a stuck sidecar only backs up its own queue. The queue follows
+// the configured overflow policy, except that block is treated as drop_oldest: a local
+// output isn't worth holding up the Monitor, and the other sinks, for.
+// If the file or socket can't be opened, or a write fails, the descriptor is closed and
+// the sink waits STREAM_RETRY_MIN_MS before trying again, doubling the wait after each
+// failure up to STREAM_RETRY_MAX_MS. The report stays at the front of the queue in the
+// meantime, and is only counted as failed if it's given up on. A write to a file that
+// fails partway (the disk filled up, say) is cut back off the end of the file first, so
+// the retry doesn't leave a torn line in front of the whole report. A datagram that can't be sent is just counted: UDP doesn't promise delivery
+// anyway, and a report too big for a datagram never will be.
+// What It Doesn't Do
+// Reports are sent one at a time; there's no batching, compression or spool. The file
+// isn't rotated, and isn't reopened if something else renames it.
+// Testing
+// nc -lu PORT, or nc -lU PATH, shows the reports as they arrive.
+
+#include "stream_sink.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// The shortest and longest waits before trying a failed destination again.
+#define STREAM_RETRY_MIN_MS     1000
+#define STREAM_RETRY_MAX_MS     60000
+
+// An anonymous namespace for functions that don't need to be in the StreamSink class itself.
+namespace {
+    // Strip the scheme from a destination that starts with it, and the // after it, if
+    // there is one.
+    bool strip_scheme(const std::string &dest, const char *scheme, std::string &rest)
+    {
+        size_t len = strlen(scheme);
+        if (dest.compare(0, len, scheme) != 0)
+            return false;
+        rest = dest.substr(len);
+        if (rest.compare(0, 2, "//") == 0)
+            rest.erase(0, 2);
+        return !rest.empty();
+    }
+
+    // Write all of the iovecs, however many writes it takes. Sockets use sendmsg() so a
+    // closed socket gives us EPIPE instead of a SIGPIPE.
+    bool write_all(int fd, struct iovec *iov, int iovcnt, bool is_socket)
+    {
+        while (iovcnt > 0) {
+            ssize_t nwritten;
+            if (is_socket) {
+                struct msghdr msg = {};
+                msg.msg_iov = iov;
+                msg.msg_iovlen = iovcnt;
+                nwritten = sendmsg(fd, &msg, MSG_NOSIGNAL);
+            }
+            else
+                nwritten = writev(fd, iov, iovcnt);
+            if (nwritten < 0) {
+                if (errno == EINTR)
+                    continue;
+                return false;
+            }
+            while (iovcnt > 0 && (size_t) nwritten >= iov->iov_len) {
+                nwritten -= iov->iov_len;
+                iov++;
+                iovcnt--;
+            }
+            if (iovcnt > 0) {
+                iov->iov_base = (char *) iov->iov_base + nwritten;
+                iov->iov_len -= nwritten;
+            }
+        }
+        return true;
+    }
+}
+
+bool split_host_port(const std::string &dest, std::string &host, std::string &port)
+{
+    size_t colon = dest.rfind(':');
+    if (colon == std::string::npos || colon == 0 || colon + 1 >= dest.size())
+        return false;
+    host = dest.substr(0, colon);
+    port = dest.substr(colon + 1);
+    if (host.size() > 2 && host.front() == '[' && host.back() == ']')
+        host = host.substr(1, host.size() - 2);
+    return true;
+}
+
+// The host is looked up again every time, in case it has moved.
+int connect_udp(const std::string &host, const std::string &port, std::string &error)
+{
+    struct addrinfo hints = {};
+    struct addrinfo *addrs = nullptr;
+    int fd = -1;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    int ret = getaddrinfo(host.c_str(), port.c_str(), &hints, &addrs);
+    if (ret != 0) {
+        error = gai_strerror(ret);
+        return -1;
+    }
+    for (struct addrinfo *ai = addrs; ai && fd < 0; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+        if (fd >= 0 && connect(fd, ai->ai_addr, ai->ai_addrlen) < 0) {
+            error = strerror(errno);
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(addrs);
+    return fd;
+}
+
+// The constructor only parses the destination. Nothing is opened until the thread is
+// running.
+StreamSink::StreamSink(std::string dest)
+    : ResultsSink(std::move(dest)), kind(sink_kind::none), capacity(SENDER_QUEUE_SIZE_DEFAULT),
+      overflow(sender_overflow::drop_oldest), fd(-1), retry_delay(STREAM_RETRY_MIN_MS)
+{
+    // Get the shared logger pointer.
+    logger = spdlog::get("epmon");
+    counters.capacity = capacity;
+    std::string rest;
+    if (strip_scheme(destination, "file:", rest)) {
+        kind = sink_kind::file;
+        path = rest;
+    }
+    else if (strip_scheme(destination, "unix:", rest)) {
+        if (rest.size() < sizeof(((struct sockaddr_un *) nullptr)->sun_path)) {
+            kind = sink_kind::unix_socket;
+            path = rest;
+        }
+    }
+    else if (strip_scheme(destination, "udp:", rest)) {
+        if (split_host_port(rest, path, port))
+            kind = sink_kind::udp;
+    }
+    if (kind == sink_kind::none)
+        logger->error("StreamSink: can't use destination {0}", destination);
+}
+
+StreamSink::~StreamSink()
+{
+    close_destination();
+}
+
+void StreamSink::configure(const Monitor_options &options)
+{
+    std::lock_guard<std::mutex> lck { queue_lock };
+    capacity = options.sender_queue_size;
+    counters.capacity = capacity;
+    overflow = options.sender_overflow_policy;
+}
+
+void StreamSink::enqueue(std::shared_ptr<const results_report> report)
+{
+    std::unique_lock<std::mutex> lck { queue_lock };
+
+    if (queue.size() >= capacity) {
+        if (overflow == sender_overflow::coalesce) {
+            queue.back() = std::move(report);
+            counters.coalesced++;
+            counters.enqueued++;
+            return;
+        }
+        while (queue.size() >= capacity) {
+            queue.pop_front();
+            counters.dropped++;
+        }
+    }
+    queue.push_back(std::move(report));
+    counters.enqueued++;
+    counters.depth = queue.size();
+    lck.unlock();
+    not_empty.notify_one();
+}
+
+sender_stats StreamSink::stats()
+{
+    std::lock_guard<std::mutex> lck { queue_lock };
+    counters.depth = queue.size();
+    return counters;
+}
+
+bool StreamSink::open_destination()
+{
+    if (kind == sink_kind::file) {
+        fd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (fd < 0)
+            logger->error("StreamSink: can't open {0}: {1}", path, strerror(errno));
+        return fd >= 0;
+    }
+    if (kind == sink_kind::unix_socket) {
+        struct sockaddr_un addr = {};
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd >= 0 && connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+            logger->error("StreamSink: can't connect to {0}: {1}", path, strerror(errno));
+            close_destination();
+        }
+        return fd >= 0;
+    }
+    std::string error;
+    fd = connect_udp(path, port, error);
+    if (fd < 0)
+        logger->error("StreamSink: can't connect to {0}: {1}", destination, error);
+    return fd >= 0;
+}
+
+void StreamSink::close_destination()
+{
+    if (fd >= 0)
+        close(fd);
+    fd = -1;
+}
+
+// Write one report. Returns false if it wasn't written, with retry set if it's worth
+// trying again once the destination has been reopened.
+bool StreamSink::write_report(const results_report &report, bool &retry)
+{
+    static const char newline = '\n';
+    struct iovec iov[2];
+
+    retry = false;
+    if (kind == sink_kind::udp) {
+        if (send(fd, report.body.data(), report.body.size(), MSG_NOSIGNAL) == (ssize_t) report.body.size())
+            return true;
+        logger->warn("StreamSink: {0} byte datagram to {1} failed: {2}", report.body.size(), destination,
+                     strerror(errno));
+        return false;
+    }
+    iov[0].iov_base = (void *) report.body.data();
+    iov[0].iov_len = report.body.size();
+    iov[1].iov_base = (void *) &newline;
+    iov[1].iov_len = 1;
+    bool text = report.format == results_format::json || report.format == results_format::otlp;
+    int iovcnt = text ? 2 : 1;
+    // Appends always go at the end, so that's where this report starts.
+    off_t start = kind == sink_kind::file ? lseek(fd, 0, SEEK_END) : -1;
+    if (write_all(fd, iov, iovcnt, kind == sink_kind::unix_socket))
+        return true;
+    logger->error("StreamSink: write to {0} failed: {1}", destination, strerror(errno));
+    if (start >= 0 && ftruncate(fd, start) < 0)
+        logger->error("StreamSink: can't cut the partial report off {0}: {1}", path, strerror(errno));
+    retry = true;
+    return false;
+}
+
+// This is the thread function. It runs forever, writing the report at the front of the
+// queue whenever there is one and we're not waiting to retry. The queue is only locked
+// while we look at it, never while we write.
+void StreamSink::send_loop()
+{
+    logger->info("begin StreamSink::send_loop for {0}", destination);
+    retry_at = std::chrono::steady_clock::now();
+    std::unique_lock<std::mutex> lck { queue_lock };
+    while(true) {
+        not_empty.wait(lck, [this] { return !queue.empty(); });
+        if (std::chrono::steady_clock::now() < retry_at) {
+            not_empty.wait_until(lck, retry_at);
+            continue;
+        }
+        std::shared_ptr<const results_report> report = queue.front();
+        lck.unlock();
+        bool retry = false;
+        bool ok = (fd >= 0 || open_destination()) && write_report(*report, retry);
+        if (fd < 0)
+            retry = true;
+        if (!ok && retry) {
+            close_destination();
+            retry_at = std::chrono::steady_clock::now() + retry_delay;
+            retry_delay = std::min(retry_delay * 2, std::chrono::milliseconds(STREAM_RETRY_MAX_MS));
+        }
+        else
+            retry_delay = std::chrono::milliseconds(STREAM_RETRY_MIN_MS);
+        lck.lock();
+        if (ok)
+            counters.sent++;
+        else if (!retry)
+            counters.failed++;
+        // Unless it's to be tried again, take the report off the queue, if the overflow
+        // policy hasn't already.
+        if ((ok || !retry) && !queue.empty() && queue.front() == report)
+            queue.pop_front();
+        counters.depth = queue.size();
+    }
+}
@@ -0,0 +1,73 @@
+// stream_sink.h
+// This file defines the StreamSink class. See stream_sink.cpp for more information.
+
+#ifndef EPMON_STREAM_SINK_H
+#define EPMON_STREAM_SINK_H
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <spdlog/spdlog.h>
+#include "results_sink.h"
+
+class StreamSink : public ResultsSink {
+public:
+    // dest is file:PATH, udp://HOST:PORT or unix:PATH.
+    explicit StreamSink(std::string dest);
+    ~StreamSink() override;
+    StreamSink(const StreamSink &) = delete;
+    StreamSink &operator=(const StreamSink &) = delete;
+
+    // False if the destination couldn't be parsed.
+    bool valid() const { return kind != sink_kind::none; }
+
+    std::thread run() override { return std::thread([this] { this->send_loop(); }); }
+    // Pick up the queue size and overflow policy.
+    void configure(const Monitor_options &options) override;
+    void enqueue(std::shared_ptr<const results_report> report) override;
+    sender_stats stats() override;
+
+private:
+    enum class sink_kind {
+        none,
+        file,
+        udp,
+        unix_socket
+    };
+
+    sink_kind kind;
+    // The file or socket path, or the UDP host and port.
+    std::string path;
+    std::string port;
+    // The queue and what to do when it's full, protected by queue_lock.
+    std::deque<std::shared_ptr<const results_report>> queue;
+    size_t capacity;
+    sender_overflow overflow;
+    sender_stats counters;
+    std::mutex queue_lock;
+    std::condition_variable not_empty;
+    // The logger.
+    std::shared_ptr<spdlog::logger> logger;
+    // The open file or socket, or -1. Only used by the sender thread.
+    int fd;
+    // After a failure, how long to wait before trying again, and when that is. Only used
+    // by the sender thread.
+    std::chrono::milliseconds retry_delay;
+    std::chrono::steady_clock::time_point retry_at;
+
+    bool open_destination();
+    void close_destination();
+    bool write_report(const results_report &report, bool &retry);
+    void send_loop();
+};
+
+// Split HOST:PORT, or [HOST]:PORT for an IPv6 address. Returns false if it isn't either.
+bool split_host_port(const std::string &dest, std::string &host, std::string &port);
+// Make a UDP socket connected to host and port, or return -1 and set error.
+int connect_udp(const std::string &host, const std::string &port, std::string &error);
+
+#endif //EPMON_STREAM_SINK_H
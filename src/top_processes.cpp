@@ -0,0 +1,91 @@
+// top_processes.cpp
+// This file implements the TopProcesses class, which answers "what are the N hungriest
+// processes on this box right now" without a blocking sample window and without keeping
+// or sorting a result for every process.
+// Instead of sampling every process twice, a second apart, we keep the CPU ticks each
+// process had in the previous round and measure against those, so the usage covers the
+// whole monitor interval. That cache is one small fixed-size record per live process,
+// kept in a sorted vector whose storage is reused from round to round. The selection
+// itself uses two min-heaps of at most N entries, one keyed by CPU and one by RSS: each
+// process is compared against the smallest of the current top N and only replaces it if
+// it's bigger. So the results take O(N) memory and the selection O(P log N) time, however
+// many processes there are.
+// A PID that was reused since the previous round is recognized by its start time and
+// treated as a new process.
+
+#include "top_processes.h"
+#include <algorithm>
+#include <cstring>
+
+// An anonymous namespace for functions that don't need to be in the TopProcesses class itself.
+namespace {
+    // Heap ordering that keeps the smallest value at the front.
+    bool greater_cpu(const top_entry &a, const top_entry &b) { return a.pcpu > b.pcpu; }
+    bool greater_rss(const top_entry &a, const top_entry &b) { return a.rss > b.rss; }
+
+    // Offer an entry to a heap of at most n entries.
+    void offer(std::vector<top_entry> &heap, size_t n, const top_entry &entry,
+               bool (*greater)(const top_entry &, const top_entry &))
+    {
+        if (heap.size() < n) {
+            heap.push_back(entry);
+            std::push_heap(heap.begin(), heap.end(), greater);
+        }
+        else if (greater(entry, heap.front())) {
+            std::pop_heap(heap.begin(), heap.end(), greater);
+            heap.back() = entry;
+            std::push_heap(heap.begin(), heap.end(), greater);
+        }
+    }
+}
+
+void TopProcesses::rank(const sample_round &round, size_t n, std::vector<top_entry> &by_cpu,
+                        std::vector<top_entry> &by_rss)
+{
+    by_cpu.clear();
+    by_rss.clear();
+    current.clear();
+    if (n == 0)
+        return;
+    by_cpu.reserve(n);
+    by_rss.reserve(n);
+    bool have_last = !last.empty() && round.cpu_total_time > last_cpu_total_time;
+    double total_time_diff = (double) (round.cpu_total_time - last_cpu_total_time);
+
+    for (auto &ps : round.procs) {
+        if (!ps.valid)
+            continue;
+        top_entry entry;
+        entry.pid = ps.pid;
+        memcpy(entry.comm, ps.stat.comm, sizeof(entry.comm));
+        entry.vsize = ps.stat.vsize;
+        entry.rss = ps.stat.rss;
+        entry.pcpu = 0.0;
+        long unsigned int ticks = ps.stat.utime_ticks + ps.stat.stime_ticks
+                                  + ps.stat.cutime_ticks + ps.stat.cstime_ticks;
+        current.push_back({ ps.pid, ps.stat.starttime, ticks });
+
+        bool have_cpu = false;
+        if (have_last) {
+            last_ticks key = { ps.pid, 0, 0 };
+            auto it = std::lower_bound(last.begin(), last.end(), key,
+                                       [](const last_ticks &a, const last_ticks &b) { return a.pid < b.pid; });
+            if (it != last.end() && it->pid == ps.pid && it->starttime == ps.stat.starttime && ticks >= it->ticks) {
+                entry.pcpu = 100.0 * (double) (ticks - it->ticks) / total_time_diff;
+                have_cpu = true;
+            }
+        }
+        offer(by_rss, n, entry, greater_rss);
+        if (have_cpu)
+            offer(by_cpu, n, entry, greater_cpu);
+    }
+    // Sorting the heaps with the "greater" ordering leaves them highest first.
+    std::sort_heap(by_cpu.begin(), by_cpu.end(), greater_cpu);
+    std::sort_heap(by_rss.begin(), by_rss.end(), greater_rss);
+
+    // The /proc walk is in directory order, which isn't always PID order.
+    std::sort(current.begin(), current.end(),
+              [](const last_ticks &a, const last_ticks &b) { return a.pid < b.pid; });
+    last.swap(current);
+    last_cpu_total_time = round.cpu_total_time;
+}
@@ -0,0 +1,45 @@
+// top_processes.h
+// This file defines the TopProcesses class. See top_processes.cpp for more information.
+
+#ifndef EPMON_TOP_PROCESSES_H
+#define EPMON_TOP_PROCESSES_H
+
+#include <vector>
+#include "collector.h"
+
+// One of the top processes.
+struct top_entry {
+    pid_t pid;
+    char comm[16];
+    // User plus system CPU since the previous round, as a percentage of total CPU time.
+    double pcpu;
+    // Virtual memory size and Resident Set Size, in bytes.
+    long unsigned int vsize;
+    long unsigned int rss;
+};
+
+class TopProcesses {
+public:
+    TopProcesses() = default;
+    ~TopProcesses() = default;     // Nothing to clean up.
+
+    // Pick the n processes in the round with the highest CPU usage and the n with the
+    // highest RSS, each sorted highest first. CPU usage is measured against the previous
+    // call, so the first call only fills in by_rss.
+    void rank(const sample_round &round, size_t n, std::vector<top_entry> &by_cpu, std::vector<top_entry> &by_rss);
+
+private:
+    // The CPU ticks of a process in the previous round, sorted by PID.
+    struct last_ticks {
+        pid_t pid;
+        long long unsigned int starttime;
+        long unsigned int ticks;
+    };
+    std::vector<last_ticks> last;
+    // The round being built; swapped with last at the end of each call so the storage
+    // is reused.
+    std::vector<last_ticks> current;
+    long unsigned int last_cpu_total_time = 0;
+};
+
+#endif //EPMON_TOP_PROCESSES_H